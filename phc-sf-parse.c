@@ -2,7 +2,7 @@
  * Example code for a decoder and encoder of "hash strings", with Argon2i
  * parameters.
  *
- * This code comprises three sections:
+ * This code comprises five sections:
  *
  *   -- The first section contains generic Base64 encoding and decoding
  *   functions. It is conceptually applicable to any hash function
@@ -15,10 +15,24 @@
  *   the parameters, salts and outputs. It does not compute the hash
  *   itself.
  *
- *   -- The third section is test code, with a main() function. With
+ *   -- The third section builds on the second one to process large
+ *   dumps of hash strings (one per line), possibly with several
+ *   threads.
+ *
+ *   -- The fourth section computes Argon2 hashes (RFC 9106), with
+ *   parameters and output held in the structure used by the encoder
+ *   and decoder.
+ *
+ *   -- The fifth section is test code, with a main() function. With
  *   this section, the whole file compiles as a stand-alone program
  *   that exercises the encoding and decoding functions with some
- *   test vectors.
+ *   test vectors. When invoked with "bench" as first argument, the
+ *   program runs some benchmarks instead; the other modes process files
+ *   of hash strings: "scan" validates and summarizes a file, "stats"
+ *   counts its Argon2 strings per parameter tuple, "salts" reports
+ *   reused and short salts, "export" writes the valid Argon2i strings
+ *   as CSV or JSON lines, and "diff" compares two files of key:hash
+ *   lines (see usage() for the options).
  *
  * The code was originally written by Thomas Pornin <pornin@bolet.org>,
  * to whom comments and remarks may be sent. It is released under what
@@ -36,10 +50,124 @@
  * Copyright (c) 2015 Thomas Pornin
  */
 
+/*
+ * On Linux, _GNU_SOURCE exposes the POSIX and Linux-specific functions
+ * used by the bulk processing code, even in strict C standard modes.
+ */
+#if defined __linux__ && !defined _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * PHC_SF_THREADS: when non-zero, bulk processing functions use POSIX
+ * threads. This defaults to 1 on Unix-like systems; on other systems,
+ * or when compiled with -DPHC_SF_THREADS=0, all work runs on the
+ * calling thread.
+ */
+#ifndef PHC_SF_THREADS
+#if defined __unix__ || defined __APPLE__
+#define PHC_SF_THREADS   1
+#else
+#define PHC_SF_THREADS   0
+#endif
+#endif
+
+#if PHC_SF_THREADS
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#endif
+
+/*
+ * PHC_SF_MMAP: when non-zero, the dump scanner memory-maps its input
+ * file; otherwise, the file is read into an allocated buffer. This
+ * defaults to 1 on Unix-like systems.
+ */
+#ifndef PHC_SF_MMAP
+#if defined __unix__ || defined __APPLE__
+#define PHC_SF_MMAP   1
+#else
+#define PHC_SF_MMAP   0
+#endif
+#endif
+
+#if PHC_SF_MMAP
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+/*
+ * PHC_SF_URING: when non-zero, the streaming reader uses io_uring, with
+ * the raw system calls (liburing is not required), to keep several
+ * reads in flight; if the kernel does not support it, pread() is used
+ * instead. This defaults to 1 on Linux with GCC or Clang (the rings
+ * are accessed with their atomic builtins). It requires PHC_SF_MMAP.
+ */
+#ifndef PHC_SF_URING
+#if defined __linux__ && PHC_SF_MMAP \
+	&& (defined __GNUC__ || defined __clang__)
+#define PHC_SF_URING   1
+#else
+#define PHC_SF_URING   0
+#endif
+#endif
+
+#if PHC_SF_URING
+#if !PHC_SF_MMAP
+#error PHC_SF_URING requires PHC_SF_MMAP
+#endif
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+
+/*
+ * PHC_SF_AVX2: when non-zero, the Argon2 compression function also has
+ * an AVX2 implementation, used if the CPU supports it (this is checked
+ * at runtime). This defaults to 1 with GCC and Clang on x86.
+ */
+#ifndef PHC_SF_AVX2
+#if (defined __GNUC__ && __GNUC__ >= 5 || defined __clang__) \
+	&& (defined __x86_64__ || defined __i386__)
+#define PHC_SF_AVX2   1
+#else
+#define PHC_SF_AVX2   0
+#endif
+#endif
+
+#if PHC_SF_AVX2
+#include <immintrin.h>
+#endif
+
+/*
+ * PHC_SF_PERF: when non-zero, benchmarks also report hardware cache
+ * misses, read with perf_event_open() (if the kernel allows it). This
+ * defaults to 1 on Linux.
+ */
+#ifndef PHC_SF_PERF
+#if defined __linux__
+#define PHC_SF_PERF   1
+#else
+#define PHC_SF_PERF   0
+#endif
+#endif
+
+#if PHC_SF_PERF
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 /* ==================================================================== */
 /*
@@ -53,6 +181,17 @@
  * interoperability issues to deal with.
  */
 
+/*
+ * Prefetch the cache line containing address p (a hint only; this is a
+ * no-op on compilers that lack the relevant intrinsic). The address need
+ * not be valid.
+ */
+#if defined __GNUC__ || defined __clang__
+#define PREFETCH(p)   __builtin_prefetch(p)
+#else
+#define PREFETCH(p)   ((void)(p))
+#endif
+
 /*
  * Some macros for constant-time comparisons. These work over values in
  * the 0..255 range. Returned value is 0x00 on "false", 0xFF on "true".
@@ -92,19 +231,13 @@ b64_char_to_byte(int c)
 }
 
 /*
- * Convert some bytes to Base64. 'dst_len' is the length (in characters)
- * of the output buffer 'dst'; if that buffer is not large enough to
- * receive the result (including the terminating 0), then (size_t)-1
- * is returned. Otherwise, the zero-terminated Base64 string is written
- * in the buffer, and the output length (counted WITHOUT the terminating
- * zero) is returned.
+ * Get the length (in characters) of the Base64 encoding of 'src_len'
+ * bytes (without padding, and not counting any terminating zero).
  */
 static size_t
-to_base64(char *dst, size_t dst_len, const void *src, size_t src_len)
+b64_length(size_t src_len)
 {
 	size_t olen;
-	const unsigned char *buf;
-	unsigned acc, acc_len;
 
 	olen = (src_len / 3) << 2;
 	switch (src_len % 3) {
@@ -115,6 +248,25 @@ to_base64(char *dst, size_t dst_len, const void *src, size_t src_len)
 		olen += 2;
 		break;
 	}
+	return olen;
+}
+
+/*
+ * Convert some bytes to Base64. 'dst_len' is the length (in characters)
+ * of the output buffer 'dst'; if that buffer is not large enough to
+ * receive the result (including the terminating 0), then (size_t)-1
+ * is returned. Otherwise, the zero-terminated Base64 string is written
+ * in the buffer, and the output length (counted WITHOUT the terminating
+ * zero) is returned.
+ */
+static size_t
+to_base64(char *dst, size_t dst_len, const void *src, size_t src_len)
+{
+	size_t olen;
+	const unsigned char *buf;
+	unsigned acc, acc_len;
+
+	olen = b64_length(src_len);
 	if (dst_len <= olen) {
 		return (size_t)-1;
 	}
@@ -142,15 +294,17 @@ to_base64(char *dst, size_t dst_len, const void *src, size_t src_len)
  * ends, the actual number of decoded bytes is written back in
  * '*dst_len'.
  *
- * Decoding stops when a non-Base64 character is encountered, or when
- * the output buffer capacity is exceeded. If an error occurred (output
- * buffer is too small, invalid last characters leading to unprocessed
- * buffered bits), then NULL is returned; otherwise, the returned value
- * points to the first non-Base64 character in the source stream, which
- * may be the terminating zero.
+ * Decoding stops when a non-Base64 character is encountered, when the
+ * end of the source ('end', which points just after the last character
+ * that may be read) is reached, or when the output buffer capacity is
+ * exceeded. If an error occurred (output buffer is too small, invalid
+ * last characters leading to unprocessed buffered bits), then NULL is
+ * returned; otherwise, the returned value points to the first
+ * non-Base64 character in the source stream (which may be the
+ * terminating zero), or is equal to 'end'.
  */
 static const char *
-from_base64(void *dst, size_t *dst_len, const char *src)
+from_base64(void *dst, size_t *dst_len, const char *src, const char *end)
 {
 	size_t len;
 	unsigned char *buf;
@@ -160,7 +314,7 @@ from_base64(void *dst, size_t *dst_len, const char *src)
 	len = 0;
 	acc = 0;
 	acc_len = 0;
-	for (;;) {
+	while (src < end) {
 		unsigned d;
 
 		d = b64_char_to_byte(*src);
@@ -192,22 +346,183 @@ from_base64(void *dst, size_t *dst_len, const char *src)
 	return src;
 }
 
+/*
+ * Encode integer 'x' in decimal into 'dst'. 'dst_len' is the length (in
+ * characters) of the output buffer; if it is not large enough to receive
+ * the result (including the terminating 0), then (size_t)-1 is returned.
+ * Otherwise, the zero-terminated string is written and its length
+ * (WITHOUT the terminating zero) is returned. This is used instead of
+ * sprintf(), which is needlessly slow for that simple task.
+ */
+static size_t
+encode_decimal(char *dst, size_t dst_len, unsigned long x)
+{
+	char tmp[3 * sizeof(unsigned long)];
+	size_t len, u;
+
+	len = 0;
+	do {
+		tmp[len ++] = '0' + (int)(x % 10);
+		x /= 10;
+	} while (x > 0);
+	if (dst_len <= len) {
+		return (size_t)-1;
+	}
+	for (u = 0; u < len; u ++) {
+		dst[u] = tmp[len - 1 - u];
+	}
+	dst[len] = 0;
+	return len;
+}
+
+/*
+ * Little-endian encoding and decoding of 32-bit and 64-bit integers.
+ */
+static void
+enc32le(unsigned char *dst, uint32_t x)
+{
+	dst[0] = (unsigned char)x;
+	dst[1] = (unsigned char)(x >> 8);
+	dst[2] = (unsigned char)(x >> 16);
+	dst[3] = (unsigned char)(x >> 24);
+}
+
+static uint32_t
+dec32le(const unsigned char *src)
+{
+	return (uint32_t)src[0]
+		| ((uint32_t)src[1] << 8)
+		| ((uint32_t)src[2] << 16)
+		| ((uint32_t)src[3] << 24);
+}
+
+static void
+enc64le(unsigned char *dst, uint64_t x)
+{
+	enc32le(dst, (uint32_t)x);
+	enc32le(dst + 4, (uint32_t)(x >> 32));
+}
+
+static uint64_t
+dec64le(const unsigned char *src)
+{
+	return (uint64_t)dec32le(src) | ((uint64_t)dec32le(src + 4) << 32);
+}
+
+/*
+ * A growable output buffer ("arena"), used to accumulate many encoded
+ * strings back to back (e.g. for a bulk export to a file or a socket).
+ * Contents are NOT zero-terminated. An arena must be initialized with
+ * phc_arena_init() and released with phc_arena_free().
+ */
+typedef struct {
+	char *buf;
+	size_t len;
+	size_t cap;
+} phc_arena;
+
+void
+phc_arena_init(phc_arena *a)
+{
+	a->buf = NULL;
+	a->len = 0;
+	a->cap = 0;
+}
+
+void
+phc_arena_free(phc_arena *a)
+{
+	free(a->buf);
+	phc_arena_init(a);
+}
+
+/*
+ * Make sure that at least 'len' extra bytes can be appended to the
+ * arena without reallocation. Returned value is 1 on success, 0 on
+ * allocation failure. Since a reallocation moves the contents, this
+ * may also be used to keep pointers into the arena valid over a batch
+ * of appends of known maximum size.
+ */
+int
+phc_arena_reserve(phc_arena *a, size_t len)
+{
+	size_t ncap;
+	char *nbuf;
+
+	if (len <= a->cap - a->len) {
+		return 1;
+	}
+	if (len > ((size_t)-1 >> 1) - a->len) {
+		return 0;
+	}
+	ncap = a->cap < 256 ? 256 : a->cap;
+	while (ncap - a->len < len) {
+		ncap <<= 1;
+	}
+	nbuf = realloc(a->buf, ncap);
+	if (nbuf == NULL) {
+		return 0;
+	}
+	a->buf = nbuf;
+	a->cap = ncap;
+	return 1;
+}
+
+/*
+ * Append some bytes to the arena. Returned value is 1 on success, 0 on
+ * allocation failure.
+ */
+int
+phc_arena_append(phc_arena *a, const void *data, size_t len)
+{
+	if (!phc_arena_reserve(a, len)) {
+		return 0;
+	}
+	memcpy(a->buf + a->len, data, len);
+	a->len += len;
+	return 1;
+}
+
+/*
+ * Append '$' followed by the Base64 encoding of 'len' bytes to the
+ * arena; there must be enough reserved room for that and an extra
+ * byte (the to_base64() terminating zero, which is written but not
+ * counted in the arena length).
+ */
+static void
+arena_put_b64(phc_arena *a, const void *data, size_t len)
+{
+	a->buf[a->len ++] = '$';
+	a->len += to_base64(a->buf + a->len, a->cap - a->len, data, len);
+}
+
+/*
+ * A memory segment, for scatter/gather output. This has the same
+ * fields, in the same order, as the POSIX 'struct iovec', so an array
+ * of segments converts trivially to what writev() expects.
+ */
+typedef struct {
+	const void *base;
+	size_t len;
+} phc_segment;
+
 /*
  * Decode decimal integer from 'str'; the value is written in '*v'.
  * Returned value is a pointer to the next non-decimal character in the
- * string. If there is no digit at all, or the value encoding is not
- * minimal (extra leading zeros), or the value does not fit in an
- * 'unsigned long', then NULL is returned.
+ * string, or 'end' if the end of the string was reached. If there is no
+ * digit at all, or the value encoding is not minimal (extra leading
+ * zeros), or the value does not fit in an 'unsigned long', then NULL is
+ * returned.
  */
 static const char *
-decode_decimal(const char *str, unsigned long *v)
+decode_decimal(const char *str, const char *end, unsigned long *v)
 {
 	const char *orig;
 	unsigned long acc;
 
 	orig = str;
 	acc = 0;
-	for (orig = str;; str ++) {
+	for (orig = str; str < end; str ++) {
 		int c;
 
 		c = *str;
@@ -276,23 +591,102 @@ typedef struct {
 } argon2i_params;
 
 /*
- * Decode an Argon2i hash string into the provided structure 'pp'.
- * Returned value is 1 on success, 0 on error.
+ * Error codes for hash string decoding. ARGON2I_ERR_NUM is the number
+ * of codes (including ARGON2I_OK), e.g. for sizing a histogram.
+ */
+#define ARGON2I_OK              0   /* no error */
+#define ARGON2I_ERR_NAME        1   /* not an "argon2i" string */
+#define ARGON2I_ERR_SYNTAX      2   /* missing or misplaced separator */
+#define ARGON2I_ERR_DECIMAL     3   /* invalid decimal value */
+#define ARGON2I_ERR_RANGE       4   /* m, t or p out of allowed range */
+#define ARGON2I_ERR_BINARY      5   /* invalid or too long Base64 field */
+#define ARGON2I_ERR_LENGTH      6   /* salt or output too short */
+#define ARGON2I_ERR_TRAILING    7   /* extra characters after output */
+#define ARGON2I_ERR_COST        8   /* m, t or p above the cost ceiling */
+#define ARGON2I_ERR_NUM         9
+
+/*
+ * Get a short symbolic name for an error code.
+ */
+const char *
+argon2i_error_name(int err)
+{
+	static const char *const names[] = {
+		"ok", "name", "syntax", "decimal", "range",
+		"binary", "length", "trailing", "cost"
+	};
+
+	if (err < 0 || err >= ARGON2I_ERR_NUM) {
+		return "unknown";
+	}
+	return names[err];
+}
+
+/*
+ * Cost ceiling for decoded strings: maximum values for m (in kilobytes),
+ * t, m*t and p. A zero field means "no limit". A stored string is under
+ * the control of whoever could write into the database; without a
+ * ceiling, it may ask a verifier for up to 4 TiB of RAM and 2^32-1
+ * passes.
+ */
+typedef struct {
+	uint32_t max_m;
+	uint32_t max_t;
+	uint64_t max_mt;
+	uint32_t max_p;
+} argon2i_cost_limits;
+
+/*
+ * Check decoded parameters against a cost ceiling (which may be NULL).
+ * Returned value is ARGON2I_OK or ARGON2I_ERR_COST.
  */
 int
-argon2i_decode_string(argon2i_params *pp, const char *str)
+argon2i_check_cost(const argon2i_params *pp, const argon2i_cost_limits *lim)
 {
-#define CC(prefix)   do { \
-		size_t cc_len = strlen(prefix); \
-		if (strncmp(str, prefix, cc_len) != 0) { \
-			return 0; \
+	if (lim == NULL) {
+		return ARGON2I_OK;
+	}
+	if ((lim->max_m != 0 && pp->m > lim->max_m)
+		|| (lim->max_t != 0 && pp->t > lim->max_t)
+		|| (lim->max_p != 0 && pp->p > lim->max_p)
+		|| (lim->max_mt != 0
+		&& (uint64_t)pp->m * (uint64_t)pp->t > lim->max_mt))
+	{
+		return ARGON2I_ERR_COST;
+	}
+	return ARGON2I_OK;
+}
+
+/*
+ * Decode an Argon2i hash string, which consists of the characters from
+ * 'str' (inclusive) to 'end' (exclusive), into the provided structure
+ * 'pp'. Returned value is ARGON2I_OK on success, or an error code. If
+ * 'lim' is not NULL, parameters above that cost ceiling are rejected
+ * with ARGON2I_ERR_COST as soon as p has been parsed.
+ *
+ * Literal prefixes are compared with memcmp() over their known lengths
+ * (computed at compile time), with an explicit bound check against
+ * 'end'; the string does not need to be zero-terminated.
+ */
+static int
+decode_string_inner(argon2i_params *pp, const char *str, const char *end,
+	const argon2i_cost_limits *lim)
+{
+#define CC(prefix, err)   do { \
+		size_t cc_len = sizeof(prefix) - 1; \
+		if ((size_t)(end - str) < cc_len \
+			|| memcmp(str, prefix, cc_len) != 0) \
+		{ \
+			return (err); \
 		} \
 		str += cc_len; \
 	} while (0)
 
 #define CC_opt(prefix, code)   do { \
-		size_t cc_len = strlen(prefix); \
-		if (strncmp(str, prefix, cc_len) == 0) { \
+		size_t cc_len = sizeof(prefix) - 1; \
+		if ((size_t)(end - str) >= cc_len \
+			&& memcmp(str, prefix, cc_len) == 0) \
+		{ \
 			str += cc_len; \
 			{ code; } \
 		} \
@@ -300,18 +694,18 @@ argon2i_decode_string(argon2i_params *pp, const char *str)
 
 #define DECIMAL(x)   do { \
 		unsigned long dec_x; \
-		str = decode_decimal(str, &dec_x); \
+		str = decode_decimal(str, end, &dec_x); \
 		if (str == NULL) { \
-			return 0; \
+			return ARGON2I_ERR_DECIMAL; \
 		} \
 		(x) = dec_x; \
 	} while (0)
 
 #define BIN(buf, max_len, len)   do { \
 		size_t bin_len = (max_len); \
-		str = from_base64(buf, &bin_len, str); \
+		str = from_base64(buf, &bin_len, str, end); \
 		if (str == NULL) { \
-			return 0; \
+			return ARGON2I_ERR_BINARY; \
 		} \
 		(len) = bin_len; \
 	} while (0)
@@ -320,12 +714,15 @@ argon2i_decode_string(argon2i_params *pp, const char *str)
 	pp->associated_data_len = 0;
 	pp->salt_len = 0;
 	pp->output_len = 0;
-	CC("$argon2i");
-	CC("$m=");
+	CC("$argon2i", ARGON2I_ERR_NAME);
+	if (str < end && *str != '$') {
+		return ARGON2I_ERR_NAME;
+	}
+	CC("$m=", ARGON2I_ERR_SYNTAX);
 	DECIMAL(pp->m);
-	CC(",t=");
+	CC(",t=", ARGON2I_ERR_SYNTAX);
 	DECIMAL(pp->t);
-	CC(",p=");
+	CC(",p=", ARGON2I_ERR_SYNTAX);
 	DECIMAL(pp->p);
 
 	/*
@@ -335,10 +732,10 @@ argon2i_decode_string(argon2i_params *pp, const char *str)
 	 * on machines where 'unsigned long' is a 32-bit type.
 	 */
 	if (pp->m < 1 || (pp->m >> 30) > 3) {
-		return 0;
+		return ARGON2I_ERR_RANGE;
 	}
 	if (pp->t < 1 || (pp->t >> 30) > 3) {
-		return 0;
+		return ARGON2I_ERR_RANGE;
 	}
 
 	/*
@@ -347,32 +744,35 @@ argon2i_decode_string(argon2i_params *pp, const char *str)
 	 * the value of p.
 	 */
 	if (pp->p < 1 || pp->p > 255) {
-		return 0;
+		return ARGON2I_ERR_RANGE;
 	}
 	if (pp->m < (pp->p << 3)) {
-		return 0;
+		return ARGON2I_ERR_RANGE;
+	}
+	if (argon2i_check_cost(pp, lim) != ARGON2I_OK) {
+		return ARGON2I_ERR_COST;
 	}
 
 	CC_opt(",keyid=", BIN(pp->key_id, sizeof pp->key_id, pp->key_id_len));
 	CC_opt(",data=", BIN(pp->associated_data, sizeof pp->associated_data,
 		pp->associated_data_len));
-	if (*str == 0) {
-		return 1;
+	if (str == end) {
+		return ARGON2I_OK;
 	}
-	CC("$");
+	CC("$", ARGON2I_ERR_SYNTAX);
 	BIN(pp->salt, sizeof pp->salt, pp->salt_len);
 	if (pp->salt_len < 8) {
-		return 0;
+		return ARGON2I_ERR_LENGTH;
 	}
-	if (*str == 0) {
-		return 1;
+	if (str == end) {
+		return ARGON2I_OK;
 	}
-	CC("$");
+	CC("$", ARGON2I_ERR_SYNTAX);
 	BIN(pp->output, sizeof pp->output, pp->output_len);
 	if (pp->output_len < 12) {
-		return 0;
+		return ARGON2I_ERR_LENGTH;
 	}
-	return *str == 0;
+	return str == end ? ARGON2I_OK : ARGON2I_ERR_TRAILING;
 
 #undef CC
 #undef CC_opt
@@ -380,6 +780,54 @@ argon2i_decode_string(argon2i_params *pp, const char *str)
 #undef BIN
 }
 
+/*
+ * Decode an Argon2i hash string into the provided structure 'pp'.
+ * Returned value is 1 on success, 0 on error.
+ */
+int
+argon2i_decode_string(argon2i_params *pp, const char *str)
+{
+	return decode_string_inner(pp, str, str + strlen(str), NULL)
+		== ARGON2I_OK;
+}
+
+/*
+ * Decode an Argon2i hash string of explicit length 'len' (in characters)
+ * into the provided structure 'pp'. The string need not be
+ * zero-terminated (e.g. it may be a line within a larger buffer); a
+ * zero byte within the 'len' characters makes the string invalid.
+ * Returned value is 1 on success, 0 on error.
+ */
+int
+argon2i_decode_string_len(argon2i_params *pp, const char *str, size_t len)
+{
+	return decode_string_inner(pp, str, str + len, NULL) == ARGON2I_OK;
+}
+
+/*
+ * Same as argon2i_decode_string_len(), but the returned value is an
+ * error code (ARGON2I_OK on success) that tells why decoding failed.
+ */
+int
+argon2i_decode_string_err(argon2i_params *pp, const char *str, size_t len)
+{
+	return decode_string_inner(pp, str, str + len, NULL);
+}
+
+/*
+ * Same as argon2i_decode_string_err(), with the cost ceiling 'lim': a
+ * string with m, t, m*t or p above the ceiling is rejected with
+ * ARGON2I_ERR_COST, before its salt and output are decoded. A verifier
+ * should use this function on stored strings, so that no memory is
+ * allocated for a hostile string.
+ */
+int
+argon2i_decode_string_limits(argon2i_params *pp, const char *str, size_t len,
+	const argon2i_cost_limits *lim)
+{
+	return decode_string_inner(pp, str, str + len, lim);
+}
+
 /*
  * Encode an Argon2i hash string into the provided buffer. 'dst_len'
  * contains the size, in characters, of the 'dst' buffer; if 'dst_len'
@@ -406,9 +854,12 @@ argon2i_encode_string(char *dst, size_t dst_len, const argon2i_params *pp)
 	} while (0)
 
 #define SX(x)   do { \
-		char tmp[30]; \
-		sprintf(tmp, "%lu", (unsigned long)(x)); \
-		SS(tmp); \
+		size_t sx_len = encode_decimal(dst, dst_len, (x)); \
+		if (sx_len == (size_t)-1) { \
+			return 0; \
+		} \
+		dst += sx_len; \
+		dst_len -= sx_len; \
 	} while (0); \
 
 #define SB(buf, len)   do { \
@@ -451,108 +902,11168 @@ argon2i_encode_string(char *dst, size_t dst_len, const argon2i_params *pp)
 #undef SB
 }
 
-/* ==================================================================== */
 /*
- * Test code.
+ * A "compiled" Argon2i encoder. At registration time, all new hashes
+ * normally use the same parameters (m, t, p, keyid and data); only the
+ * salt and the output change. The encoder renders the parameter prefix
+ * of the hash string once; each subsequent encoding is then a plain
+ * copy of that prefix, followed by the Base64 encoding of the salt and
+ * of the output.
+ *
+ * The structure is not modified after argon2i_encoder_init(), hence it
+ * may be shared, read-only, between several threads.
  */
+typedef struct {
+	char prefix[128];
+	size_t prefix_len;
+} argon2i_encoder;
 
-static const char *KAT_GOOD[] = {
-	"$argon2i$m=120,t=5000,p=2",
-	"$argon2i$m=120,t=4294967295,p=2",
-	"$argon2i$m=2040,t=5000,p=255",
-	"$argon2i$m=120,t=5000,p=2,keyid=Hj5+dsK0",
-	"$argon2i$m=120,t=5000,p=2,keyid=Hj5+dsK0ZQ",
-	"$argon2i$m=120,t=5000,p=2,keyid=Hj5+dsK0ZQA",
-	"$argon2i$m=120,t=5000,p=2,data=sRlHhRmKUGzdOmXn01XmXygd5Kc",
-	"$argon2i$m=120,t=5000,p=2,keyid=Hj5+dsK0,data=sRlHhRmKUGzdOmXn01XmXygd5Kc",
-	"$argon2i$m=120,t=5000,p=2$/LtFjH5rVL8",
-	"$argon2i$m=120,t=5000,p=2$4fXXG0spB92WPB1NitT8/OH0VKI",
-	"$argon2i$m=120,t=5000,p=2$BwUgJHHQaynE+a4nZrYRzOllGSjjxuxNXxyNRUtI6Dlw/zlbt6PzOL8Onfqs6TcG",
-	"$argon2i$m=120,t=5000,p=2,keyid=Hj5+dsK0$4fXXG0spB92WPB1NitT8/OH0VKI",
-	"$argon2i$m=120,t=5000,p=2,data=sRlHhRmKUGzdOmXn01XmXygd5Kc$4fXXG0spB92WPB1NitT8/OH0VKI",
-	"$argon2i$m=120,t=5000,p=2,keyid=Hj5+dsK0,data=sRlHhRmKUGzdOmXn01XmXygd5Kc$4fXXG0spB92WPB1NitT8/OH0VKI",
-	"$argon2i$m=120,t=5000,p=2$4fXXG0spB92WPB1NitT8/OH0VKI$iPBVuORECm5biUsjq33hn9/7BKqy9aPWKhFfK2haEsM",
-	"$argon2i$m=120,t=5000,p=2,keyid=Hj5+dsK0$4fXXG0spB92WPB1NitT8/OH0VKI$iPBVuORECm5biUsjq33hn9/7BKqy9aPWKhFfK2haEsM",
-	"$argon2i$m=120,t=5000,p=2,data=sRlHhRmKUGzdOmXn01XmXygd5Kc$4fXXG0spB92WPB1NitT8/OH0VKI$iPBVuORECm5biUsjq33hn9/7BKqy9aPWKhFfK2haEsM",
-	"$argon2i$m=120,t=5000,p=2,keyid=Hj5+dsK0,data=sRlHhRmKUGzdOmXn01XmXygd5Kc$4fXXG0spB92WPB1NitT8/OH0VKI$iPBVuORECm5biUsjq33hn9/7BKqy9aPWKhFfK2haEsM",
-	"$argon2i$m=120,t=5000,p=2,keyid=Hj5+dsK0,data=sRlHhRmKUGzdOmXn01XmXygd5Kc$iHSDPHzUhPzK7rCcJgOFfg$EkCWX6pSTqWruiR0",
-	"$argon2i$m=120,t=5000,p=2,keyid=Hj5+dsK0,data=sRlHhRmKUGzdOmXn01XmXygd5Kc$iHSDPHzUhPzK7rCcJgOFfg$J4moa2MM0/6uf3HbY2Tf5Fux8JIBTwIhmhxGRbsY14qhTltQt+Vw3b7tcJNEbk8ium8AQfZeD4tabCnNqfkD1g",
-	NULL
-};
-
-static const char *KAT_BAD[] = {
-	/* bad function name */
-	"$argon2j$m=120,t=5000,p=2",
-
-	/* missing parameter 'm' */
-	"$argon2i$t=5000,p=2",
-
-	/* missing parameter 't' */
-	"$argon2i$m=120,p=2",
+/*
+ * Initialize an encoder with the parameters from 'pp'. The salt and
+ * output contained in 'pp' (if any) are ignored. Returned value is 1 on
+ * success, 0 on error (prefix too long, which cannot happen with
+ * values that argon2i_decode_string() would accept).
+ */
+int
+argon2i_encoder_init(argon2i_encoder *enc, const argon2i_params *pp)
+{
+	argon2i_params tmp;
 
-	/* missing parameter 'p' */
-	"$argon2i$m=120,t=5000",
+	tmp = *pp;
+	tmp.salt_len = 0;
+	tmp.output_len = 0;
+	if (!argon2i_encode_string(enc->prefix, sizeof enc->prefix, &tmp)) {
+		return 0;
+	}
+	enc->prefix_len = strlen(enc->prefix);
+	return 1;
+}
 
-	/* value of 'm' is too small (lower than 8*p) */
-	"$argon2i$m=15,t=5000,p=2",
+/*
+ * Encode a hash string with the encoder parameters, and the provided
+ * salt and output. Rules are the same as for argon2i_encode_string():
+ * the string is zero-terminated, an output length of 0 yields a salt
+ * string, and a salt length of 0 yields a parameter-only string.
+ * Returned value is 1 on success, 0 if 'dst_len' is too small.
+ */
+int
+argon2i_encoder_encode(const argon2i_encoder *enc, char *dst, size_t dst_len,
+	const void *salt, size_t salt_len, const void *output, size_t output_len)
+{
+	size_t len;
 
-	/* value of 't' is invalid */
+	if (dst_len <= enc->prefix_len) {
+		return 0;
+	}
+	memcpy(dst, enc->prefix, enc->prefix_len + 1);
+	dst += enc->prefix_len;
+	dst_len -= enc->prefix_len;
+	if (salt_len == 0) {
+		return 1;
+	}
+	if (dst_len <= 1) {
+		return 0;
+	}
+	*dst ++ = '$';
+	dst_len --;
+	len = to_base64(dst, dst_len, salt, salt_len);
+	if (len == (size_t)-1) {
+		return 0;
+	}
+	dst += len;
+	dst_len -= len;
+	if (output_len == 0) {
+		return 1;
+	}
+	if (dst_len <= 1) {
+		return 0;
+	}
+	*dst ++ = '$';
+	dst_len --;
+	return to_base64(dst, dst_len, output, output_len) != (size_t)-1;
+}
+
+/*
+ * Append a hash string to an arena, with the encoder parameters and the
+ * provided salt and output (same rules as argon2i_encoder_encode()). No
+ * terminating zero is added to the arena contents, so records may be
+ * appended back to back, with whatever separator the caller appends.
+ * Returned value is 1 on success, 0 on allocation failure (in which
+ * case the arena contents are unchanged).
+ */
+int
+argon2i_encoder_append(const argon2i_encoder *enc, phc_arena *a,
+	const void *salt, size_t salt_len, const void *output, size_t output_len)
+{
+	if (!phc_arena_reserve(a, enc->prefix_len
+		+ 2 + b64_length(salt_len) + b64_length(output_len) + 1))
+	{
+		return 0;
+	}
+	memcpy(a->buf + a->len, enc->prefix, enc->prefix_len);
+	a->len += enc->prefix_len;
+	if (salt_len == 0) {
+		return 1;
+	}
+	arena_put_b64(a, salt, salt_len);
+	if (output_len > 0) {
+		arena_put_b64(a, output, output_len);
+	}
+	return 1;
+}
+
+/*
+ * Scatter/gather variant of argon2i_encoder_append(): only the salt and
+ * output characters (each preceded by its '$' separator) are written
+ * into the arena; the shared parameter prefix is referenced directly
+ * from the encoder. Up to three segments are written into 'seg'
+ * (prefix, salt, output), and their number is returned; 0 is returned
+ * on allocation failure.
+ *
+ * The segments point into the encoder and into the arena buffer; the
+ * latter pointers are invalidated if the arena is later reallocated.
+ * To gather a whole batch of records before a single writev() call,
+ * reserve enough room in the arena beforehand with phc_arena_reserve().
+ */
+size_t
+argon2i_encoder_gather(const argon2i_encoder *enc, phc_arena *a,
+	phc_segment *seg,
+	const void *salt, size_t salt_len, const void *output, size_t output_len)
+{
+	size_t num, off;
+
+	if (!phc_arena_reserve(a,
+		2 + b64_length(salt_len) + b64_length(output_len) + 1))
+	{
+		return 0;
+	}
+	seg[0].base = enc->prefix;
+	seg[0].len = enc->prefix_len;
+	num = 1;
+	if (salt_len == 0) {
+		return num;
+	}
+	off = a->len;
+	arena_put_b64(a, salt, salt_len);
+	seg[num].base = a->buf + off;
+	seg[num].len = a->len - off;
+	num ++;
+	if (output_len > 0) {
+		off = a->len;
+		arena_put_b64(a, output, output_len);
+		seg[num].base = a->buf + off;
+		seg[num].len = a->len - off;
+		num ++;
+	}
+	return num;
+}
+
+/*
+ * A compact version of argon2i_params, for holding large numbers of
+ * decoded records in memory (bulk APIs use this type). The m and t
+ * parameters fit on 32 bits, p on 8 bits, and all binary lengths are
+ * at most 64, which allows for a structure of 168 bytes on common
+ * systems, instead of 208 for argon2i_params on 64-bit systems.
+ */
+typedef struct {
+	uint32_t m;
+	uint32_t t;
+	uint8_t p;
+	uint8_t key_id_len;
+	uint8_t associated_data_len;
+	uint8_t salt_len;
+	uint8_t output_len;
+	unsigned char key_id[8];
+	unsigned char associated_data[32];
+	unsigned char salt[48];
+	unsigned char output[64];
+} argon2i_packed;
+
+/*
+ * Convert an argon2i_params structure into the packed format. Returned
+ * value is 1 on success, 0 if a value does not fit (which cannot happen
+ * with a structure filled by argon2i_decode_string()).
+ */
+int
+argon2i_pack(argon2i_packed *dst, const argon2i_params *src)
+{
+	if ((src->m >> 30) > 3 || (src->t >> 30) > 3 || src->p > 255
+		|| src->key_id_len > sizeof dst->key_id
+		|| src->associated_data_len > sizeof dst->associated_data
+		|| src->salt_len > sizeof dst->salt
+		|| src->output_len > sizeof dst->output)
+	{
+		return 0;
+	}
+	dst->m = (uint32_t)src->m;
+	dst->t = (uint32_t)src->t;
+	dst->p = (uint8_t)src->p;
+	dst->key_id_len = (uint8_t)src->key_id_len;
+	dst->associated_data_len = (uint8_t)src->associated_data_len;
+	dst->salt_len = (uint8_t)src->salt_len;
+	dst->output_len = (uint8_t)src->output_len;
+	memcpy(dst->key_id, src->key_id, src->key_id_len);
+	memcpy(dst->associated_data, src->associated_data,
+		src->associated_data_len);
+	memcpy(dst->salt, src->salt, src->salt_len);
+	memcpy(dst->output, src->output, src->output_len);
+	return 1;
+}
+
+/*
+ * Convert a packed record back into an argon2i_params structure.
+ */
+void
+argon2i_unpack(argon2i_params *dst, const argon2i_packed *src)
+{
+	dst->m = src->m;
+	dst->t = src->t;
+	dst->p = src->p;
+	dst->key_id_len = src->key_id_len;
+	dst->associated_data_len = src->associated_data_len;
+	dst->salt_len = src->salt_len;
+	dst->output_len = src->output_len;
+	memcpy(dst->key_id, src->key_id, src->key_id_len);
+	memcpy(dst->associated_data, src->associated_data,
+		src->associated_data_len);
+	memcpy(dst->salt, src->salt, src->salt_len);
+	memcpy(dst->output, src->output, src->output_len);
+}
+
+/*
+ * Compact binary serialization of a single record ("blob"), e.g. for
+ * storage in a key-value store. The blob consists of a fixed 15-byte
+ * header:
+ *
+ *     0   variant (1 = Argon2i, following the Argon2 type numbering)
+ *     1   version (0: the string format has no version field)
+ *     2   m (32 bits, little-endian)
+ *     6   t (32 bits, little-endian)
+ *    10   p
+ *    11   keyid length
+ *    12   associated data length
+ *    13   salt length
+ *    14   output length
+ *
+ * followed by the raw keyid, associated data, salt and output bytes, in
+ * that order. Decoding applies the same value checks as
+ * argon2i_decode_string(), so that a decoded blob always encodes back
+ * to a valid, canonical hash string.
+ */
+
+#define ARGON2I_BLOB_HEADER_LEN   15
+#define ARGON2I_BLOB_MAX_LEN      (ARGON2I_BLOB_HEADER_LEN + 8 + 32 + 48 + 64)
+
+/*
+ * Encode a record as a blob into 'dst' (of size 'dst_len' bytes).
+ * Returned value is the blob length, or 0 if the buffer is too small
+ * or a value does not fit in the blob format.
+ */
+size_t
+argon2i_blob_encode(void *dst, size_t dst_len, const argon2i_params *pp)
+{
+	unsigned char *buf;
+	size_t len;
+
+	if ((pp->m >> 30) > 3 || (pp->t >> 30) > 3 || pp->p > 255
+		|| pp->key_id_len > sizeof pp->key_id
+		|| pp->associated_data_len > sizeof pp->associated_data
+		|| pp->salt_len > sizeof pp->salt
+		|| pp->output_len > sizeof pp->output)
+	{
+		return 0;
+	}
+	len = ARGON2I_BLOB_HEADER_LEN + pp->key_id_len
+		+ pp->associated_data_len + pp->salt_len + pp->output_len;
+	if (dst_len < len) {
+		return 0;
+	}
+	buf = dst;
+	buf[0] = 1;
+	buf[1] = 0;
+	enc32le(buf + 2, (uint32_t)pp->m);
+	enc32le(buf + 6, (uint32_t)pp->t);
+	buf[10] = (unsigned char)pp->p;
+	buf[11] = (unsigned char)pp->key_id_len;
+	buf[12] = (unsigned char)pp->associated_data_len;
+	buf[13] = (unsigned char)pp->salt_len;
+	buf[14] = (unsigned char)pp->output_len;
+	buf += ARGON2I_BLOB_HEADER_LEN;
+	memcpy(buf, pp->key_id, pp->key_id_len);
+	buf += pp->key_id_len;
+	memcpy(buf, pp->associated_data, pp->associated_data_len);
+	buf += pp->associated_data_len;
+	memcpy(buf, pp->salt, pp->salt_len);
+	buf += pp->salt_len;
+	memcpy(buf, pp->output, pp->output_len);
+	return len;
+}
+
+/*
+ * Decode a blob of exactly 'len' bytes. Returned value is 1 on success,
+ * 0 on error (truncated or oversized blob, unknown variant or version,
+ * invalid values).
+ */
+int
+argon2i_blob_decode(argon2i_params *pp, const void *src, size_t len)
+{
+	const unsigned char *buf;
+
+	buf = src;
+	if (len < ARGON2I_BLOB_HEADER_LEN || buf[0] != 1 || buf[1] != 0) {
+		return 0;
+	}
+	pp->m = dec32le(buf + 2);
+	pp->t = dec32le(buf + 6);
+	pp->p = buf[10];
+	pp->key_id_len = buf[11];
+	pp->associated_data_len = buf[12];
+	pp->salt_len = buf[13];
+	pp->output_len = buf[14];
+	if (pp->m < 1 || pp->t < 1 || pp->p < 1 || pp->m < (pp->p << 3)
+		|| pp->key_id_len > sizeof pp->key_id
+		|| pp->associated_data_len > sizeof pp->associated_data
+		|| pp->salt_len > sizeof pp->salt
+		|| pp->output_len > sizeof pp->output
+		|| (pp->salt_len != 0 && pp->salt_len < 8)
+		|| (pp->output_len != 0 && pp->output_len < 12)
+		|| (pp->salt_len == 0 && pp->output_len != 0)
+		|| len != ARGON2I_BLOB_HEADER_LEN + pp->key_id_len
+			+ pp->associated_data_len + pp->salt_len + pp->output_len)
+	{
+		return 0;
+	}
+	buf += ARGON2I_BLOB_HEADER_LEN;
+	memcpy(pp->key_id, buf, pp->key_id_len);
+	buf += pp->key_id_len;
+	memcpy(pp->associated_data, buf, pp->associated_data_len);
+	buf += pp->associated_data_len;
+	memcpy(pp->salt, buf, pp->salt_len);
+	buf += pp->salt_len;
+	memcpy(pp->output, buf, pp->output_len);
+	return 1;
+}
+
+/*
+ * Column-oriented ("structure of arrays") output for batch decoding.
+ * Scanning a single field over many records then reads contiguous
+ * memory, instead of gathering one value out of each 200-byte
+ * structure.
+ *
+ * A binary field is stored as three arrays: for row i, the field value
+ * consists of len[i] bytes starting at bytes[off[i]]. Values are
+ * appended at offset 'fill', which is updated; the 'bytes' array must
+ * have room for the maximum field size (8, 32, 48 or 64 bytes) for each
+ * decoded row.
+ */
+typedef struct {
+	uint8_t *len;
+	size_t *off;
+	unsigned char *bytes;
+	size_t fill;
+} argon2i_bin_column;
+
+/*
+ * All columns for batch decoding. Each array pointer may be NULL, in
+ * which case that field is not stored (binary fields are skipped if
+ * their 'len' array is NULL). The 'valid' column receives 1 for rows
+ * that decoded successfully, 0 otherwise; invalid rows have all their
+ * numeric fields and lengths set to 0.
+ */
+typedef struct {
+	uint8_t *valid;
+	uint32_t *m;
+	uint32_t *t;
+	uint8_t *p;
+	argon2i_bin_column key_id;
+	argon2i_bin_column associated_data;
+	argon2i_bin_column salt;
+	argon2i_bin_column output;
+} argon2i_columns;
+
+static void
+bin_column_put(argon2i_bin_column *col, size_t row,
+	const unsigned char *buf, size_t len)
+{
+	if (col->len == NULL) {
+		return;
+	}
+	col->len[row] = (uint8_t)len;
+	col->off[row] = col->fill;
+	memcpy(col->bytes + col->fill, buf, len);
+	col->fill += len;
+}
+
+/*
+ * Store decoded values 'pp' into row 'row' of the columns. If 'ok' is
+ * zero, then the row is marked invalid and 'pp' is ignored.
+ */
+static void
+columns_put_row(argon2i_columns *cols, size_t row,
+	argon2i_params *pp, int ok)
+{
+	if (!ok) {
+		memset(pp, 0, sizeof *pp);
+	}
+	if (cols->valid != NULL) {
+		cols->valid[row] = (uint8_t)(ok != 0);
+	}
+	if (cols->m != NULL) {
+		cols->m[row] = (uint32_t)pp->m;
+	}
+	if (cols->t != NULL) {
+		cols->t[row] = (uint32_t)pp->t;
+	}
+	if (cols->p != NULL) {
+		cols->p[row] = (uint8_t)pp->p;
+	}
+	bin_column_put(&cols->key_id, row, pp->key_id, pp->key_id_len);
+	bin_column_put(&cols->associated_data, row,
+		pp->associated_data, pp->associated_data_len);
+	bin_column_put(&cols->salt, row, pp->salt, pp->salt_len);
+	bin_column_put(&cols->output, row, pp->output, pp->output_len);
+}
+
+/*
+ * Decode 'n' hash strings into rows 'row' to 'row+n-1' of the provided
+ * columns. Returned value is the number of rows that were successfully
+ * decoded.
+ */
+size_t
+argon2i_decode_columns(argon2i_columns *cols, size_t row,
+	const char *const *strs, size_t n)
+{
+	size_t u, num;
+
+	num = 0;
+	for (u = 0; u < n; u ++, row ++) {
+		argon2i_params pp;
+		int ok;
+
+		ok = argon2i_decode_string(&pp, strs[u]);
+		columns_put_row(cols, row, &pp, ok);
+		num += ok;
+	}
+	return num;
+}
+
+/*
+ * Number of records ahead of the current one for which the batch
+ * decoder issues prefetches.
+ */
+#define DECODE_PREFETCH_DISTANCE   8
+
+/*
+ * Decode a batch of 'n' hash strings; string i consists of lens[i]
+ * characters starting at strs[i] (zero-termination is not needed).
+ * Decoded values are written in out[i]. Per-record status is written in
+ * the 'status' bitmap: bit (i & 7) of status[i >> 3] is set to 1 if
+ * record i was decoded successfully, 0 otherwise (out[i] contents are
+ * then unspecified). The bitmap must have room for (n + 7) / 8 bytes.
+ * Returned value is the number of successfully decoded records.
+ *
+ * Source strings (and their pointers) are prefetched a few records
+ * ahead, so that memory latency for the next records overlaps with the
+ * parsing of the current one. Status bits are accumulated without
+ * conditional jumps.
+ */
+size_t
+argon2_decode_batch(const char *const *strs, const size_t *lens, size_t n,
+	argon2i_packed *out, unsigned char *status)
+{
+	size_t u, num;
+	unsigned bits;
+
+	num = 0;
+	bits = 0;
+	for (u = 0; u < n; u ++) {
+		argon2i_params pp;
+		unsigned ok;
+
+		if (u + 2 * DECODE_PREFETCH_DISTANCE < n) {
+			PREFETCH(&strs[u + 2 * DECODE_PREFETCH_DISTANCE]);
+			PREFETCH(&lens[u + 2 * DECODE_PREFETCH_DISTANCE]);
+		}
+		if (u + DECODE_PREFETCH_DISTANCE < n) {
+			PREFETCH(strs[u + DECODE_PREFETCH_DISTANCE]);
+		}
+		ok = decode_string_inner(&pp, strs[u], strs[u] + lens[u],
+			NULL) == ARGON2I_OK && argon2i_pack(&out[u], &pp);
+		num += ok;
+		bits |= ok << (u & 7);
+		if ((u & 7) == 7) {
+			status[u >> 3] = (unsigned char)bits;
+			bits = 0;
+		}
+	}
+	if ((n & 7) != 0) {
+		status[n >> 3] = (unsigned char)bits;
+	}
+	return num;
+}
+
+/* ==================================================================== */
+/*
+ * Bulk processing of hash string dumps: a dump is a buffer containing
+ * one hash string per line; lines are terminated by '\n', except
+ * possibly the last one (an empty last line is not counted).
+ *
+ * Work is split into chunks, aligned on line boundaries, which worker
+ * threads claim dynamically from a shared counter: a thread that
+ * finishes early simply claims more chunks. Each worker accumulates
+ * its results in a private context, which are merged once all workers
+ * are done; no lock is taken on the result data.
+ */
+
+/*
+ * Run 'fn' on 'num' worker contexts, each of 'ctx_size' bytes, stored
+ * consecutively starting at 'ctx'. When threads are enabled, context 0
+ * runs on the calling thread and the others on new threads; otherwise
+ * (or if thread creation fails), the remaining contexts also run on the
+ * calling thread, one after the other. The function returns when all
+ * workers have completed.
+ */
+static void
+run_workers(void *(*fn)(void *), void *ctx, size_t ctx_size, unsigned num)
+{
+	unsigned u;
+#if PHC_SF_THREADS
+	pthread_t *th;
+	unsigned *started;
+
+	th = NULL;
+	started = NULL;
+	if (num > 1) {
+		th = malloc(num * sizeof *th);
+		started = calloc(num, sizeof *started);
+	}
+	if (th != NULL && started != NULL) {
+		for (u = 1; u < num; u ++) {
+			started[u] = pthread_create(&th[u], NULL, fn,
+				(char *)ctx + u * ctx_size) == 0;
+		}
+	}
+	fn(ctx);
+	for (u = 1; u < num; u ++) {
+		if (started != NULL && started[u]) {
+			pthread_join(th[u], NULL);
+		} else {
+			fn((char *)ctx + u * ctx_size);
+		}
+	}
+	free(th);
+	free(started);
+#else
+	for (u = 0; u < num; u ++) {
+		fn((char *)ctx + u * ctx_size);
+	}
+#endif
+}
+
+/*
+ * Number of CPUs available (1 if unknown, at most 256).
+ */
+static unsigned
+default_threads(void)
+{
+#if PHC_SF_THREADS && defined _SC_NPROCESSORS_ONLN
+	long n;
+
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n > 1) {
+		return n > 256 ? 256 : (unsigned)n;
+	}
+#endif
+	return 1;
+}
+
+/*
+ * Atomically increment '*counter' and return its previous value.
+ */
+static size_t
+claim_next(size_t *counter)
+{
+#if PHC_SF_THREADS && (defined __GNUC__ || defined __clang__)
+	return __atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+#elif PHC_SF_THREADS
+	static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	size_t r;
+
+	pthread_mutex_lock(&lock);
+	r = (*counter) ++;
+	pthread_mutex_unlock(&lock);
+	return r;
+#else
+	return (*counter) ++;
+#endif
+}
+
+/*
+ * 32-bit atomic operations for lock-free shared structures: load with
+ * acquire semantics, store with release semantics, and compare-and-swap
+ * (returned value is 1 if '*p' was equal to 'old' and has been set to
+ * 'val', 0 otherwise). Without compiler support, a global mutex is
+ * used.
+ */
+#if PHC_SF_THREADS && !(defined __GNUC__ || defined __clang__)
+static pthread_mutex_t atomic_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static uint32_t
+atomic_load32(uint32_t *p)
+{
+#if PHC_SF_THREADS && (defined __GNUC__ || defined __clang__)
+	return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+#elif PHC_SF_THREADS
+	uint32_t r;
+
+	pthread_mutex_lock(&atomic_lock);
+	r = *p;
+	pthread_mutex_unlock(&atomic_lock);
+	return r;
+#else
+	return *p;
+#endif
+}
+
+static void
+atomic_store32(uint32_t *p, uint32_t val)
+{
+#if PHC_SF_THREADS && (defined __GNUC__ || defined __clang__)
+	__atomic_store_n(p, val, __ATOMIC_RELEASE);
+#elif PHC_SF_THREADS
+	pthread_mutex_lock(&atomic_lock);
+	*p = val;
+	pthread_mutex_unlock(&atomic_lock);
+#else
+	*p = val;
+#endif
+}
+
+static int
+atomic_cas32(uint32_t *p, uint32_t old, uint32_t val)
+{
+#if PHC_SF_THREADS && (defined __GNUC__ || defined __clang__)
+	return __atomic_compare_exchange_n(p, &old, val, 0,
+		__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+#elif PHC_SF_THREADS
+	int r;
+
+	pthread_mutex_lock(&atomic_lock);
+	r = *p == old;
+	if (r) {
+		*p = val;
+	}
+	pthread_mutex_unlock(&atomic_lock);
+	return r;
+#else
+	if (*p != old) {
+		return 0;
+	}
+	*p = val;
+	return 1;
+#endif
+}
+
+/*
+ * A chunk of a dump: complete lines from 'start' (inclusive) to 'end'
+ * (exclusive). 'first_row' is the index of the first line of the chunk
+ * in the whole dump.
+ */
+typedef struct {
+	const char *start;
+	const char *end;
+	size_t first_row;
+	size_t num_rows;
+} dump_chunk;
+
+/*
+ * Minimum chunk size, in bytes; a dump is split into about 8 chunks per
+ * thread, but not smaller than that.
+ */
+#define DUMP_CHUNK_MIN   4096
+
+/*
+ * Split a dump into chunks, aligned on line boundaries. A new array is
+ * allocated and returned, and the number of chunks is written into
+ * '*num_chunks'; NULL is returned on allocation failure. Row numbers
+ * are not computed.
+ */
+static dump_chunk *
+split_dump(const char *buf, size_t len, unsigned num_threads,
+	size_t *num_chunks)
+{
+	dump_chunk *ch;
+	size_t n, max, step, u;
+	const char *end, *cur;
+
+	max = (size_t)num_threads * 8;
+	if (max < 1) {
+		max = 1;
+	}
+	step = len / max;
+	if (step < DUMP_CHUNK_MIN) {
+		step = DUMP_CHUNK_MIN;
+	}
+	ch = malloc(max * sizeof *ch);
+	if (ch == NULL) {
+		return NULL;
+	}
+	end = buf + len;
+	cur = buf;
+	n = 0;
+	for (u = 0; u < max && cur < end; u ++) {
+		const char *next;
+
+		if (u == max - 1 || (size_t)(end - cur) <= step) {
+			next = end;
+		} else {
+			next = memchr(cur + step, '\n', (size_t)(end - cur) - step);
+			next = next == NULL ? end : next + 1;
+		}
+		ch[n].start = cur;
+		ch[n].end = next;
+		ch[n].first_row = 0;
+		ch[n].num_rows = 0;
+		n ++;
+		cur = next;
+	}
+	*num_chunks = n;
+	return ch;
+}
+
+/*
+ * Get the next line from '*cur' (up to 'end'); the line start and length
+ * are written in '*line' and '*line_len', and '*cur' is moved to the
+ * start of the next line. Returned value is 0 if there is no more line.
+ */
+static int
+next_line(const char **cur, const char *end,
+	const char **line, size_t *line_len)
+{
+	const char *nl;
+
+	if (*cur >= end) {
+		return 0;
+	}
+	*line = *cur;
+	nl = memchr(*cur, '\n', (size_t)(end - *cur));
+	if (nl == NULL) {
+		*line_len = (size_t)(end - *cur);
+		*cur = end;
+	} else {
+		*line_len = (size_t)(nl - *cur);
+		*cur = nl + 1;
+	}
+	return 1;
+}
+
+/*
+ * Count the lines in a dump (with the same rules as the bulk decoder).
+ */
+size_t
+phc_count_lines(const char *buf, size_t len)
+{
+	const char *cur, *end, *line;
+	size_t n, line_len;
+
+	cur = buf;
+	end = buf + len;
+	n = 0;
+	while (next_line(&cur, end, &line, &line_len)) {
+		n ++;
+	}
+	return n;
+}
+
+/*
+ * Results of a bulk decode: number of rows, and histogram of decoding
+ * results (status[ARGON2I_OK] is the number of valid rows).
+ */
+typedef struct {
+	size_t rows;
+	size_t status[ARGON2I_ERR_NUM];
+} argon2i_bulk_stats;
+
+/*
+ * Chunk numbering: each worker counts the lines of the chunks it
+ * claims.
+ */
+typedef struct {
+	dump_chunk *chunks;
+	size_t num_chunks;
+	size_t *next;
+} count_worker;
+
+static void *
+count_worker_run(void *arg)
+{
+	count_worker *w;
+	size_t c;
+
+	w = arg;
+	while ((c = claim_next(w->next)) < w->num_chunks) {
+		dump_chunk *ch;
+
+		ch = &w->chunks[c];
+		ch->num_rows = phc_count_lines(ch->start,
+			(size_t)(ch->end - ch->start));
+	}
+	return NULL;
+}
+
+/*
+ * Set the 'first_row' field of all chunks, counting lines with
+ * 'num_threads' threads. Returned value is the total number of rows,
+ * or (size_t)-1 on allocation failure.
+ */
+static size_t
+number_chunks(dump_chunk *chunks, size_t num_chunks, unsigned num_threads)
+{
+	count_worker *w;
+	size_t next, u, row;
+	unsigned v;
+
+	w = malloc(num_threads * sizeof *w);
+	if (w == NULL) {
+		return (size_t)-1;
+	}
+	next = 0;
+	for (v = 0; v < num_threads; v ++) {
+		w[v].chunks = chunks;
+		w[v].num_chunks = num_chunks;
+		w[v].next = &next;
+	}
+	run_workers(count_worker_run, w, sizeof *w, num_threads);
+	free(w);
+	row = 0;
+	for (u = 0; u < num_chunks; u ++) {
+		chunks[u].first_row = row;
+		row += chunks[u].num_rows;
+	}
+	return row;
+}
+
+typedef struct {
+	dump_chunk *chunks;
+	size_t num_chunks;
+	size_t next;
+	argon2i_columns *cols;
+} bulk_job;
+
+typedef struct {
+	bulk_job *job;
+	argon2i_bulk_stats st;
+} bulk_worker;
+
+static void *
+bulk_worker_run(void *arg)
+{
+	bulk_worker *w;
+	bulk_job *job;
+	size_t c;
+
+	w = arg;
+	job = w->job;
+	while ((c = claim_next(&job->next)) < job->num_chunks) {
+		dump_chunk *ch;
+		argon2i_columns cols;
+		const char *cur, *line;
+		size_t row, line_len;
+
+		ch = &job->chunks[c];
+
+		/*
+		 * Binary values of a chunk are stored from the offset
+		 * that the maximum-sized values of all previous rows
+		 * would reach, so that chunks never overlap.
+		 */
+		if (job->cols != NULL) {
+			cols = *job->cols;
+			cols.key_id.fill = ch->first_row * 8;
+			cols.associated_data.fill = ch->first_row * 32;
+			cols.salt.fill = ch->first_row * 48;
+			cols.output.fill = ch->first_row * 64;
+		}
+		/*
+		 * Lines are decoded with decode_string_inner() rather
+		 * than argon2_decode_batch(): the batch decoder reports
+		 * only success or failure per record, while the bulk
+		 * statistics count each error kind. Its prefetching
+		 * would not help here anyway, since the lines of a chunk
+		 * are contiguous and read in order (which hardware
+		 * prefetchers already handle), whereas it targets strings
+		 * scattered in memory.
+		 */
+		cur = ch->start;
+		row = ch->first_row;
+		while (next_line(&cur, ch->end, &line, &line_len)) {
+			argon2i_params pp;
+			int err;
+
+			err = decode_string_inner(&pp, line, line + line_len,
+				NULL);
+			w->st.status[err] ++;
+			w->st.rows ++;
+			if (job->cols != NULL) {
+				columns_put_row(&cols, row, &pp,
+					err == ARGON2I_OK);
+			}
+			row ++;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Decode all hash strings of a dump, using 'num_threads' threads
+ * (including the caller). Results are accumulated into '*st' (which
+ * this function clears first). If 'cols' is not NULL, then decoded
+ * values are also stored in the columns, one row per line: these
+ * must be sized for phc_count_lines() rows, and each binary column
+ * must have room for the maximum value size times the number of rows.
+ * Binary values are not necessarily stored densely; the 'fill' fields
+ * of the binary columns are not updated.
+ *
+ * Results are identical to those of decoding each line in turn with
+ * argon2i_decode_string_err(). Returned value is 1 on success, 0 on
+ * allocation failure.
+ */
+int
+argon2i_decode_bulk(const char *buf, size_t len, unsigned num_threads,
+	argon2i_columns *cols, argon2i_bulk_stats *st)
+{
+	bulk_job job;
+	bulk_worker *w;
+	unsigned v;
+	int e;
+
+	memset(st, 0, sizeof *st);
+	if (num_threads < 1) {
+		num_threads = 1;
+	}
+	job.chunks = split_dump(buf, len, num_threads, &job.num_chunks);
+	if (job.chunks == NULL) {
+		return 0;
+	}
+	if (num_threads > job.num_chunks) {
+		num_threads = job.num_chunks > 0 ? (unsigned)job.num_chunks : 1;
+	}
+	w = calloc(num_threads, sizeof *w);
+	if (w == NULL) {
+		free(job.chunks);
+		return 0;
+	}
+	job.cols = cols;
+	for (v = 0; v < num_threads; v ++) {
+		w[v].job = &job;
+	}
+
+	/*
+	 * Storing into columns requires the row index of the first line
+	 * of each chunk; lines are counted in a first parallel pass.
+	 */
+	if (cols != NULL && number_chunks(job.chunks, job.num_chunks,
+		num_threads) == (size_t)-1)
+	{
+		free(w);
+		free(job.chunks);
+		return 0;
+	}
+	job.next = 0;
+	run_workers(bulk_worker_run, w, sizeof *w, num_threads);
+
+	for (v = 0; v < num_threads; v ++) {
+		st->rows += w[v].st.rows;
+		for (e = 0; e < ARGON2I_ERR_NUM; e ++) {
+			st->status[e] += w[v].st.status[e];
+		}
+	}
+	free(w);
+	free(job.chunks);
+	return 1;
+}
+
+/*
+ * A hash table of parameter tuples with occurrence counts (open
+ * addressing, linear probing, grown when half full).
+ *
+ * The variant uses the Argon2 type numbering (0 = Argon2d, 1 = Argon2i,
+ * 2 = Argon2id); the version is 0 when the string has no "v=" field.
+ * Users that do not need some of the fields set them to 0.
+ */
+typedef struct {
+	uint32_t m;
+	uint32_t t;
+	uint32_t p;
+	uint32_t version;
+	uint8_t variant;
+	uint8_t salt_len;
+	uint8_t output_len;
+	size_t count;
+} param_tuple;
+
+typedef struct {
+	param_tuple *slots;
+	size_t cap;
+	size_t num;
+} param_table;
+
+static void
+param_table_init(param_table *pt)
+{
+	pt->slots = NULL;
+	pt->cap = 0;
+	pt->num = 0;
+}
+
+static void
+param_table_free(param_table *pt)
+{
+	free(pt->slots);
+	param_table_init(pt);
+}
+
+static size_t
+param_tuple_hash(const param_tuple *pk)
+{
+	uint32_t h;
+
+	h = pk->m * 0x9E3779B1u;
+	h = (h ^ (h >> 15) ^ pk->t) * 0x85EBCA77u;
+	h = (h ^ (h >> 13) ^ pk->p ^ (pk->version << 8)) * 0xC2B2AE3Du;
+	h = (h ^ (h >> 16) ^ pk->variant ^ ((uint32_t)pk->salt_len << 8)
+		^ ((uint32_t)pk->output_len << 16)) * 0x9E3779B1u;
+	return (size_t)(h ^ (h >> 16));
+}
+
+static int
+param_tuple_eq(const param_tuple *a, const param_tuple *b)
+{
+	return a->m == b->m && a->t == b->t && a->p == b->p
+		&& a->version == b->version && a->variant == b->variant
+		&& a->salt_len == b->salt_len && a->output_len == b->output_len;
+}
+
+/*
+ * Order parameter tuples by decreasing count, then by increasing field
+ * values.
+ */
+static int
+param_tuple_cmp(const void *a, const void *b)
+{
+	const param_tuple *ta, *tb;
+	uint32_t fa[7], fb[7];
+	int i;
+
+	ta = a;
+	tb = b;
+	if (ta->count != tb->count) {
+		return ta->count < tb->count ? 1 : -1;
+	}
+	fa[0] = ta->variant;
+	fa[1] = ta->version;
+	fa[2] = ta->m;
+	fa[3] = ta->t;
+	fa[4] = ta->p;
+	fa[5] = ta->salt_len;
+	fa[6] = ta->output_len;
+	fb[0] = tb->variant;
+	fb[1] = tb->version;
+	fb[2] = tb->m;
+	fb[3] = tb->t;
+	fb[4] = tb->p;
+	fb[5] = tb->salt_len;
+	fb[6] = tb->output_len;
+	for (i = 0; i < 7; i ++) {
+		if (fa[i] != fb[i]) {
+			return fa[i] < fb[i] ? -1 : 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Add 'key->count' occurrences of the tuple 'key' to the table.
+ * Returned value is 1 on success, 0 on allocation failure.
+ */
+static int
+param_table_add(param_table *pt, const param_tuple *key)
+{
+	size_t u, mask;
+
+	if (pt->num >= (pt->cap >> 1)) {
+		param_table nt;
+		size_t v;
+
+		nt.cap = pt->cap == 0 ? 64 : pt->cap << 1;
+		nt.num = 0;
+		nt.slots = calloc(nt.cap, sizeof *nt.slots);
+		if (nt.slots == NULL) {
+			return 0;
+		}
+		for (v = 0; v < pt->cap; v ++) {
+			if (pt->slots[v].count != 0) {
+				param_table_add(&nt, &pt->slots[v]);
+			}
+		}
+		free(pt->slots);
+		*pt = nt;
+	}
+	mask = pt->cap - 1;
+	for (u = param_tuple_hash(key) & mask;; u = (u + 1) & mask) {
+		param_tuple *e;
+
+		e = &pt->slots[u];
+		if (e->count == 0) {
+			*e = *key;
+			pt->num ++;
+			return 1;
+		}
+		if (param_tuple_eq(e, key)) {
+			e->count += key->count;
+			return 1;
+		}
+	}
+}
+
+/*
+ * Get the table entries in an array (allocated with malloc()), sorted
+ * by decreasing count. The number of entries is written in '*num'.
+ * NULL is returned on allocation failure.
+ */
+static param_tuple *
+param_table_sorted(const param_table *pt, size_t *num)
+{
+	param_tuple *tp;
+	size_t u, n;
+
+	tp = malloc((pt->num + 1) * sizeof *tp);
+	if (tp == NULL) {
+		return NULL;
+	}
+	n = 0;
+	for (u = 0; u < pt->cap; u ++) {
+		if (pt->slots[u].count != 0) {
+			tp[n ++] = pt->slots[u];
+		}
+	}
+	qsort(tp, n, sizeof *tp, param_tuple_cmp);
+	*num = n;
+	return tp;
+}
+
+/*
+ * Dump scanner: validates every line of a dump, and summarizes it.
+ *
+ * The algorithm of a line is its identifier (the characters between the
+ * leading '$' and the next '$'), followed by the version when the next
+ * field is "v=<num>" (the Argon2i format handled in this file has no
+ * version field, but other hash strings may). Lines that do not start
+ * with a plausible identifier are counted under "(other)".
+ */
+#define SCAN_MAX_ALGS      32
+#define SCAN_ALG_LEN       32
+#define SCAN_SAMPLES       5
+
+typedef struct {
+	char name[SCAN_ALG_LEN];
+	size_t count;
+} scan_alg;
+
+typedef struct {
+	argon2i_bulk_stats st;
+	scan_alg algs[SCAN_MAX_ALGS];
+	size_t num_algs;
+	param_table params;
+	size_t samples[ARGON2I_ERR_NUM][SCAN_SAMPLES];
+	size_t num_samples[ARGON2I_ERR_NUM];
+	int alloc_failed;
+} phc_scan_result;
+
+/*
+ * Extract the algorithm identifier (and version, if any) of a line into
+ * 'dst' (SCAN_ALG_LEN bytes, zero-terminated).
+ */
+static void
+scan_alg_name(char *dst, const char *line, size_t len)
+{
+	size_t u, v;
+
+	v = 0;
+	if (len > 1 && line[0] == '$') {
+		for (u = 1; u < len && line[u] != '$'; u ++) {
+			int c;
+
+			c = line[u];
+			if (v >= 16 || !((c >= 'a' && c <= 'z')
+				|| (c >= '0' && c <= '9') || c == '-'))
+			{
+				v = 0;
+				break;
+			}
+			dst[v ++] = (char)c;
+		}
+		if (v > 0 && u + 2 < len && line[u + 1] == 'v'
+			&& line[u + 2] == '=')
+		{
+			dst[v ++] = ' ';
+			dst[v ++] = 'v';
+			dst[v ++] = '=';
+			for (u += 3; u < len && v < SCAN_ALG_LEN - 1
+				&& line[u] >= '0' && line[u] <= '9'; u ++)
+			{
+				dst[v ++] = line[u];
+			}
+		}
+	}
+	if (v == 0) {
+		memcpy(dst, "(other)", 8);
+	} else {
+		dst[v] = 0;
+	}
+}
+
+static void
+scan_add_alg(phc_scan_result *r, const char *name, size_t count)
+{
+	size_t u;
+
+	for (u = 0; u < r->num_algs; u ++) {
+		if (strcmp(r->algs[u].name, name) == 0) {
+			r->algs[u].count += count;
+			return;
+		}
+	}
+	if (r->num_algs == SCAN_MAX_ALGS) {
+		scan_add_alg(r, "(other)", count);
+		return;
+	}
+	if (r->num_algs == SCAN_MAX_ALGS - 1 && strcmp(name, "(other)") != 0) {
+		/*
+		 * Keep the last slot for "(other)".
+		 */
+		scan_add_alg(r, "(other)", count);
+		return;
+	}
+	memcpy(r->algs[r->num_algs].name, name, SCAN_ALG_LEN);
+	r->algs[r->num_algs].count = count;
+	r->num_algs ++;
+}
+
+/*
+ * Record line number 'line_num' as a sample for error 'err'; only the
+ * SCAN_SAMPLES smallest line numbers are kept.
+ */
+static void
+scan_add_sample(phc_scan_result *r, int err, size_t line_num)
+{
+	size_t *smp, n, u;
+
+	smp = r->samples[err];
+	n = r->num_samples[err];
+	if (n == SCAN_SAMPLES) {
+		if (line_num >= smp[n - 1]) {
+			return;
+		}
+		n --;
+	}
+	for (u = n; u > 0 && smp[u - 1] > line_num; u --) {
+		smp[u] = smp[u - 1];
+	}
+	smp[u] = line_num;
+	r->num_samples[err] = n + 1;
+}
+
+/*
+ * Scan the lines of a chunk, accumulating into 'r'; line numbers (in
+ * error samples) start at the 'first_row' field of the chunk.
+ */
+static void
+scan_chunk(phc_scan_result *r, const dump_chunk *ch)
+{
+	const char *cur, *line;
+	size_t row, line_len;
+	char name[SCAN_ALG_LEN], last[SCAN_ALG_LEN];
+	size_t run;
+
+	cur = ch->start;
+	row = ch->first_row;
+	run = 0;
+	last[0] = 0;
+	while (next_line(&cur, ch->end, &line, &line_len)) {
+		argon2i_params pp;
+		int err;
+
+		/*
+		 * Consecutive lines usually share the same algorithm;
+		 * counts are accumulated locally until it changes.
+		 */
+		scan_alg_name(name, line, line_len);
+		if (strcmp(name, last) != 0) {
+			if (run > 0) {
+				scan_add_alg(r, last, run);
+			}
+			memcpy(last, name, SCAN_ALG_LEN);
+			run = 0;
+		}
+		run ++;
+
+		err = decode_string_inner(&pp, line, line + line_len, NULL);
+		r->st.status[err] ++;
+		r->st.rows ++;
+		if (err == ARGON2I_OK) {
+			param_tuple key;
+
+			memset(&key, 0, sizeof key);
+			key.variant = 1;
+			key.m = (uint32_t)pp.m;
+			key.t = (uint32_t)pp.t;
+			key.p = (uint32_t)pp.p;
+			key.count = 1;
+			if (!param_table_add(&r->params, &key)) {
+				r->alloc_failed = 1;
+			}
+		} else {
+			scan_add_sample(r, err, row + 1);
+		}
+		row ++;
+	}
+	if (run > 0) {
+		scan_add_alg(r, last, run);
+	}
+}
+
+typedef struct {
+	dump_chunk *chunks;
+	size_t num_chunks;
+	size_t *next;
+	phc_scan_result r;
+} scan_worker;
+
+static void *
+scan_worker_run(void *arg)
+{
+	scan_worker *w;
+	size_t c;
+
+	w = arg;
+	while ((c = claim_next(w->next)) < w->num_chunks) {
+		scan_chunk(&w->r, &w->chunks[c]);
+	}
+	return NULL;
+}
+
+/*
+ * Release the resources held by a scan result.
+ */
+void
+phc_scan_free(phc_scan_result *r)
+{
+	param_table_free(&r->params);
+}
+
+/*
+ * Merge scan result 'src' into 'dst'; line numbers from 'src' are
+ * shifted by 'line_base'. Returned value is 1 on success, 0 on
+ * allocation failure (in 'src' or during the merge).
+ */
+static int
+scan_merge(phc_scan_result *dst, const phc_scan_result *src,
+	size_t line_base)
+{
+	size_t u;
+	int e, ok;
+
+	ok = !src->alloc_failed;
+	dst->st.rows += src->st.rows;
+	for (e = 0; e < ARGON2I_ERR_NUM; e ++) {
+		dst->st.status[e] += src->st.status[e];
+		for (u = 0; u < src->num_samples[e]; u ++) {
+			scan_add_sample(dst, e, line_base + src->samples[e][u]);
+		}
+	}
+	for (u = 0; u < src->num_algs; u ++) {
+		scan_add_alg(dst, src->algs[u].name, src->algs[u].count);
+	}
+	for (u = 0; u < src->params.cap; u ++) {
+		if (src->params.slots[u].count != 0) {
+			ok &= param_table_add(&dst->params, &src->params.slots[u]);
+		}
+	}
+	return ok;
+}
+
+/*
+ * Scan a dump (validate all lines and summarize them) with
+ * 'num_threads' threads. The result must be released with
+ * phc_scan_free() afterwards. Returned value is 1 on success, 0 on
+ * allocation failure.
+ */
+int
+phc_scan(const char *buf, size_t len, unsigned num_threads,
+	phc_scan_result *r)
+{
+	dump_chunk *chunks;
+	size_t num_chunks, next;
+	scan_worker *w;
+	unsigned v;
+	int ok;
+
+	memset(r, 0, sizeof *r);
+	param_table_init(&r->params);
+	if (num_threads < 1) {
+		num_threads = 1;
+	}
+	chunks = split_dump(buf, len, num_threads, &num_chunks);
+	if (chunks == NULL) {
+		return 0;
+	}
+	if (num_threads > num_chunks) {
+		num_threads = num_chunks > 0 ? (unsigned)num_chunks : 1;
+	}
+	w = calloc(num_threads, sizeof *w);
+	if (w == NULL || number_chunks(chunks, num_chunks, num_threads)
+		== (size_t)-1)
+	{
+		free(w);
+		free(chunks);
+		return 0;
+	}
+	next = 0;
+	for (v = 0; v < num_threads; v ++) {
+		w[v].chunks = chunks;
+		w[v].num_chunks = num_chunks;
+		w[v].next = &next;
+		param_table_init(&w[v].r.params);
+	}
+	run_workers(scan_worker_run, w, sizeof *w, num_threads);
+
+	ok = 1;
+	for (v = 0; v < num_threads; v ++) {
+		ok &= scan_merge(r, &w[v].r, 0);
+		phc_scan_free(&w[v].r);
+	}
+	free(w);
+	free(chunks);
+	if (!ok) {
+		phc_scan_free(r);
+	}
+	return ok;
+}
+
+/*
+ * A file mapped (or loaded) in memory.
+ */
+typedef struct {
+	const char *buf;
+	size_t len;
+	int mapped;
+} phc_file;
+
+/*
+ * Map the file 'name' in memory, read-only. If the file cannot be
+ * mapped (or memory mapping is not supported), then it is read into an
+ * allocated buffer instead. Returned value is 1 on success, 0 on error.
+ */
+int
+phc_file_open(phc_file *f, const char *name)
+{
+	FILE *fp;
+	char *buf;
+	size_t len, cap, rlen;
+
+#if PHC_SF_MMAP
+	int fd;
+	struct stat sb;
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0) {
+		return 0;
+	}
+	if (fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode) && sb.st_size > 0
+		&& (uintmax_t)sb.st_size <= (uintmax_t)SIZE_MAX)
+	{
+		void *addr;
+
+		addr = mmap(NULL, (size_t)sb.st_size, PROT_READ,
+			MAP_PRIVATE, fd, 0);
+		if (addr != MAP_FAILED) {
+#ifdef MADV_SEQUENTIAL
+			madvise(addr, (size_t)sb.st_size, MADV_SEQUENTIAL);
+#endif
+			close(fd);
+			f->buf = addr;
+			f->len = (size_t)sb.st_size;
+			f->mapped = 1;
+			return 1;
+		}
+	}
+	close(fd);
+#endif
+
+	fp = fopen(name, "rb");
+	if (fp == NULL) {
+		return 0;
+	}
+	buf = NULL;
+	len = 0;
+	cap = 0;
+	for (;;) {
+		if (len == cap) {
+			char *nbuf;
+
+			cap = cap == 0 ? 65536 : cap << 1;
+			nbuf = realloc(buf, cap);
+			if (nbuf == NULL) {
+				free(buf);
+				fclose(fp);
+				return 0;
+			}
+			buf = nbuf;
+		}
+		rlen = fread(buf + len, 1, cap - len, fp);
+		if (rlen == 0) {
+			break;
+		}
+		len += rlen;
+	}
+	if (ferror(fp)) {
+		free(buf);
+		fclose(fp);
+		return 0;
+	}
+	fclose(fp);
+	f->buf = buf;
+	f->len = len;
+	f->mapped = 0;
+	return 1;
+}
+
+void
+phc_file_close(phc_file *f)
+{
+#if PHC_SF_MMAP
+	if (f->mapped) {
+		munmap((void *)f->buf, f->len);
+		return;
+	}
+#endif
+	free((void *)f->buf);
+}
+
+/*
+ * Streaming reader, for files too large to be mapped or kept in the page
+ * cache. The file is read sequentially, in blocks of a fixed size, into
+ * a ring of 'depth' buffers; up to 'depth' blocks are read ahead while
+ * the consumer works on the oldest one. Reads use one of three
+ * mechanisms:
+ *
+ *   -- With io_uring (PHC_SF_URING), a read is submitted for every free
+ *   buffer, so that several reads are in flight at once without any
+ *   extra thread. The buffers are registered with the kernel (which
+ *   then does not have to map and pin them for each read); if the
+ *   registration fails (e.g. because of RLIMIT_MEMLOCK), plain reads
+ *   are submitted instead.
+ *
+ *   -- Otherwise, when threads are enabled, a dedicated reader thread
+ *   fills the free buffers with pread(), and asks the kernel to read
+ *   ahead the block that follows each read (POSIX_FADV_WILLNEED).
+ *
+ *   -- Otherwise, blocks are read on the calling thread.
+ *
+ * The consumer cuts each block after its last newline and hands the
+ * complete lines to a callback, directly from the buffer; the partial
+ * last line is copied into a carry buffer, and completed with the
+ * start of the next block (a line longer than a block spans several
+ * blocks in the carry buffer). A buffer is recycled (its next read is
+ * submitted) as soon as the callback returns.
+ */
+
+#define STREAM_DEPTH_MAX   16
+
+/*
+ * Callback for a block of complete lines. It must return 1 to continue,
+ * 0 to abort the streaming. The block is valid only until the callback
+ * returns.
+ */
+typedef int (*phc_block_fn)(void *ctx, const char *buf, size_t len);
+
+typedef struct {
+	char *buf;
+	uint64_t off;
+	size_t len;
+	int state;   /* 0 = free, 1 = being read, 2 = filled */
+} stream_slot;
+
+#if PHC_SF_URING
+/*
+ * io_uring instance: submission and completion rings shared with the
+ * kernel.
+ */
+typedef struct {
+	int fd;
+	int fixed;
+	unsigned in_flight;
+	void *sq_ptr;
+	size_t sq_len;
+	void *cq_ptr;
+	size_t cq_len;
+	struct io_uring_sqe *sqes;
+	size_t sqes_len;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+} stream_ring;
+#endif
+
+/*
+ * Maximum block size for io_uring reads (the kernel does not register
+ * larger buffers).
+ */
+#define STREAM_URING_BLOCK_MAX   ((size_t)1 << 30)
+
+#define STREAM_SYNC     0
+#define STREAM_THREAD   1
+#define STREAM_URING    2
+
+typedef struct {
+#if PHC_SF_MMAP
+	int fd;
+#else
+	FILE *fp;
+#endif
+	uint64_t off;
+	size_t block_size;
+	unsigned depth;
+	int mode;
+	char *mem;
+	stream_slot slots[STREAM_DEPTH_MAX];
+	char *carry;
+	size_t carry_len;
+	size_t carry_cap;
+	int failed;
+	int stop;
+#if PHC_SF_THREADS
+	pthread_t th;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+#endif
+#if PHC_SF_URING
+	stream_ring ring;
+#endif
+} stream_reader;
+
+/*
+ * Assign the next block of the file to a slot.
+ */
+static void
+stream_next_block(stream_reader *sr, stream_slot *sl)
+{
+	sl->off = sr->off;
+	sl->len = 0;
+	sr->off += sr->block_size;
+}
+
+/*
+ * Read the block of a slot (or its remainder, after the first 'len'
+ * bytes) with plain reads; the block is shorter than the block size
+ * only at the end of the file. On error, the 'failed' flag is set and
+ * the block is truncated.
+ */
+static void
+stream_read(stream_reader *sr, stream_slot *sl)
+{
+#if PHC_SF_MMAP
+	while (sl->len < sr->block_size) {
+		ssize_t n;
+
+		n = pread(sr->fd, sl->buf + sl->len, sr->block_size - sl->len,
+			(off_t)(sl->off + sl->len));
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0) {
+			sr->failed = 1;
+			return;
+		}
+		if (n == 0) {
+			return;
+		}
+		sl->len += (size_t)n;
+	}
+#ifdef POSIX_FADV_WILLNEED
+	if (sr->mode != STREAM_URING) {
+		posix_fadvise(sr->fd, (off_t)(sl->off + sl->len),
+			(off_t)sr->block_size, POSIX_FADV_WILLNEED);
+	}
+#endif
+#else
+	sl->len += fread(sl->buf + sl->len, 1, sr->block_size - sl->len,
+		sr->fp);
+	if (ferror(sr->fp)) {
+		sr->failed = 1;
+	}
+#endif
+}
+
+#if PHC_SF_URING
+static void
+stream_ring_free(stream_reader *sr)
+{
+	stream_ring *rg;
+
+	rg = &sr->ring;
+	if (rg->sqes != NULL) {
+		munmap(rg->sqes, rg->sqes_len);
+	}
+	if (rg->cq_ptr != NULL && rg->cq_ptr != rg->sq_ptr) {
+		munmap(rg->cq_ptr, rg->cq_len);
+	}
+	if (rg->sq_ptr != NULL) {
+		munmap(rg->sq_ptr, rg->sq_len);
+	}
+	if (rg->fd >= 0) {
+		close(rg->fd);
+	}
+	memset(rg, 0, sizeof *rg);
+	rg->fd = -1;
+}
+
+/*
+ * Map a ring region; NULL is returned on error.
+ */
+static void *
+stream_ring_map(int fd, size_t len, uint64_t off)
+{
+	void *p;
+
+	p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, fd, (off_t)off);
+	return p == MAP_FAILED ? NULL : p;
+}
+
+/*
+ * Set up an io_uring instance with one submission entry per buffer,
+ * and register the buffers. Returned value is 1 on success, 0 if
+ * io_uring cannot be used.
+ */
+static int
+stream_ring_init(stream_reader *sr)
+{
+	stream_ring *rg;
+	struct io_uring_params p;
+	struct iovec iov[STREAM_DEPTH_MAX];
+	unsigned i;
+
+	rg = &sr->ring;
+	memset(rg, 0, sizeof *rg);
+	memset(&p, 0, sizeof p);
+	rg->fd = (int)syscall(SYS_io_uring_setup, sr->depth, &p);
+	if (rg->fd < 0) {
+		rg->fd = -1;
+		return 0;
+	}
+	rg->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	rg->cq_len = p.cq_off.cqes
+		+ p.cq_entries * sizeof(struct io_uring_cqe);
+	rg->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+#ifdef IORING_FEAT_SINGLE_MMAP
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (rg->sq_len < rg->cq_len) {
+			rg->sq_len = rg->cq_len;
+		}
+		rg->sq_ptr = stream_ring_map(rg->fd, rg->sq_len,
+			IORING_OFF_SQ_RING);
+		rg->cq_ptr = rg->sq_ptr;
+	} else
+#endif
+	{
+		rg->sq_ptr = stream_ring_map(rg->fd, rg->sq_len,
+			IORING_OFF_SQ_RING);
+		rg->cq_ptr = stream_ring_map(rg->fd, rg->cq_len,
+			IORING_OFF_CQ_RING);
+	}
+	rg->sqes = stream_ring_map(rg->fd, rg->sqes_len, IORING_OFF_SQES);
+	if (rg->sq_ptr == NULL || rg->cq_ptr == NULL || rg->sqes == NULL) {
+		stream_ring_free(sr);
+		return 0;
+	}
+	rg->sq_tail = (unsigned *)((char *)rg->sq_ptr + p.sq_off.tail);
+	rg->sq_mask = (unsigned *)((char *)rg->sq_ptr + p.sq_off.ring_mask);
+	rg->sq_array = (unsigned *)((char *)rg->sq_ptr + p.sq_off.array);
+	rg->cq_head = (unsigned *)((char *)rg->cq_ptr + p.cq_off.head);
+	rg->cq_tail = (unsigned *)((char *)rg->cq_ptr + p.cq_off.tail);
+	rg->cq_mask = (unsigned *)((char *)rg->cq_ptr + p.cq_off.ring_mask);
+	rg->cqes = (struct io_uring_cqe *)((char *)rg->cq_ptr
+		+ p.cq_off.cqes);
+
+	for (i = 0; i < sr->depth; i ++) {
+		iov[i].iov_base = sr->slots[i].buf;
+		iov[i].iov_len = sr->block_size;
+	}
+	rg->fixed = syscall(SYS_io_uring_register, rg->fd,
+		IORING_REGISTER_BUFFERS, iov, sr->depth) == 0;
+	return 1;
+}
+
+/*
+ * Submit the read of the next block into slot 'i'. If the kernel
+ * rejects the submission, the 'failed' flag is set and the slot is
+ * marked as filled, with no data.
+ */
+static void
+stream_ring_submit(stream_reader *sr, unsigned i)
+{
+	stream_ring *rg;
+	stream_slot *sl;
+	struct io_uring_sqe *sqe;
+	unsigned tail, idx;
+	long n;
+
+	rg = &sr->ring;
+	sl = &sr->slots[i];
+	stream_next_block(sr, sl);
+	tail = *rg->sq_tail;
+	idx = tail & *rg->sq_mask;
+	sqe = &rg->sqes[idx];
+	memset(sqe, 0, sizeof *sqe);
+	sqe->opcode = rg->fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+	sqe->fd = sr->fd;
+	sqe->off = sl->off;
+	sqe->addr = (uint64_t)(uintptr_t)sl->buf;
+	sqe->len = (uint32_t)sr->block_size;
+	if (rg->fixed) {
+		sqe->buf_index = (uint16_t)i;
+	}
+	sqe->user_data = i;
+	rg->sq_array[idx] = idx;
+	__atomic_store_n(rg->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	do {
+		n = syscall(SYS_io_uring_enter, rg->fd, 1, 0, 0, NULL, 0);
+	} while (n < 0 && (errno == EINTR || errno == EAGAIN));
+	if (n != 1) {
+		sr->failed = 1;
+		sl->state = 2;
+		return;
+	}
+	rg->in_flight ++;
+	sl->state = 1;
+}
+
+/*
+ * Process one completion, waiting for it if necessary. Returned value
+ * is 1 on success, 0 on error.
+ */
+static int
+stream_ring_reap(stream_reader *sr)
+{
+	stream_ring *rg;
+	struct io_uring_cqe *cqe;
+	stream_slot *sl;
+	unsigned head;
+
+	rg = &sr->ring;
+	for (;;) {
+		long n;
+
+		head = *rg->cq_head;
+		if (head != __atomic_load_n(rg->cq_tail, __ATOMIC_ACQUIRE)) {
+			break;
+		}
+		n = syscall(SYS_io_uring_enter, rg->fd, 0, 1,
+			IORING_ENTER_GETEVENTS, NULL, 0);
+		if (n < 0 && errno != EINTR && errno != EAGAIN) {
+			return 0;
+		}
+	}
+	cqe = &rg->cqes[head & *rg->cq_mask];
+	sl = &sr->slots[cqe->user_data];
+
+	/*
+	 * A failed read is retried with pread() (from stream_read()),
+	 * which reports persistent errors.
+	 */
+	sl->len = cqe->res > 0 ? (size_t)cqe->res : 0;
+	sl->state = 2;
+	__atomic_store_n(rg->cq_head, head + 1, __ATOMIC_RELEASE);
+	rg->in_flight --;
+	return 1;
+}
+#endif
+
+#if PHC_SF_THREADS
+static void *
+stream_reader_run(void *arg)
+{
+	stream_reader *sr;
+	unsigned i;
+	int stop;
+
+	sr = arg;
+	for (i = 0;; i = (i + 1) % sr->depth) {
+		stream_slot *sl;
+
+		sl = &sr->slots[i];
+		pthread_mutex_lock(&sr->lock);
+		while (sl->state != 0 && !sr->stop) {
+			pthread_cond_wait(&sr->cond, &sr->lock);
+		}
+		stop = sr->stop;
+		pthread_mutex_unlock(&sr->lock);
+		if (stop) {
+			break;
+		}
+		stream_next_block(sr, sl);
+		stream_read(sr, sl);
+		pthread_mutex_lock(&sr->lock);
+		sl->state = 2;
+		pthread_cond_broadcast(&sr->cond);
+		pthread_mutex_unlock(&sr->lock);
+		if (sl->len < sr->block_size) {
+			break;
+		}
+	}
+	return NULL;
+}
+#endif
+
+/*
+ * Start reading ahead, with the first available mechanism.
+ */
+static void
+stream_start(stream_reader *sr)
+{
+	unsigned i;
+
+#if PHC_SF_URING
+	if (sr->block_size <= STREAM_URING_BLOCK_MAX && stream_ring_init(sr)) {
+		sr->mode = STREAM_URING;
+		for (i = 0; i < sr->depth && !sr->failed; i ++) {
+			stream_ring_submit(sr, i);
+		}
+		return;
+	}
+#endif
+#if PHC_SF_THREADS
+	if (pthread_mutex_init(&sr->lock, NULL) == 0) {
+		if (pthread_cond_init(&sr->cond, NULL) == 0) {
+			sr->mode = STREAM_THREAD;
+			if (pthread_create(&sr->th, NULL,
+				stream_reader_run, sr) == 0)
+			{
+				return;
+			}
+			pthread_cond_destroy(&sr->cond);
+		}
+		pthread_mutex_destroy(&sr->lock);
+	}
+#endif
+	(void)i;
+	sr->mode = STREAM_SYNC;
+}
+
+/*
+ * Wait until slot 'i' contains its block.
+ */
+static void
+stream_wait(stream_reader *sr, unsigned i)
+{
+	stream_slot *sl;
+
+	sl = &sr->slots[i];
+	switch (sr->mode) {
+#if PHC_SF_URING
+	case STREAM_URING:
+		while (sl->state == 1) {
+			if (!stream_ring_reap(sr)) {
+				sr->failed = 1;
+				return;
+			}
+		}
+
+		/*
+		 * Complete short reads; this also detects the end of
+		 * the file.
+		 */
+		if (!sr->failed) {
+			stream_read(sr, sl);
+		}
+		break;
+#endif
+#if PHC_SF_THREADS
+	case STREAM_THREAD:
+		pthread_mutex_lock(&sr->lock);
+		while (sl->state != 2) {
+			pthread_cond_wait(&sr->cond, &sr->lock);
+		}
+		pthread_mutex_unlock(&sr->lock);
+		break;
+#endif
+	default:
+		stream_next_block(sr, sl);
+		stream_read(sr, sl);
+		sl->state = 2;
+		break;
+	}
+}
+
+/*
+ * Give back slot 'i' for the next read.
+ */
+static void
+stream_release(stream_reader *sr, unsigned i)
+{
+	switch (sr->mode) {
+#if PHC_SF_URING
+	case STREAM_URING:
+		stream_ring_submit(sr, i);
+		break;
+#endif
+#if PHC_SF_THREADS
+	case STREAM_THREAD:
+		pthread_mutex_lock(&sr->lock);
+		sr->slots[i].state = 0;
+		pthread_cond_broadcast(&sr->cond);
+		pthread_mutex_unlock(&sr->lock);
+		break;
+#endif
+	default:
+		sr->slots[i].state = 0;
+		break;
+	}
+}
+
+/*
+ * Stop reading ahead. Returned value is 1 if the buffers can be
+ * released, 0 if the kernel may still write into them.
+ */
+static int
+stream_stop(stream_reader *sr)
+{
+	switch (sr->mode) {
+#if PHC_SF_URING
+	case STREAM_URING:
+		while (sr->ring.in_flight > 0) {
+			if (!stream_ring_reap(sr)) {
+				return 0;
+			}
+		}
+		stream_ring_free(sr);
+		break;
+#endif
+#if PHC_SF_THREADS
+	case STREAM_THREAD:
+		pthread_mutex_lock(&sr->lock);
+		sr->stop = 1;
+		pthread_cond_broadcast(&sr->cond);
+		pthread_mutex_unlock(&sr->lock);
+		pthread_join(sr->th, NULL);
+		pthread_cond_destroy(&sr->cond);
+		pthread_mutex_destroy(&sr->lock);
+		break;
+#endif
+	default:
+		break;
+	}
+	return 1;
+}
+
+/*
+ * Append 'len' bytes to the carried-over partial line. Returned value
+ * is 1 on success, 0 on allocation failure.
+ */
+static int
+stream_carry(stream_reader *sr, const char *buf, size_t len)
+{
+	if (len == 0) {
+		return 1;
+	}
+	if (sr->carry_cap - sr->carry_len < len) {
+		char *nbuf;
+		size_t cap;
+
+		cap = sr->carry_cap == 0 ? sr->block_size : sr->carry_cap;
+		while (cap - sr->carry_len < len) {
+			cap <<= 1;
+		}
+		nbuf = realloc(sr->carry, cap);
+		if (nbuf == NULL) {
+			return 0;
+		}
+		sr->carry = nbuf;
+		sr->carry_cap = cap;
+	}
+	memcpy(sr->carry + sr->carry_len, buf, len);
+	sr->carry_len += len;
+	return 1;
+}
+
+/*
+ * Hand the complete lines of a block to the callback: first the line
+ * that completes the carried-over partial line (if any), then the lines
+ * up to the last newline; the rest is carried over. Returned value is 1
+ * on success, 0 on error (allocation failure or callback abort).
+ */
+static int
+stream_lines(stream_reader *sr, const char *buf, size_t len,
+	phc_block_fn fn, void *ctx)
+{
+	size_t start, end;
+
+	start = 0;
+	if (sr->carry_len > 0) {
+		const char *nl;
+
+		nl = memchr(buf, '\n', len);
+		start = nl == NULL ? len : (size_t)(nl - buf) + 1;
+		if (!stream_carry(sr, buf, start)) {
+			return 0;
+		}
+		if (nl == NULL) {
+			return 1;
+		}
+		if (!fn(ctx, sr->carry, sr->carry_len)) {
+			return 0;
+		}
+		sr->carry_len = 0;
+	}
+	for (end = len; end > start && buf[end - 1] != '\n'; end --);
+	if (end > start && !fn(ctx, buf + start, end - start)) {
+		return 0;
+	}
+	return stream_carry(sr, buf + end, len - end);
+}
+
+/*
+ * Stream the file 'name' through the callback 'fn', in blocks of about
+ * 'block_size' bytes (complete lines only), with up to 'depth' blocks
+ * read ahead (at least 2, at most STREAM_DEPTH_MAX). Returned value is
+ * 1 on success, 0 on error (file cannot be read, allocation failure, or
+ * callback abort).
+ */
+int
+phc_stream_file(const char *name, size_t block_size, unsigned depth,
+	phc_block_fn fn, void *ctx)
+{
+	stream_reader sr;
+	unsigned i;
+	int ok;
+
+	memset(&sr, 0, sizeof sr);
+	if (block_size < 1) {
+		block_size = 1;
+	}
+	if (depth < 2) {
+		depth = 2;
+	}
+	if (depth > STREAM_DEPTH_MAX) {
+		depth = STREAM_DEPTH_MAX;
+	}
+	if (block_size > SIZE_MAX / depth) {
+		return 0;
+	}
+	sr.block_size = block_size;
+	sr.depth = depth;
+	sr.mem = malloc(depth * block_size);
+	if (sr.mem == NULL) {
+		return 0;
+	}
+	for (i = 0; i < depth; i ++) {
+		sr.slots[i].buf = sr.mem + i * block_size;
+	}
+#if PHC_SF_MMAP
+	sr.fd = open(name, O_RDONLY);
+	if (sr.fd < 0) {
+		free(sr.mem);
+		return 0;
+	}
+#ifdef POSIX_FADV_SEQUENTIAL
+	posix_fadvise(sr.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+#else
+	sr.fp = fopen(name, "rb");
+	if (sr.fp == NULL) {
+		free(sr.mem);
+		return 0;
+	}
+#endif
+
+	ok = 1;
+	stream_start(&sr);
+	for (i = 0;; i = (i + 1) % depth) {
+		stream_slot *sl;
+
+		sl = &sr.slots[i];
+		stream_wait(&sr, i);
+		if (!stream_lines(&sr, sl->buf, sl->len, fn, ctx)) {
+			ok = 0;
+			break;
+		}
+		if (sl->len < block_size || sr.failed) {
+			break;
+		}
+		stream_release(&sr, i);
+	}
+
+	/*
+	 * The last line may lack a terminating newline.
+	 */
+	if (ok && !sr.failed && sr.carry_len > 0) {
+		ok = fn(ctx, sr.carry, sr.carry_len);
+	}
+
+	/*
+	 * If reads may still be pending, the buffers must not be reused
+	 * (this should not happen).
+	 */
+	if (stream_stop(&sr)) {
+		free(sr.mem);
+	}
+	ok &= !sr.failed;
+	free(sr.carry);
+#if PHC_SF_MMAP
+	close(sr.fd);
+#else
+	fclose(sr.fp);
+#endif
+	return ok;
+}
+
+/*
+ * Streaming scan: the blocks are decoded by a set of worker threads
+ * that is started once for the whole file, along with the calling
+ * thread. Each block is split into chunks; the workers first count the
+ * lines of all chunks (so that line numbers can be assigned), then scan
+ * them. Each worker accumulates its own results over all blocks; these
+ * are merged at the end.
+ */
+
+struct stream_scan_ctx_;
+
+typedef struct {
+	struct stream_scan_ctx_ *sc;
+	phc_scan_result r;
+} stream_scan_worker;
+
+typedef struct stream_scan_ctx_ {
+	dump_chunk *chunks;
+	size_t num_chunks;
+	size_t next;
+	size_t done;
+	int counting;
+	size_t rows;
+	unsigned num_threads;
+	stream_scan_worker *w;
+#if PHC_SF_THREADS
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t idle;
+	pthread_t *threads;
+	unsigned num_started;
+	int stop;
+#endif
+} stream_scan_ctx;
+
+/*
+ * Process chunk 'c' of the current block (counting or scanning its
+ * lines).
+ */
+static void
+stream_scan_chunk(stream_scan_ctx *sc, phc_scan_result *r, size_t c)
+{
+	dump_chunk *ch;
+
+	ch = &sc->chunks[c];
+	if (sc->counting) {
+		ch->num_rows = phc_count_lines(ch->start,
+			(size_t)(ch->end - ch->start));
+	} else {
+		scan_chunk(r, ch);
+	}
+}
+
+#if PHC_SF_THREADS
+static void *
+stream_scan_worker_run(void *arg)
+{
+	stream_scan_worker *w;
+	stream_scan_ctx *sc;
+
+	w = arg;
+	sc = w->sc;
+	pthread_mutex_lock(&sc->lock);
+	for (;;) {
+		size_t c;
+
+		if (sc->next < sc->num_chunks) {
+			c = sc->next ++;
+			pthread_mutex_unlock(&sc->lock);
+			stream_scan_chunk(sc, &w->r, c);
+			pthread_mutex_lock(&sc->lock);
+			if (++ sc->done == sc->num_chunks) {
+				pthread_cond_broadcast(&sc->idle);
+			}
+			continue;
+		}
+		if (sc->stop) {
+			break;
+		}
+		pthread_cond_wait(&sc->work, &sc->lock);
+	}
+	pthread_mutex_unlock(&sc->lock);
+	return NULL;
+}
+#endif
+
+/*
+ * Count or scan the lines of all chunks of a block, on the workers and
+ * the calling thread; this returns when all chunks are processed.
+ */
+static void
+stream_scan_job(stream_scan_ctx *sc, dump_chunk *chunks, size_t num_chunks,
+	int counting)
+{
+	size_t c;
+
+#if PHC_SF_THREADS
+	if (sc->num_started > 0) {
+		pthread_mutex_lock(&sc->lock);
+		sc->chunks = chunks;
+		sc->num_chunks = num_chunks;
+		sc->counting = counting;
+		sc->next = 0;
+		sc->done = 0;
+		pthread_cond_broadcast(&sc->work);
+		while (sc->next < sc->num_chunks) {
+			c = sc->next ++;
+			pthread_mutex_unlock(&sc->lock);
+			stream_scan_chunk(sc, &sc->w[0].r, c);
+			pthread_mutex_lock(&sc->lock);
+			sc->done ++;
+		}
+		while (sc->done < sc->num_chunks) {
+			pthread_cond_wait(&sc->idle, &sc->lock);
+		}
+		pthread_mutex_unlock(&sc->lock);
+		return;
+	}
+#endif
+	sc->chunks = chunks;
+	sc->num_chunks = num_chunks;
+	sc->counting = counting;
+	for (c = 0; c < num_chunks; c ++) {
+		stream_scan_chunk(sc, &sc->w[0].r, c);
+	}
+}
+
+static int
+stream_scan_block(void *arg, const char *buf, size_t len)
+{
+	stream_scan_ctx *sc;
+	dump_chunk *chunks;
+	size_t num_chunks, u;
+
+	sc = arg;
+	chunks = split_dump(buf, len, sc->num_threads, &num_chunks);
+	if (chunks == NULL) {
+		return 0;
+	}
+	stream_scan_job(sc, chunks, num_chunks, 1);
+	for (u = 0; u < num_chunks; u ++) {
+		chunks[u].first_row = sc->rows;
+		sc->rows += chunks[u].num_rows;
+	}
+	stream_scan_job(sc, chunks, num_chunks, 0);
+	free(chunks);
+	return 1;
+}
+
+/*
+ * Start the workers of a streaming scan ('num_threads' threads in
+ * total, including the calling thread). Returned value is 1 on
+ * success, 0 on error. If only some threads can be started, the scan
+ * uses those.
+ */
+static int
+stream_scan_init(stream_scan_ctx *sc, unsigned num_threads)
+{
+	unsigned v;
+
+	memset(sc, 0, sizeof *sc);
+	if (num_threads < 1) {
+		num_threads = 1;
+	}
+	sc->num_threads = num_threads;
+	sc->w = calloc(num_threads, sizeof *sc->w);
+	if (sc->w == NULL) {
+		return 0;
+	}
+	for (v = 0; v < num_threads; v ++) {
+		sc->w[v].sc = sc;
+		param_table_init(&sc->w[v].r.params);
+	}
+#if PHC_SF_THREADS
+	if (num_threads > 1) {
+		if (pthread_mutex_init(&sc->lock, NULL) != 0) {
+			return 1;
+		}
+		if (pthread_cond_init(&sc->work, NULL) != 0) {
+			pthread_mutex_destroy(&sc->lock);
+			return 1;
+		}
+		if (pthread_cond_init(&sc->idle, NULL) != 0) {
+			pthread_cond_destroy(&sc->work);
+			pthread_mutex_destroy(&sc->lock);
+			return 1;
+		}
+		sc->threads = malloc((num_threads - 1) * sizeof *sc->threads);
+		while (sc->threads != NULL && sc->num_started < num_threads - 1
+			&& pthread_create(&sc->threads[sc->num_started], NULL,
+				stream_scan_worker_run,
+				&sc->w[sc->num_started + 1]) == 0)
+		{
+			sc->num_started ++;
+		}
+		if (sc->num_started == 0) {
+			free(sc->threads);
+			sc->threads = NULL;
+			pthread_cond_destroy(&sc->idle);
+			pthread_cond_destroy(&sc->work);
+			pthread_mutex_destroy(&sc->lock);
+		}
+	}
+#endif
+	return 1;
+}
+
+/*
+ * Stop the workers of a streaming scan, and merge their results into
+ * 'r' (if not NULL). Returned value is 1 on success, 0 on allocation
+ * failure.
+ */
+static int
+stream_scan_finish(stream_scan_ctx *sc, phc_scan_result *r)
+{
+	unsigned v;
+	int ok;
+
+#if PHC_SF_THREADS
+	if (sc->num_started > 0) {
+		pthread_mutex_lock(&sc->lock);
+		sc->stop = 1;
+		pthread_cond_broadcast(&sc->work);
+		pthread_mutex_unlock(&sc->lock);
+		for (v = 0; v < sc->num_started; v ++) {
+			pthread_join(sc->threads[v], NULL);
+		}
+		free(sc->threads);
+		pthread_cond_destroy(&sc->idle);
+		pthread_cond_destroy(&sc->work);
+		pthread_mutex_destroy(&sc->lock);
+	}
+#endif
+	ok = 1;
+	for (v = 0; v < sc->num_threads; v ++) {
+		if (r != NULL) {
+			ok &= scan_merge(r, &sc->w[v].r, 0);
+		}
+		phc_scan_free(&sc->w[v].r);
+	}
+	free(sc->w);
+	return ok;
+}
+
+/*
+ * Scan the file 'name' with the streaming reader; blocks are scanned
+ * with 'num_threads' threads while the next ones are being read. The
+ * result is the same as that of phc_scan() over the whole file, and
+ * must be released with phc_scan_free(). Returned value is 1 on
+ * success, 0 on error.
+ */
+int
+phc_scan_stream(const char *name, size_t block_size, unsigned num_threads,
+	phc_scan_result *r)
+{
+	stream_scan_ctx sc;
+
+	memset(r, 0, sizeof *r);
+	param_table_init(&r->params);
+	if (!stream_scan_init(&sc, num_threads)) {
+		return 0;
+	}
+	if (!phc_stream_file(name, block_size, 4, stream_scan_block, &sc)) {
+		stream_scan_finish(&sc, NULL);
+		return 0;
+	}
+	if (!stream_scan_finish(&sc, r)) {
+		phc_scan_free(r);
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Parameter-distribution analytics: count the lines of a dump for each
+ * distinct (variant, version, m, t, p, salt length, output length)
+ * tuple. Only the parameter prefix is parsed: the salt and output are
+ * not decoded, their lengths are inferred from the number of Base64
+ * characters. All three Argon2 variants are accepted, with an optional
+ * "v=" field, as the PHC string format specification allows; lines
+ * that do not match this structure are counted as rejected.
+ */
+
+/*
+ * Skip Base64 characters; the number of bytes they encode is written in
+ * '*len'. NULL is returned if the character count is invalid (1 modulo
+ * 4), if the unused bits of the last character are not zero, or if the
+ * encoded length exceeds 'max_len'. This accepts exactly what
+ * from_base64() accepts, but without decoding anything.
+ */
+static const char *
+skip_base64(const char *str, const char *end, size_t max_len, size_t *len)
+{
+	const char *orig;
+	size_t n;
+
+	orig = str;
+	while (str < end && b64_char_to_byte(*str) != 0xFF) {
+		str ++;
+	}
+	n = (size_t)(str - orig);
+	if ((n & 3) == 1) {
+		return NULL;
+	}
+	if ((n & 3) != 0
+		&& (b64_char_to_byte(str[-1]) & ((n & 3) == 2 ? 0x0F : 0x03)))
+	{
+		return NULL;
+	}
+	n = (n >> 2) * 3 + (((n & 3) * 3) >> 2);
+	if (n > max_len) {
+		return NULL;
+	}
+	*len = n;
+	return str;
+}
+
+/*
+ * Parse the parameter prefix of an Argon2 hash string into 'key' (the
+ * count field is not modified). Returned value is 1 on success, 0 if
+ * the string does not have the expected structure.
+ */
+static int
+decode_prefix(param_tuple *key, const char *str, const char *end)
+{
+#define CC(prefix)   do { \
+		size_t cc_len = sizeof(prefix) - 1; \
+		if ((size_t)(end - str) < cc_len \
+			|| memcmp(str, prefix, cc_len) != 0) \
+		{ \
+			return 0; \
+		} \
+		str += cc_len; \
+	} while (0)
+
+#define DECIMAL(x)   do { \
+		str = decode_decimal(str, end, &(x)); \
+		if (str == NULL) { \
+			return 0; \
+		} \
+	} while (0)
+
+#define SKIP(max_len, len)   do { \
+		str = skip_base64(str, end, max_len, &(len)); \
+		if (str == NULL) { \
+			return 0; \
+		} \
+	} while (0)
+
+	unsigned long m, t, p, v;
+	size_t len;
+
+	CC("$argon2");
+	if (end - str >= 2 && str[0] == 'i' && str[1] == 'd') {
+		key->variant = 2;
+		str += 2;
+	} else if (str < end && (*str == 'd' || *str == 'i')) {
+		key->variant = *str == 'd' ? 0 : 1;
+		str ++;
+	} else {
+		return 0;
+	}
+	v = 0;
+	if (end - str >= 3 && memcmp(str, "$v=", 3) == 0) {
+		str += 3;
+		DECIMAL(v);
+		if ((v >> 30) > 3) {
+			return 0;
+		}
+	}
+	CC("$m=");
+	DECIMAL(m);
+	CC(",t=");
+	DECIMAL(t);
+	CC(",p=");
+	DECIMAL(p);
+	if (m < 1 || (m >> 30) > 3 || t < 1 || (t >> 30) > 3
+		|| p < 1 || p > 255 || m < (p << 3))
+	{
+		return 0;
+	}
+	key->version = (uint32_t)v;
+	key->m = (uint32_t)m;
+	key->t = (uint32_t)t;
+	key->p = (uint32_t)p;
+	key->salt_len = 0;
+	key->output_len = 0;
+	if (end - str >= 7 && memcmp(str, ",keyid=", 7) == 0) {
+		str += 7;
+		SKIP(8, len);
+	}
+	if (end - str >= 6 && memcmp(str, ",data=", 6) == 0) {
+		str += 6;
+		SKIP(32, len);
+	}
+	if (str == end) {
+		return 1;
+	}
+	CC("$");
+	SKIP(48, len);
+	if (len < 8) {
+		return 0;
+	}
+	key->salt_len = (uint8_t)len;
+	if (str == end) {
+		return 1;
+	}
+	CC("$");
+	SKIP(64, len);
+	if (len < 12) {
+		return 0;
+	}
+	key->output_len = (uint8_t)len;
+	return str == end;
+
+#undef CC
+#undef DECIMAL
+#undef SKIP
+}
+
+/*
+ * Result of the analytics: the tuple histogram, and the number of rows
+ * (total, and rejected).
+ */
+typedef struct {
+	param_table tuples;
+	size_t rows;
+	size_t rejected;
+	int alloc_failed;
+} phc_param_stats;
+
+typedef struct {
+	dump_chunk *chunks;
+	size_t num_chunks;
+	size_t *next;
+	phc_param_stats ps;
+} stats_worker;
+
+static void *
+stats_worker_run(void *arg)
+{
+	stats_worker *w;
+	size_t c;
+
+	w = arg;
+	while ((c = claim_next(w->next)) < w->num_chunks) {
+		dump_chunk *ch;
+		const char *cur, *line;
+		size_t line_len;
+		param_tuple key, last;
+
+		ch = &w->chunks[c];
+		cur = ch->start;
+
+		/*
+		 * Runs of identical tuples (common in dumps, where most
+		 * rows share the current policy) are counted locally
+		 * before touching the hash table.
+		 */
+		last.count = 0;
+		while (next_line(&cur, ch->end, &line, &line_len)) {
+			w->ps.rows ++;
+			if (!decode_prefix(&key, line, line + line_len)) {
+				w->ps.rejected ++;
+				continue;
+			}
+			if (last.count > 0 && param_tuple_eq(&key, &last)) {
+				last.count ++;
+				continue;
+			}
+			if (last.count > 0
+				&& !param_table_add(&w->ps.tuples, &last))
+			{
+				w->ps.alloc_failed = 1;
+			}
+			last = key;
+			last.count = 1;
+		}
+		if (last.count > 0 && !param_table_add(&w->ps.tuples, &last)) {
+			w->ps.alloc_failed = 1;
+		}
+	}
+	return NULL;
+}
+
+void
+phc_param_stats_free(phc_param_stats *ps)
+{
+	param_table_free(&ps->tuples);
+}
+
+/*
+ * Build the parameter histogram of a dump, with 'num_threads' threads
+ * (each with its own hash table; tables are merged at the end). The
+ * result must be released with phc_param_stats_free(). Returned value
+ * is 1 on success, 0 on allocation failure.
+ */
+int
+phc_param_stats_build(const char *buf, size_t len, unsigned num_threads,
+	phc_param_stats *ps)
+{
+	dump_chunk *chunks;
+	size_t num_chunks, next, u;
+	stats_worker *w;
+	unsigned v;
+	int ok;
+
+	memset(ps, 0, sizeof *ps);
+	param_table_init(&ps->tuples);
+	if (num_threads < 1) {
+		num_threads = 1;
+	}
+	chunks = split_dump(buf, len, num_threads, &num_chunks);
+	if (chunks == NULL) {
+		return 0;
+	}
+	if (num_threads > num_chunks) {
+		num_threads = num_chunks > 0 ? (unsigned)num_chunks : 1;
+	}
+	w = calloc(num_threads, sizeof *w);
+	if (w == NULL) {
+		free(chunks);
+		return 0;
+	}
+	next = 0;
+	for (v = 0; v < num_threads; v ++) {
+		w[v].chunks = chunks;
+		w[v].num_chunks = num_chunks;
+		w[v].next = &next;
+		param_table_init(&w[v].ps.tuples);
+	}
+	run_workers(stats_worker_run, w, sizeof *w, num_threads);
+	ok = 1;
+	for (v = 0; v < num_threads; v ++) {
+		phc_param_stats *wp;
+
+		wp = &w[v].ps;
+		ok &= !wp->alloc_failed;
+		ps->rows += wp->rows;
+		ps->rejected += wp->rejected;
+		for (u = 0; u < wp->tuples.cap; u ++) {
+			if (wp->tuples.slots[u].count != 0) {
+				ok &= param_table_add(&ps->tuples,
+					&wp->tuples.slots[u]);
+			}
+		}
+		param_table_free(&wp->tuples);
+	}
+	free(w);
+	free(chunks);
+	if (!ok) {
+		phc_param_stats_free(ps);
+	}
+	return ok;
+}
+
+static const char *
+variant_name(unsigned variant)
+{
+	switch (variant) {
+	case 0:
+		return "argon2d";
+	case 1:
+		return "argon2i";
+	default:
+		return "argon2id";
+	}
+}
+
+/*
+ * Write the histogram as CSV (one header line, then one line per tuple,
+ * by decreasing count; a version of 0 means "no version field") or as
+ * JSON (an object with the row counts and an array of tuples). Returned
+ * value is 1 on success, 0 on error.
+ */
+int
+phc_param_stats_write(FILE *out, const phc_param_stats *ps, int json)
+{
+	param_tuple *tp;
+	size_t u, n, valid;
+
+	tp = param_table_sorted(&ps->tuples, &n);
+	if (tp == NULL) {
+		return 0;
+	}
+	valid = ps->rows - ps->rejected;
+	if (json) {
+		fprintf(out, "{\"rows\":%lu,\"rejected\":%lu,\"tuples\":[",
+			(unsigned long)ps->rows, (unsigned long)ps->rejected);
+	} else {
+		fprintf(out, "variant,version,m,t,p,salt_len,output_len,"
+			"count,fraction\n");
+	}
+	for (u = 0; u < n; u ++) {
+		double frac;
+
+		frac = valid == 0 ? 0.0 : (double)tp[u].count / (double)valid;
+		if (json) {
+			fprintf(out, "%s\n{\"variant\":\"%s\",\"version\":%lu,"
+				"\"m\":%lu,\"t\":%lu,\"p\":%lu,"
+				"\"salt_len\":%u,\"output_len\":%u,"
+				"\"count\":%lu,\"fraction\":%.6f}",
+				u == 0 ? "" : ",", variant_name(tp[u].variant),
+				(unsigned long)tp[u].version,
+				(unsigned long)tp[u].m, (unsigned long)tp[u].t,
+				(unsigned long)tp[u].p,
+				(unsigned)tp[u].salt_len,
+				(unsigned)tp[u].output_len,
+				(unsigned long)tp[u].count, frac);
+		} else {
+			fprintf(out, "%s,%lu,%lu,%lu,%lu,%u,%u,%lu,%.6f\n",
+				variant_name(tp[u].variant),
+				(unsigned long)tp[u].version,
+				(unsigned long)tp[u].m, (unsigned long)tp[u].t,
+				(unsigned long)tp[u].p,
+				(unsigned)tp[u].salt_len,
+				(unsigned)tp[u].output_len,
+				(unsigned long)tp[u].count, frac);
+		}
+	}
+	if (json) {
+		fprintf(out, "\n]}\n");
+	}
+	free(tp);
+	return !ferror(out);
+}
+
+/*
+ * Salt-reuse detector: the salt of each Argon2 string of a dump is
+ * decoded (nothing else is) and inserted in a concurrent hash set
+ * shared by all worker threads. Rows whose salt was already present
+ * are reported as duplicates; salts shorter than SALT_MIN_LEN bytes
+ * are reported as well.
+ *
+ * The set is an open-addressing table sized from the row count (at
+ * least twice as many slots as rows, so that it never fills up) with
+ * fixed 16-byte keys: a 16-byte salt is its own key, other lengths are
+ * hashed into 16 bytes (with the length), so that memory usage does not
+ * depend on salt sizes. Insertion is lock-free: a slot is claimed with
+ * a compare-and-swap on its state word (empty, being written, full),
+ * and readers wait for the key of a slot being written.
+ */
+
+#define SALT_MIN_LEN   16
+
+typedef struct {
+	unsigned char key[16];
+	uint32_t state;
+	uint32_t dup;
+} salt_slot;
+
+/*
+ * Result of a salt check. Sample lists hold the lowest line numbers
+ * (counted from 1) found in each category; which occurrence of a
+ * duplicated salt counts as the duplicate depends on thread scheduling,
+ * but counts do not.
+ */
+typedef struct {
+	size_t rows;
+	size_t no_salt;
+	size_t short_salts;
+	size_t dup_rows;
+	size_t dup_salts;
+	size_t short_samples[SCAN_SAMPLES];
+	size_t num_short_samples;
+	size_t dup_samples[SCAN_SAMPLES];
+	size_t num_dup_samples;
+} phc_salt_report;
+
+/*
+ * Locate the salt of an Argon2 string: it is the field that follows the
+ * parameters ("m=..."). NULL is returned if there is no such field.
+ */
+static const char *
+find_salt(const char *str, const char *end)
+{
+	if ((size_t)(end - str) < 7 || memcmp(str, "$argon2", 7) != 0) {
+		return NULL;
+	}
+	str += 7;
+	for (;;) {
+		str = memchr(str, '$', (size_t)(end - str));
+		if (str == NULL || ++ str == end) {
+			return NULL;
+		}
+		if (end - str >= 2 && str[0] == 'm' && str[1] == '=') {
+			break;
+		}
+	}
+	str = memchr(str, '$', (size_t)(end - str));
+	return str == NULL ? NULL : str + 1;
+}
+
+/*
+ * Compute the 16-byte set key for a salt.
+ */
+static void
+salt_key(unsigned char *key, const unsigned char *salt, size_t len)
+{
+	uint64_t h0, h1;
+	size_t u;
+
+	if (len == 16) {
+		memcpy(key, salt, 16);
+		return;
+	}
+	h0 = 0xCBF29CE484222325 ^ (uint64_t)len;
+	h1 = 0x84222325CBF29CE4 + (uint64_t)len;
+	for (u = 0; u < len; u ++) {
+		h0 = (h0 ^ salt[u]) * 0x100000001B3;
+		h1 = (h1 + salt[u]) * 0x9E3779B97F4A7C15;
+		h1 ^= h1 >> 29;
+	}
+	enc64le(key, h0 ^ (h1 >> 32));
+	enc64le(key + 8, h1 ^ (h0 >> 17));
+}
+
+/*
+ * Insert a key in the set. Returned value is 0 if the key was new, 1 if
+ * it was already present, 2 if it was already present and this is the
+ * first duplicate found for it.
+ */
+static int
+salt_set_insert(salt_slot *set, size_t mask, const unsigned char *key)
+{
+	size_t u;
+
+	u = (size_t)((dec64le(key) ^ dec64le(key + 8))
+		* 0x9E3779B97F4A7C15 >> 32) & mask;
+	for (;;) {
+		salt_slot *sl;
+		uint32_t state;
+
+		sl = &set[u];
+		state = atomic_load32(&sl->state);
+		if (state == 0) {
+			if (!atomic_cas32(&sl->state, 0, 1)) {
+				continue;
+			}
+			memcpy(sl->key, key, 16);
+			atomic_store32(&sl->state, 2);
+			return 0;
+		}
+		if (state == 1) {
+			/* Slot is being written: wait for its key. */
+			continue;
+		}
+		if (memcmp(sl->key, key, 16) == 0) {
+			return atomic_cas32(&sl->dup, 0, 1) ? 2 : 1;
+		}
+		u = (u + 1) & mask;
+	}
+}
+
+/*
+ * Insert a line number in a sorted sample list (keeping the lowest).
+ */
+static void
+sample_insert(size_t *samples, size_t *num, size_t line_num)
+{
+	size_t u;
+
+	if (*num == SCAN_SAMPLES) {
+		if (line_num >= samples[SCAN_SAMPLES - 1]) {
+			return;
+		}
+		(*num) --;
+	}
+	for (u = *num; u > 0 && samples[u - 1] > line_num; u --) {
+		samples[u] = samples[u - 1];
+	}
+	samples[u] = line_num;
+	(*num) ++;
+}
+
+typedef struct {
+	dump_chunk *chunks;
+	size_t num_chunks;
+	size_t *next;
+	salt_slot *set;
+	size_t mask;
+	phc_salt_report r;
+} salt_worker;
+
+static void *
+salt_worker_run(void *arg)
+{
+	salt_worker *w;
+	size_t c;
+
+	w = arg;
+	while ((c = claim_next(w->next)) < w->num_chunks) {
+		dump_chunk *ch;
+		const char *cur, *line, *end, *str;
+		size_t line_len, row;
+
+		ch = &w->chunks[c];
+		cur = ch->start;
+		row = ch->first_row;
+		while (next_line(&cur, ch->end, &line, &line_len)) {
+			unsigned char salt[48], key[16];
+			size_t len;
+
+			row ++;
+			end = line + line_len;
+			str = find_salt(line, end);
+			len = sizeof salt;
+			if (str != NULL) {
+				str = from_base64(salt, &len, str, end);
+			}
+			if (str == NULL || (str != end && *str != '$')
+				|| len == 0)
+			{
+				w->r.no_salt ++;
+				continue;
+			}
+			if (len < SALT_MIN_LEN) {
+				w->r.short_salts ++;
+				sample_insert(w->r.short_samples,
+					&w->r.num_short_samples, row);
+			}
+			salt_key(key, salt, len);
+			switch (salt_set_insert(w->set, w->mask, key)) {
+			case 2:
+				w->r.dup_salts ++;
+				/* fall through */
+			case 1:
+				w->r.dup_rows ++;
+				sample_insert(w->r.dup_samples,
+					&w->r.num_dup_samples, row);
+				break;
+			}
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Check the salts of a dump with 'num_threads' threads. Lines without a
+ * (decodable, non-empty) salt are only counted. Returned value is 1 on
+ * success, 0 on allocation failure.
+ */
+int
+phc_salt_check(const char *buf, size_t len, unsigned num_threads,
+	phc_salt_report *r)
+{
+	dump_chunk *chunks;
+	size_t num_chunks, next, rows, cap, u;
+	salt_slot *set;
+	salt_worker *w;
+	unsigned v;
+
+	memset(r, 0, sizeof *r);
+	if (num_threads < 1) {
+		num_threads = 1;
+	}
+	chunks = split_dump(buf, len, num_threads, &num_chunks);
+	if (chunks == NULL) {
+		return 0;
+	}
+	if (num_threads > num_chunks) {
+		num_threads = num_chunks > 0 ? (unsigned)num_chunks : 1;
+	}
+	rows = number_chunks(chunks, num_chunks, num_threads);
+	if (rows == (size_t)-1) {
+		free(chunks);
+		return 0;
+	}
+	for (cap = 64; cap < (rows << 1); cap <<= 1) {
+		if (cap > ((size_t)-1 / sizeof *set) >> 1) {
+			free(chunks);
+			return 0;
+		}
+	}
+	set = calloc(cap, sizeof *set);
+	w = calloc(num_threads, sizeof *w);
+	if (set == NULL || w == NULL) {
+		free(set);
+		free(w);
+		free(chunks);
+		return 0;
+	}
+	next = 0;
+	for (v = 0; v < num_threads; v ++) {
+		w[v].chunks = chunks;
+		w[v].num_chunks = num_chunks;
+		w[v].next = &next;
+		w[v].set = set;
+		w[v].mask = cap - 1;
+	}
+	run_workers(salt_worker_run, w, sizeof *w, num_threads);
+	r->rows = rows;
+	for (v = 0; v < num_threads; v ++) {
+		phc_salt_report *wr;
+
+		wr = &w[v].r;
+		r->no_salt += wr->no_salt;
+		r->short_salts += wr->short_salts;
+		r->dup_rows += wr->dup_rows;
+		r->dup_salts += wr->dup_salts;
+		for (u = 0; u < wr->num_short_samples; u ++) {
+			sample_insert(r->short_samples,
+				&r->num_short_samples, wr->short_samples[u]);
+		}
+		for (u = 0; u < wr->num_dup_samples; u ++) {
+			sample_insert(r->dup_samples,
+				&r->num_dup_samples, wr->dup_samples[u]);
+		}
+	}
+	free(w);
+	free(set);
+	free(chunks);
+	return 1;
+}
+
+/*
+ * Export of decoded Argon2i strings as CSV or JSON lines, for loading
+ * into other tools. Each valid line of the dump yields one record with
+ * its line number, m, t and p as integers, and keyid, data, salt and
+ * output in hexadecimal (empty strings when absent); invalid lines are
+ * skipped, and only counted.
+ *
+ * The dump is processed in windows of about EXPORT_WINDOW bytes: each
+ * window is split into chunks that worker threads decode and format
+ * into per-chunk arenas (reused from one window to the next), which are
+ * then written in order. No allocation or stdio formatting happens per
+ * row.
+ */
+
+#define EXPORT_WINDOW    ((size_t)16 << 20)
+#define EXPORT_ROW_MAX   640
+
+/*
+ * Write 'len' bytes as lowercase hexadecimal (2*len characters, no
+ * terminating zero). Groups of four bytes are converted with 64-bit
+ * arithmetic: nibbles are spread into separate bytes, and all eight
+ * characters are computed at once, without table lookups or branches.
+ */
+static void
+to_hex(char *dst, const unsigned char *src, size_t len)
+{
+	while (len >= 4) {
+		uint64_t x, n;
+
+		x = dec32le(src);
+		x = (x | (x << 16)) & 0x0000FFFF0000FFFF;
+		x = (x | (x << 8)) & 0x00FF00FF00FF00FF;
+		n = ((x >> 4) & 0x000F000F000F000F)
+			| ((x & 0x000F000F000F000F) << 8);
+		n += 0x3030303030303030
+			+ (((n + 0x0606060606060606) >> 4)
+			& 0x0101010101010101) * 0x27;
+		enc64le((unsigned char *)dst, n);
+		src += 4;
+		dst += 8;
+		len -= 4;
+	}
+	while (len -- > 0) {
+		unsigned x;
+
+		x = *src >> 4;
+		*dst ++ = (char)(x + '0' + (((x + 6) >> 4) * 0x27));
+		x = *src ++ & 0x0F;
+		*dst ++ = (char)(x + '0' + (((x + 6) >> 4) * 0x27));
+	}
+}
+
+/*
+ * Format one record into the arena, which must have at least
+ * EXPORT_ROW_MAX bytes of reserved room.
+ */
+static void
+export_row(phc_arena *a, size_t line_num, const argon2i_params *pp, int json)
+{
+#define PUT(str)   do { \
+		memcpy(dst, str, sizeof(str) - 1); \
+		dst += sizeof(str) - 1; \
+	} while (0)
+
+#define NUM(x)   do { \
+		dst += encode_decimal(dst, 21, (x)); \
+	} while (0)
+
+#define HEX(buf, len)   do { \
+		to_hex(dst, buf, len); \
+		dst += (len) << 1; \
+	} while (0)
+
+	char *dst;
+
+	dst = a->buf + a->len;
+	if (json) {
+		PUT("{\"line\":");
+		NUM(line_num);
+		PUT(",\"m\":");
+		NUM(pp->m);
+		PUT(",\"t\":");
+		NUM(pp->t);
+		PUT(",\"p\":");
+		NUM(pp->p);
+		PUT(",\"keyid\":\"");
+		HEX(pp->key_id, pp->key_id_len);
+		PUT("\",\"data\":\"");
+		HEX(pp->associated_data, pp->associated_data_len);
+		PUT("\",\"salt\":\"");
+		HEX(pp->salt, pp->salt_len);
+		PUT("\",\"output\":\"");
+		HEX(pp->output, pp->output_len);
+		PUT("\"}\n");
+	} else {
+		NUM(line_num);
+		PUT(",");
+		NUM(pp->m);
+		PUT(",");
+		NUM(pp->t);
+		PUT(",");
+		NUM(pp->p);
+		PUT(",");
+		HEX(pp->key_id, pp->key_id_len);
+		PUT(",");
+		HEX(pp->associated_data, pp->associated_data_len);
+		PUT(",");
+		HEX(pp->salt, pp->salt_len);
+		PUT(",");
+		HEX(pp->output, pp->output_len);
+		PUT("\n");
+	}
+	a->len = (size_t)(dst - a->buf);
+
+#undef PUT
+#undef NUM
+#undef HEX
+}
+
+typedef struct {
+	dump_chunk *chunks;
+	size_t num_chunks;
+	size_t *next;
+	phc_arena *out;
+	int json;
+	int alloc_failed;
+	argon2i_bulk_stats st;
+} export_worker;
+
+static void *
+export_worker_run(void *arg)
+{
+	export_worker *w;
+	size_t c;
+
+	w = arg;
+	while ((c = claim_next(w->next)) < w->num_chunks) {
+		dump_chunk *ch;
+		phc_arena *a;
+		const char *cur, *line;
+		size_t line_len, row;
+
+		ch = &w->chunks[c];
+		a = &w->out[c];
+		a->len = 0;
+		cur = ch->start;
+		row = ch->first_row;
+		while (next_line(&cur, ch->end, &line, &line_len)) {
+			argon2i_params pp;
+			int err;
+
+			row ++;
+			w->st.rows ++;
+			err = argon2i_decode_string_err(&pp, line, line_len);
+			w->st.status[err] ++;
+			if (err != ARGON2I_OK) {
+				continue;
+			}
+			if (!phc_arena_reserve(a, EXPORT_ROW_MAX)) {
+				w->alloc_failed = 1;
+				return NULL;
+			}
+			export_row(a, row, &pp, w->json);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Export the valid Argon2i strings of a dump to 'out', as CSV (with a
+ * header line) if 'json' is 0, as JSON lines otherwise, using
+ * 'num_threads' threads. If 'st' is not NULL, it receives the decoding
+ * statistics. Returned value is 1 on success, 0 on allocation or write
+ * error.
+ */
+int
+phc_export(FILE *out, const char *buf, size_t len, unsigned num_threads,
+	int json, argon2i_bulk_stats *st)
+{
+	static const char header[] = "line,m,t,p,keyid,data,salt,output\n";
+	phc_arena *arenas;
+	export_worker *w;
+	argon2i_bulk_stats total;
+	const char *cur, *end;
+	size_t max_chunks, base, u;
+	unsigned v;
+	int ok;
+
+	memset(&total, 0, sizeof total);
+	if (num_threads < 1) {
+		num_threads = 1;
+	}
+	max_chunks = (size_t)num_threads * 8;
+	arenas = malloc(max_chunks * sizeof *arenas);
+	w = calloc(num_threads, sizeof *w);
+	if (arenas == NULL || w == NULL) {
+		free(arenas);
+		free(w);
+		return 0;
+	}
+	for (u = 0; u < max_chunks; u ++) {
+		phc_arena_init(&arenas[u]);
+	}
+	ok = json || fwrite(header, 1, sizeof header - 1, out)
+		== sizeof header - 1;
+	cur = buf;
+	end = buf + len;
+	base = 0;
+	while (ok && cur < end) {
+		const char *wend;
+		dump_chunk *chunks;
+		size_t num_chunks, next, rows;
+		unsigned nt;
+
+		if ((size_t)(end - cur) <= EXPORT_WINDOW) {
+			wend = end;
+		} else {
+			wend = memchr(cur + EXPORT_WINDOW, '\n',
+				(size_t)(end - cur) - EXPORT_WINDOW);
+			wend = wend == NULL ? end : wend + 1;
+		}
+		chunks = split_dump(cur, (size_t)(wend - cur),
+			num_threads, &num_chunks);
+		if (chunks == NULL) {
+			ok = 0;
+			break;
+		}
+		nt = num_threads > num_chunks ? (unsigned)num_chunks : num_threads;
+		rows = number_chunks(chunks, num_chunks, nt);
+		if (rows == (size_t)-1) {
+			free(chunks);
+			ok = 0;
+			break;
+		}
+		for (u = 0; u < num_chunks; u ++) {
+			chunks[u].first_row += base;
+		}
+		next = 0;
+		for (v = 0; v < nt; v ++) {
+			memset(&w[v], 0, sizeof w[v]);
+			w[v].chunks = chunks;
+			w[v].num_chunks = num_chunks;
+			w[v].next = &next;
+			w[v].out = arenas;
+			w[v].json = json;
+		}
+		run_workers(export_worker_run, w, sizeof *w, nt);
+		for (v = 0; v < nt; v ++) {
+			int e;
+
+			ok &= !w[v].alloc_failed;
+			total.rows += w[v].st.rows;
+			for (e = 0; e < ARGON2I_ERR_NUM; e ++) {
+				total.status[e] += w[v].st.status[e];
+			}
+		}
+		for (u = 0; ok && u < num_chunks; u ++) {
+			ok = fwrite(arenas[u].buf, 1, arenas[u].len, out)
+				== arenas[u].len;
+		}
+		free(chunks);
+		base += rows;
+		cur = wend;
+	}
+	for (u = 0; u < max_chunks; u ++) {
+		phc_arena_free(&arenas[u]);
+	}
+	free(arenas);
+	free(w);
+	if (st != NULL) {
+		*st = total;
+	}
+	return ok && !ferror(out);
+}
+
+/*
+ * Diff of two dumps of "key:hash" lines (e.g. a user identifier and its
+ * Argon2i hash string), before and after a rehash campaign. Rows are
+ * joined on the key; joined rows are compared on their decoded values,
+ * not on the hash strings. A row is "parameter-changed" if m, t, p,
+ * keyid or data differ, and otherwise "output-changed" if the salt or
+ * output differ.
+ *
+ * Both dumps are decoded in parallel (one record per row). Rows are then
+ * partitioned on their key hash into partitions sized to fit in cache,
+ * and worker threads join each partition with a small hash table.
+ * Lines without a ':' separator or with an invalid hash string are
+ * counted and ignored, and so are rows whose key already appeared in
+ * the same dump.
+ */
+
+#define DIFF_ADDED       0
+#define DIFF_REMOVED     1
+#define DIFF_PARAMS      2
+#define DIFF_OUTPUT      3
+#define DIFF_NUM         4
+
+/*
+ * Target partition size, in bytes of decoded rows.
+ */
+#define DIFF_PART_BYTES  ((size_t)256 << 10)
+
+/*
+ * Result of a diff. count[] holds the number of rows of each kind
+ * (DIFF_*), and samples[] the lowest line numbers of such rows (in the
+ * old dump for removed rows, in the new dump otherwise).
+ */
+typedef struct {
+	size_t old_rows;
+	size_t new_rows;
+	size_t old_invalid;
+	size_t new_invalid;
+	size_t dup_keys;
+	size_t unchanged;
+	size_t count[DIFF_NUM];
+	size_t samples[DIFF_NUM][SCAN_SAMPLES];
+	size_t num_samples[DIFF_NUM];
+} phc_diff_result;
+
+typedef struct {
+	const char *key;
+	size_t key_len;
+	uint64_t hash;
+	int valid;
+	argon2i_packed rec;
+} diff_row;
+
+/*
+ * One side of a diff: decoded rows, and row indices grouped by
+ * partition (those of partition i are idx[part[i]] to idx[part[i+1]-1]).
+ */
+typedef struct {
+	diff_row *rows;
+	size_t num_rows;
+	size_t *idx;
+	size_t *part;
+	size_t invalid;
+} diff_side;
+
+static uint64_t
+diff_key_hash(const char *key, size_t len)
+{
+	uint64_t h;
+	size_t u;
+
+	h = 0xCBF29CE484222325;
+	for (u = 0; u < len; u ++) {
+		h = (h ^ (unsigned char)key[u]) * 0x100000001B3;
+	}
+	h ^= h >> 32;
+	h *= 0x9E3779B97F4A7C15;
+	return h ^ (h >> 29);
+}
+
+typedef struct {
+	dump_chunk *chunks;
+	size_t num_chunks;
+	size_t *next;
+	diff_row *rows;
+	size_t invalid;
+} diff_parse_worker;
+
+static void *
+diff_parse_worker_run(void *arg)
+{
+	diff_parse_worker *w;
+	size_t c;
+
+	w = arg;
+	while ((c = claim_next(w->next)) < w->num_chunks) {
+		dump_chunk *ch;
+		const char *cur, *line, *sep;
+		size_t line_len, row;
+
+		ch = &w->chunks[c];
+		cur = ch->start;
+		row = ch->first_row;
+		while (next_line(&cur, ch->end, &line, &line_len)) {
+			diff_row *dr;
+			argon2i_params pp;
+
+			dr = &w->rows[row ++];
+			sep = memchr(line, ':', line_len);
+			dr->valid = sep != NULL
+				&& argon2i_decode_string_len(&pp, sep + 1,
+					(size_t)(line + line_len - sep - 1))
+				&& argon2i_pack(&dr->rec, &pp);
+			if (!dr->valid) {
+				w->invalid ++;
+				continue;
+			}
+			dr->key = line;
+			dr->key_len = (size_t)(sep - line);
+			dr->hash = diff_key_hash(line, dr->key_len);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Decode one dump and partition its rows into 2^bits partitions.
+ * Returned value is 1 on success, 0 on allocation failure.
+ */
+static int
+diff_side_load(diff_side *ds, const char *buf, size_t len,
+	unsigned num_threads)
+{
+	dump_chunk *chunks;
+	diff_parse_worker *w;
+	size_t num_chunks, next;
+	unsigned v;
+
+	memset(ds, 0, sizeof *ds);
+	chunks = split_dump(buf, len, num_threads, &num_chunks);
+	if (chunks == NULL) {
+		return 0;
+	}
+	if (num_threads > num_chunks) {
+		num_threads = num_chunks > 0 ? (unsigned)num_chunks : 1;
+	}
+	ds->num_rows = number_chunks(chunks, num_chunks, num_threads);
+	if (ds->num_rows == (size_t)-1
+		|| ds->num_rows > (size_t)-1 / sizeof *ds->rows)
+	{
+		free(chunks);
+		return 0;
+	}
+	ds->rows = malloc(ds->num_rows * sizeof *ds->rows + 1);
+	w = calloc(num_threads, sizeof *w);
+	if (ds->rows == NULL || w == NULL) {
+		free(ds->rows);
+		free(w);
+		free(chunks);
+		return 0;
+	}
+	next = 0;
+	for (v = 0; v < num_threads; v ++) {
+		w[v].chunks = chunks;
+		w[v].num_chunks = num_chunks;
+		w[v].next = &next;
+		w[v].rows = ds->rows;
+	}
+	run_workers(diff_parse_worker_run, w, sizeof *w, num_threads);
+	for (v = 0; v < num_threads; v ++) {
+		ds->invalid += w[v].invalid;
+	}
+	free(w);
+	free(chunks);
+	return 1;
+}
+
+/*
+ * Group the valid rows of a side by partition (counting sort on the
+ * upper 'bits' bits of the key hash).
+ */
+static int
+diff_side_partition(diff_side *ds, unsigned bits)
+{
+	size_t num_parts, u;
+
+	num_parts = (size_t)1 << bits;
+	ds->part = calloc(num_parts + 1, sizeof *ds->part);
+	ds->idx = malloc((ds->num_rows - ds->invalid) * sizeof *ds->idx + 1);
+	if (ds->part == NULL || ds->idx == NULL) {
+		return 0;
+	}
+	for (u = 0; u < ds->num_rows; u ++) {
+		if (ds->rows[u].valid) {
+			ds->part[(ds->rows[u].hash >> 1 >> (63 - bits)) + 1] ++;
+		}
+	}
+	for (u = 0; u < num_parts; u ++) {
+		ds->part[u + 1] += ds->part[u];
+	}
+	for (u = 0; u < ds->num_rows; u ++) {
+		if (ds->rows[u].valid) {
+			ds->idx[ds->part[ds->rows[u].hash >> 1 >> (63 - bits)] ++]
+				= u;
+		}
+	}
+
+	/*
+	 * The counters now hold the partition ends; shift them back.
+	 */
+	for (u = num_parts; u > 0; u --) {
+		ds->part[u] = ds->part[u - 1];
+	}
+	ds->part[0] = 0;
+	return 1;
+}
+
+static void
+diff_side_free(diff_side *ds)
+{
+	free(ds->rows);
+	free(ds->idx);
+	free(ds->part);
+}
+
+static int
+diff_params_eq(const argon2i_packed *a, const argon2i_packed *b)
+{
+	return a->m == b->m && a->t == b->t && a->p == b->p
+		&& a->key_id_len == b->key_id_len
+		&& a->associated_data_len == b->associated_data_len
+		&& memcmp(a->key_id, b->key_id, a->key_id_len) == 0
+		&& memcmp(a->associated_data, b->associated_data,
+			a->associated_data_len) == 0;
+}
+
+static int
+diff_output_eq(const argon2i_packed *a, const argon2i_packed *b)
+{
+	return a->salt_len == b->salt_len && a->output_len == b->output_len
+		&& memcmp(a->salt, b->salt, a->salt_len) == 0
+		&& memcmp(a->output, b->output, a->output_len) == 0;
+}
+
+/*
+ * Join table entry: row indices in the old and new dumps ((size_t)-1
+ * if absent); an entry with no old row and no new row is free.
+ */
+typedef struct {
+	uint64_t hash;
+	size_t old_row;
+	size_t new_row;
+} diff_entry;
+
+typedef struct {
+	const diff_side *old_side;
+	const diff_side *new_side;
+	size_t num_parts;
+	size_t *next;
+	diff_entry *table;
+	size_t table_cap;
+	int alloc_failed;
+	phc_diff_result r;
+} diff_join_worker;
+
+/*
+ * Find the entry for a row's key in the join table; a new entry is
+ * returned if there is none yet.
+ */
+static diff_entry *
+diff_lookup(diff_join_worker *w, const diff_side *ds, size_t row,
+	size_t mask)
+{
+	const diff_row *dr;
+	size_t u;
+
+	dr = &ds->rows[row];
+	for (u = (size_t)dr->hash & mask;; u = (u + 1) & mask) {
+		diff_entry *e;
+		const diff_row *er;
+
+		e = &w->table[u];
+		if (e->old_row == (size_t)-1 && e->new_row == (size_t)-1) {
+			e->hash = dr->hash;
+			return e;
+		}
+		if (e->hash != dr->hash) {
+			continue;
+		}
+		er = e->old_row != (size_t)-1
+			? &w->old_side->rows[e->old_row]
+			: &w->new_side->rows[e->new_row];
+		if (er->key_len == dr->key_len
+			&& memcmp(er->key, dr->key, dr->key_len) == 0)
+		{
+			return e;
+		}
+	}
+}
+
+static void
+diff_report(phc_diff_result *r, int kind, size_t row)
+{
+	r->count[kind] ++;
+	sample_insert(r->samples[kind], &r->num_samples[kind], row + 1);
+}
+
+static void *
+diff_join_worker_run(void *arg)
+{
+	diff_join_worker *w;
+	size_t c;
+
+	w = arg;
+	while ((c = claim_next(w->next)) < w->num_parts) {
+		const diff_side *os, *ns;
+		size_t n, cap, u;
+
+		os = w->old_side;
+		ns = w->new_side;
+		n = (os->part[c + 1] - os->part[c])
+			+ (ns->part[c + 1] - ns->part[c]);
+		for (cap = 16; cap < (n << 1); cap <<= 1);
+		if (cap > w->table_cap) {
+			free(w->table);
+			w->table = malloc(cap * sizeof *w->table);
+			if (w->table == NULL) {
+				w->table_cap = 0;
+				w->alloc_failed = 1;
+				return NULL;
+			}
+			w->table_cap = cap;
+		}
+		memset(w->table, 0xFF, cap * sizeof *w->table);
+		for (u = os->part[c]; u < os->part[c + 1]; u ++) {
+			diff_entry *e;
+
+			e = diff_lookup(w, os, os->idx[u], cap - 1);
+			if (e->old_row != (size_t)-1) {
+				w->r.dup_keys ++;
+			} else {
+				e->old_row = os->idx[u];
+			}
+		}
+		for (u = ns->part[c]; u < ns->part[c + 1]; u ++) {
+			diff_entry *e;
+
+			e = diff_lookup(w, ns, ns->idx[u], cap - 1);
+			if (e->new_row != (size_t)-1) {
+				w->r.dup_keys ++;
+			} else {
+				e->new_row = ns->idx[u];
+			}
+		}
+		for (u = 0; u < cap; u ++) {
+			diff_entry *e;
+			const argon2i_packed *a, *b;
+
+			e = &w->table[u];
+			if (e->old_row == (size_t)-1) {
+				if (e->new_row != (size_t)-1) {
+					diff_report(&w->r, DIFF_ADDED, e->new_row);
+				}
+				continue;
+			}
+			if (e->new_row == (size_t)-1) {
+				diff_report(&w->r, DIFF_REMOVED, e->old_row);
+				continue;
+			}
+			a = &os->rows[e->old_row].rec;
+			b = &ns->rows[e->new_row].rec;
+			if (!diff_params_eq(a, b)) {
+				diff_report(&w->r, DIFF_PARAMS, e->new_row);
+			} else if (!diff_output_eq(a, b)) {
+				diff_report(&w->r, DIFF_OUTPUT, e->new_row);
+			} else {
+				w->r.unchanged ++;
+			}
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Diff two dumps, with 'num_threads' threads. Returned value is 1 on
+ * success, 0 on allocation failure.
+ */
+int
+phc_diff(const char *old_buf, size_t old_len,
+	const char *new_buf, size_t new_len,
+	unsigned num_threads, phc_diff_result *r)
+{
+	diff_side os, ns;
+	diff_join_worker *w;
+	size_t next, total, u;
+	unsigned bits, v;
+	int ok, k;
+
+	memset(r, 0, sizeof *r);
+	if (num_threads < 1) {
+		num_threads = 1;
+	}
+	if (!diff_side_load(&os, old_buf, old_len, num_threads)) {
+		return 0;
+	}
+	if (!diff_side_load(&ns, new_buf, new_len, num_threads)) {
+		diff_side_free(&os);
+		return 0;
+	}
+
+	/*
+	 * At least 4 partitions per thread, for load balancing; more if
+	 * needed to keep partitions within the target size.
+	 */
+	total = (os.num_rows - os.invalid) + (ns.num_rows - ns.invalid);
+	for (bits = 0; bits < 24; bits ++) {
+		if (((size_t)1 << bits) >= (size_t)num_threads * 4
+			&& (total >> bits) * sizeof(diff_row) <= DIFF_PART_BYTES)
+		{
+			break;
+		}
+	}
+	w = calloc(num_threads, sizeof *w);
+	ok = w != NULL
+		&& diff_side_partition(&os, bits)
+		&& diff_side_partition(&ns, bits);
+	if (ok) {
+		next = 0;
+		for (v = 0; v < num_threads; v ++) {
+			w[v].old_side = &os;
+			w[v].new_side = &ns;
+			w[v].num_parts = (size_t)1 << bits;
+			w[v].next = &next;
+		}
+		run_workers(diff_join_worker_run, w, sizeof *w, num_threads);
+		r->old_rows = os.num_rows;
+		r->new_rows = ns.num_rows;
+		r->old_invalid = os.invalid;
+		r->new_invalid = ns.invalid;
+		for (v = 0; v < num_threads; v ++) {
+			phc_diff_result *wr;
+
+			wr = &w[v].r;
+			ok &= !w[v].alloc_failed;
+			r->dup_keys += wr->dup_keys;
+			r->unchanged += wr->unchanged;
+			for (k = 0; k < DIFF_NUM; k ++) {
+				r->count[k] += wr->count[k];
+				for (u = 0; u < wr->num_samples[k]; u ++) {
+					sample_insert(r->samples[k],
+						&r->num_samples[k],
+						wr->samples[k][u]);
+				}
+			}
+			free(w[v].table);
+		}
+	}
+	free(w);
+	diff_side_free(&os);
+	diff_side_free(&ns);
+	return ok;
+}
+
+/*
+ * Columnar binary store. Hash strings are stored decoded, in a file
+ * that can be memory-mapped and accessed by row index without parsing
+ * or copying. All integers are little-endian. The layout is:
+ *
+ *   header (96 bytes):
+ *      0   magic "PHCSTOR1"
+ *      8   number of rows (64 bits)
+ *     16   number of distinct parameter tuples (64 bits)
+ *     24   offset of the tuple dictionary (64 bits)
+ *     32   offset of the tuple column (64 bits)
+ *     40   offset of the length column (64 bits)
+ *     48   offset of the salt column (64 bits)
+ *     56   offset of the output column (64 bits)
+ *     64   offset of the spill index (64 bits)
+ *     72   number of spill index entries (64 bits)
+ *     80   offset of the spill area (64 bits)
+ *     88   length of the spill area (64 bits)
+ *
+ *   tuple dictionary: one 56-byte entry per distinct (m, t, p, keyid,
+ *   data) tuple: m (32 bits), t (32 bits), p, keyid length, data length
+ *   (one byte each), one zero byte, keyid (8 bytes, zero-padded), data
+ *   (32 bytes, zero-padded), four zero bytes;
+ *
+ *   tuple column: one 32-bit dictionary index per row;
+ *
+ *   length column: salt length and output length (one byte each) per
+ *   row (0 means "absent");
+ *
+ *   salt column: 16 bytes per row, holding the salt if it is 16 bytes
+ *   long (the default size), zeros otherwise;
+ *
+ *   output column: 32 bytes per row, holding the output if it is 32
+ *   bytes long (the default size), zeros otherwise;
+ *
+ *   spill index: for each row with a salt or output of non-default
+ *   size, in increasing row order, the row index and the offset of its
+ *   data within the spill area (64 bits each);
+ *
+ *   spill area: for each such row, the salt (if its size is not 0 or
+ *   16) followed by the output (if its size is not 0 or 32).
+ *
+ * Sections start at 16-byte aligned offsets.
+ */
+
+#define STORE_HEADER_LEN   96
+#define STORE_DICT_LEN     56
+#define STORE_SALT_LEN     16
+#define STORE_OUTPUT_LEN   32
+
+static int
+store_spills(const argon2i_params *pp)
+{
+	return (pp->salt_len != 0 && pp->salt_len != STORE_SALT_LEN)
+		|| (pp->output_len != 0 && pp->output_len != STORE_OUTPUT_LEN);
+}
+
+static size_t
+store_spill_len(const argon2i_params *pp)
+{
+	size_t len;
+
+	len = 0;
+	if (pp->salt_len != STORE_SALT_LEN) {
+		len += pp->salt_len;
+	}
+	if (pp->output_len != STORE_OUTPUT_LEN) {
+		len += pp->output_len;
+	}
+	return len;
+}
+
+static size_t
+align16(size_t x)
+{
+	return (x + 15) & ~(size_t)15;
+}
+
+/*
+ * Dictionary of parameter tuples being built: serialized entries, and
+ * an open-addressing table of entry indices (plus one; 0 = empty slot).
+ */
+typedef struct {
+	unsigned char *entries;
+	size_t num;
+	size_t cap;
+	uint32_t *slots;
+	size_t slots_cap;
+} store_dict;
+
+static uint32_t
+store_dict_hash(const unsigned char *e)
+{
+	uint32_t h;
+	int i;
+
+	h = 2166136261u;
+	for (i = 0; i < STORE_DICT_LEN; i ++) {
+		h = (h ^ e[i]) * 16777619u;
+	}
+	return h;
+}
+
+/*
+ * Look up a serialized tuple, adding it if needed. Returned value is
+ * the tuple index, or (size_t)-1 on allocation failure.
+ */
+static size_t
+store_dict_add(store_dict *d, const unsigned char *e)
+{
+	size_t u, mask;
+
+	if (d->num >= (d->slots_cap >> 1)) {
+		uint32_t *ns;
+		size_t ncap, v;
+
+		ncap = d->slots_cap == 0 ? 64 : d->slots_cap << 1;
+		ns = calloc(ncap, sizeof *ns);
+		if (ns == NULL) {
+			return (size_t)-1;
+		}
+		for (v = 0; v < d->num; v ++) {
+			u = store_dict_hash(d->entries + v * STORE_DICT_LEN)
+				& (ncap - 1);
+			while (ns[u] != 0) {
+				u = (u + 1) & (ncap - 1);
+			}
+			ns[u] = (uint32_t)(v + 1);
+		}
+		free(d->slots);
+		d->slots = ns;
+		d->slots_cap = ncap;
+	}
+	mask = d->slots_cap - 1;
+	for (u = store_dict_hash(e) & mask;; u = (u + 1) & mask) {
+		size_t idx;
+
+		if (d->slots[u] == 0) {
+			break;
+		}
+		idx = d->slots[u] - 1;
+		if (memcmp(d->entries + idx * STORE_DICT_LEN,
+			e, STORE_DICT_LEN) == 0)
+		{
+			return idx;
+		}
+	}
+	if (d->num == d->cap) {
+		unsigned char *ne;
+		size_t ncap;
+
+		ncap = d->cap == 0 ? 16 : d->cap << 1;
+		ne = realloc(d->entries, ncap * STORE_DICT_LEN);
+		if (ne == NULL) {
+			return (size_t)-1;
+		}
+		d->entries = ne;
+		d->cap = ncap;
+	}
+	memcpy(d->entries + d->num * STORE_DICT_LEN, e, STORE_DICT_LEN);
+	d->slots[u] = (uint32_t)(d->num + 1);
+	return d->num ++;
+}
+
+static void
+store_dict_entry(unsigned char *e, const argon2i_params *pp)
+{
+	memset(e, 0, STORE_DICT_LEN);
+	enc32le(e, (uint32_t)pp->m);
+	enc32le(e + 4, (uint32_t)pp->t);
+	e[8] = (unsigned char)pp->p;
+	e[9] = (unsigned char)pp->key_id_len;
+	e[10] = (unsigned char)pp->associated_data_len;
+	memcpy(e + 12, pp->key_id, pp->key_id_len);
+	memcpy(e + 20, pp->associated_data, pp->associated_data_len);
+}
+
+/*
+ * Build a columnar store from 'n' hash strings (string i has lens[i]
+ * characters, starting at strs[i]), and append it to the arena 'out'.
+ * Every string must be a valid Argon2i hash string; otherwise, 0 is
+ * returned and, if 'bad_row' is not NULL, the index of the first
+ * invalid string is written in '*bad_row'. Returned value is 1 on
+ * success, 0 on error (invalid string or allocation failure; the arena
+ * length is then unchanged).
+ */
+int
+phc_store_build(phc_arena *out, const char *const *strs, const size_t *lens,
+	size_t n, size_t *bad_row)
+{
+	store_dict d;
+	uint32_t *tuples;
+	size_t u, num_spills, spill_len, total;
+	size_t dict_off, tuple_off, len_off, salt_off, output_off;
+	size_t spill_idx_off, spill_off, base, spill_pos, spill_num;
+	unsigned char *buf, e[STORE_DICT_LEN];
+	argon2i_params pp;
+
+	/*
+	 * First pass: decode all strings, build the dictionary and
+	 * compute the spill area size.
+	 */
+	memset(&d, 0, sizeof d);
+	tuples = malloc((n + 1) * sizeof *tuples);
+	if (tuples == NULL) {
+		return 0;
+	}
+	num_spills = 0;
+	spill_len = 0;
+	for (u = 0; u < n; u ++) {
+		size_t idx;
+
+		if (!argon2i_decode_string_len(&pp, strs[u], lens[u])) {
+			if (bad_row != NULL) {
+				*bad_row = u;
+			}
+			goto fail;
+		}
+		store_dict_entry(e, &pp);
+		idx = store_dict_add(&d, e);
+		if (idx == (size_t)-1) {
+			goto fail;
+		}
+		tuples[u] = (uint32_t)idx;
+		if (store_spills(&pp)) {
+			num_spills ++;
+			spill_len += store_spill_len(&pp);
+		}
+	}
+
+	dict_off = STORE_HEADER_LEN;
+	tuple_off = align16(dict_off + d.num * STORE_DICT_LEN);
+	len_off = align16(tuple_off + n * 4);
+	salt_off = align16(len_off + n * 2);
+	output_off = align16(salt_off + n * STORE_SALT_LEN);
+	spill_idx_off = align16(output_off + n * STORE_OUTPUT_LEN);
+	spill_off = align16(spill_idx_off + num_spills * 16);
+	total = align16(spill_off + spill_len);
+	if (!phc_arena_reserve(out, total)) {
+		goto fail;
+	}
+	base = out->len;
+	buf = (unsigned char *)out->buf + base;
+	memset(buf, 0, total);
+	memcpy(buf, "PHCSTOR1", 8);
+	enc64le(buf + 8, n);
+	enc64le(buf + 16, d.num);
+	enc64le(buf + 24, dict_off);
+	enc64le(buf + 32, tuple_off);
+	enc64le(buf + 40, len_off);
+	enc64le(buf + 48, salt_off);
+	enc64le(buf + 56, output_off);
+	enc64le(buf + 64, spill_idx_off);
+	enc64le(buf + 72, num_spills);
+	enc64le(buf + 80, spill_off);
+	enc64le(buf + 88, spill_len);
+	memcpy(buf + dict_off, d.entries, d.num * STORE_DICT_LEN);
+
+	/*
+	 * Second pass: decode again, and write each field into its
+	 * column.
+	 */
+	spill_pos = 0;
+	spill_num = 0;
+	for (u = 0; u < n; u ++) {
+		unsigned char *sp;
+
+		argon2i_decode_string_len(&pp, strs[u], lens[u]);
+		enc32le(buf + tuple_off + u * 4, tuples[u]);
+		buf[len_off + u * 2] = (unsigned char)pp.salt_len;
+		buf[len_off + u * 2 + 1] = (unsigned char)pp.output_len;
+		if (pp.salt_len == STORE_SALT_LEN) {
+			memcpy(buf + salt_off + u * STORE_SALT_LEN,
+				pp.salt, STORE_SALT_LEN);
+		}
+		if (pp.output_len == STORE_OUTPUT_LEN) {
+			memcpy(buf + output_off + u * STORE_OUTPUT_LEN,
+				pp.output, STORE_OUTPUT_LEN);
+		}
+		if (!store_spills(&pp)) {
+			continue;
+		}
+		enc64le(buf + spill_idx_off + spill_num * 16, u);
+		enc64le(buf + spill_idx_off + spill_num * 16 + 8, spill_pos);
+		spill_num ++;
+		sp = buf + spill_off + spill_pos;
+		if (pp.salt_len != STORE_SALT_LEN) {
+			memcpy(sp, pp.salt, pp.salt_len);
+			sp += pp.salt_len;
+		}
+		if (pp.output_len != STORE_OUTPUT_LEN) {
+			memcpy(sp, pp.output, pp.output_len);
+		}
+		spill_pos += store_spill_len(&pp);
+	}
+	out->len += total;
+	free(tuples);
+	free(d.entries);
+	free(d.slots);
+	return 1;
+
+fail:
+	free(tuples);
+	free(d.entries);
+	free(d.slots);
+	return 0;
+}
+
+/*
+ * An opened store (pointers into the caller's buffer, which is
+ * typically a memory-mapped file).
+ */
+typedef struct {
+	const unsigned char *buf;
+	size_t num_rows;
+	size_t num_tuples;
+	const unsigned char *dict;
+	const unsigned char *tuples;
+	const unsigned char *lens;
+	const unsigned char *salts;
+	const unsigned char *outputs;
+	const unsigned char *spill_idx;
+	size_t num_spills;
+	const unsigned char *spill;
+	size_t spill_len;
+} phc_store;
+
+/*
+ * Check that a section of 'num' elements of 'elt_len' bytes, at offset
+ * 'off', fits in a buffer of 'len' bytes.
+ */
+static int
+store_section_ok(uint64_t off, uint64_t num, size_t elt_len, size_t len)
+{
+	return off <= len && num <= (len - off) / elt_len;
+}
+
+/*
+ * Open a store contained in 'buf' (of length 'len'); the buffer must
+ * remain valid while the store is used. The header is checked for
+ * consistency with the buffer length. Returned value is 1 on success,
+ * 0 if the buffer does not contain a valid store.
+ */
+int
+phc_store_open(phc_store *st, const void *buf, size_t len)
+{
+	const unsigned char *b;
+	uint64_t rows, tuples, spills, spill_len;
+
+	b = buf;
+	if (len < STORE_HEADER_LEN || memcmp(b, "PHCSTOR1", 8) != 0) {
+		return 0;
+	}
+	rows = dec64le(b + 8);
+	tuples = dec64le(b + 16);
+	spills = dec64le(b + 72);
+	spill_len = dec64le(b + 88);
+	if (!store_section_ok(dec64le(b + 24), tuples, STORE_DICT_LEN, len)
+		|| !store_section_ok(dec64le(b + 32), rows, 4, len)
+		|| !store_section_ok(dec64le(b + 40), rows, 2, len)
+		|| !store_section_ok(dec64le(b + 48), rows, STORE_SALT_LEN, len)
+		|| !store_section_ok(dec64le(b + 56), rows,
+			STORE_OUTPUT_LEN, len)
+		|| !store_section_ok(dec64le(b + 64), spills, 16, len)
+		|| !store_section_ok(dec64le(b + 80), spill_len, 1, len))
+	{
+		return 0;
+	}
+	st->buf = b;
+	st->num_rows = (size_t)rows;
+	st->num_tuples = (size_t)tuples;
+	st->dict = b + dec64le(b + 24);
+	st->tuples = b + dec64le(b + 32);
+	st->lens = b + dec64le(b + 40);
+	st->salts = b + dec64le(b + 48);
+	st->outputs = b + dec64le(b + 56);
+	st->spill_idx = b + dec64le(b + 64);
+	st->num_spills = (size_t)spills;
+	st->spill = b + dec64le(b + 80);
+	st->spill_len = (size_t)spill_len;
+	return 1;
+}
+
+/*
+ * A row of a store, as pointers into the store buffer (no copy).
+ */
+typedef struct {
+	const unsigned char *tuple;
+	const unsigned char *salt;
+	size_t salt_len;
+	const unsigned char *output;
+	size_t output_len;
+} phc_store_row;
+
+/*
+ * Get row 'row' of a store. Returned value is 1 on success, 0 if the
+ * row does not exist or the store contents are inconsistent.
+ */
+int
+phc_store_get_row(const phc_store *st, size_t row, phc_store_row *r)
+{
+	uint32_t idx;
+	const unsigned char *sp;
+
+	if (row >= st->num_rows) {
+		return 0;
+	}
+	idx = dec32le(st->tuples + row * 4);
+	if (idx >= st->num_tuples) {
+		return 0;
+	}
+	r->tuple = st->dict + (size_t)idx * STORE_DICT_LEN;
+	r->salt_len = st->lens[row * 2];
+	r->output_len = st->lens[row * 2 + 1];
+	r->salt = st->salts + row * STORE_SALT_LEN;
+	r->output = st->outputs + row * STORE_OUTPUT_LEN;
+	if ((r->salt_len != 0 && r->salt_len != STORE_SALT_LEN)
+		|| (r->output_len != 0 && r->output_len != STORE_OUTPUT_LEN))
+	{
+		size_t lo, hi, need;
+		uint64_t off;
+
+		/*
+		 * Binary search in the spill index.
+		 */
+		lo = 0;
+		hi = st->num_spills;
+		while (lo < hi) {
+			size_t mid;
+
+			mid = lo + ((hi - lo) >> 1);
+			if (dec64le(st->spill_idx + mid * 16) < row) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+		if (lo == st->num_spills
+			|| dec64le(st->spill_idx + lo * 16) != row)
+		{
+			return 0;
+		}
+		off = dec64le(st->spill_idx + lo * 16 + 8);
+		need = (r->salt_len != STORE_SALT_LEN ? r->salt_len : 0)
+			+ (r->output_len != STORE_OUTPUT_LEN ? r->output_len : 0);
+		if (off > st->spill_len || need > st->spill_len - off) {
+			return 0;
+		}
+		sp = st->spill + off;
+		if (r->salt_len != STORE_SALT_LEN) {
+			r->salt = sp;
+			sp += r->salt_len;
+		}
+		if (r->output_len != STORE_OUTPUT_LEN) {
+			r->output = sp;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Get row 'row' of a store as an argon2i_params structure. Returned
+ * value is 1 on success, 0 on error.
+ */
+int
+phc_store_get(const phc_store *st, size_t row, argon2i_params *pp)
+{
+	phc_store_row r;
+	const unsigned char *e;
+
+	if (!phc_store_get_row(st, row, &r)) {
+		return 0;
+	}
+	e = r.tuple;
+	if (e[9] > sizeof pp->key_id || e[10] > sizeof pp->associated_data
+		|| r.salt_len > sizeof pp->salt
+		|| r.output_len > sizeof pp->output)
+	{
+		return 0;
+	}
+	pp->m = dec32le(e);
+	pp->t = dec32le(e + 4);
+	pp->p = e[8];
+	pp->key_id_len = e[9];
+	pp->associated_data_len = e[10];
+	memcpy(pp->key_id, e + 12, pp->key_id_len);
+	memcpy(pp->associated_data, e + 20, pp->associated_data_len);
+	pp->salt_len = r.salt_len;
+	memcpy(pp->salt, r.salt, r.salt_len);
+	pp->output_len = r.output_len;
+	memcpy(pp->output, r.output, r.output_len);
+	return 1;
+}
+
+/*
+ * Compressed bitmaps of row indices, used for posting lists. Rows are
+ * grouped by their upper 16 bits into containers; a container stores
+ * its lower 16 bits either as a sorted array (up to RB_ARRAY_MAX rows)
+ * or as a 65536-bit bitmap (when denser), so that both sparse and
+ * dense sets stay compact and support incremental insertion and
+ * removal.
+ */
+
+#define RB_ARRAY_MAX   4096
+
+typedef struct {
+	uint32_t key;
+	uint32_t card;
+	uint16_t *array;
+	uint32_t array_cap;
+	uint64_t *bits;
+} rb_container;
+
+typedef struct {
+	rb_container *c;
+	size_t num;
+	size_t cap;
+} rbitmap;
+
+static void
+rb_free(rbitmap *bm)
+{
+	size_t u;
+
+	for (u = 0; u < bm->num; u ++) {
+		free(bm->c[u].array);
+		free(bm->c[u].bits);
+	}
+	free(bm->c);
+	bm->c = NULL;
+	bm->num = 0;
+	bm->cap = 0;
+}
+
+/*
+ * Find the container for 'key'; if absent, the insertion position is
+ * written in '*pos' and NULL is returned.
+ */
+static rb_container *
+rb_find(const rbitmap *bm, uint32_t key, size_t *pos)
+{
+	size_t lo, hi;
+
+	lo = 0;
+	hi = bm->num;
+	while (lo < hi) {
+		size_t mid;
+
+		mid = lo + ((hi - lo) >> 1);
+		if (bm->c[mid].key < key) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	*pos = lo;
+	if (lo < bm->num && bm->c[lo].key == key) {
+		return &bm->c[lo];
+	}
+	return NULL;
+}
+
+/*
+ * Position of 'v' in a sorted array, or of its insertion point.
+ */
+static uint32_t
+rb_array_pos(const uint16_t *a, uint32_t n, uint16_t v)
+{
+	uint32_t lo, hi;
+
+	lo = 0;
+	hi = n;
+	while (lo < hi) {
+		uint32_t mid;
+
+		mid = lo + ((hi - lo) >> 1);
+		if (a[mid] < v) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/*
+ * Add 'row' to the bitmap. Returned value is 1 on success, 0 on
+ * allocation failure. Adding a row already present is a no-op.
+ */
+static int
+rb_add(rbitmap *bm, uint32_t row)
+{
+	rb_container *c;
+	size_t pos;
+	uint16_t low;
+	uint32_t i;
+
+	c = rb_find(bm, row >> 16, &pos);
+	if (c == NULL) {
+		if (bm->num == bm->cap) {
+			rb_container *nc;
+			size_t ncap;
+
+			ncap = bm->cap == 0 ? 4 : bm->cap << 1;
+			nc = realloc(bm->c, ncap * sizeof *nc);
+			if (nc == NULL) {
+				return 0;
+			}
+			bm->c = nc;
+			bm->cap = ncap;
+		}
+		memmove(&bm->c[pos + 1], &bm->c[pos],
+			(bm->num - pos) * sizeof *bm->c);
+		bm->num ++;
+		c = &bm->c[pos];
+		memset(c, 0, sizeof *c);
+		c->key = row >> 16;
+	}
+	low = (uint16_t)row;
+	if (c->bits != NULL) {
+		uint64_t m;
+
+		m = (uint64_t)1 << (low & 63);
+		c->card += (c->bits[low >> 6] & m) == 0;
+		c->bits[low >> 6] |= m;
+		return 1;
+	}
+	i = rb_array_pos(c->array, c->card, low);
+	if (i < c->card && c->array[i] == low) {
+		return 1;
+	}
+	if (c->card == RB_ARRAY_MAX) {
+		/*
+		 * Array is full: convert to a bitmap.
+		 */
+		uint64_t *bits;
+		uint32_t j;
+
+		bits = calloc(1024, sizeof *bits);
+		if (bits == NULL) {
+			return 0;
+		}
+		for (j = 0; j < c->card; j ++) {
+			bits[c->array[j] >> 6] |= (uint64_t)1 << (c->array[j] & 63);
+		}
+		bits[low >> 6] |= (uint64_t)1 << (low & 63);
+		free(c->array);
+		c->array = NULL;
+		c->array_cap = 0;
+		c->bits = bits;
+		c->card ++;
+		return 1;
+	}
+	if (c->card == c->array_cap) {
+		uint16_t *na;
+		uint32_t ncap;
+
+		ncap = c->array_cap == 0 ? 4 : c->array_cap << 1;
+		if (ncap > RB_ARRAY_MAX) {
+			ncap = RB_ARRAY_MAX;
+		}
+		na = realloc(c->array, ncap * sizeof *na);
+		if (na == NULL) {
+			return 0;
+		}
+		c->array = na;
+		c->array_cap = ncap;
+	}
+	memmove(&c->array[i + 1], &c->array[i],
+		(c->card - i) * sizeof *c->array);
+	c->array[i] = low;
+	c->card ++;
+	return 1;
+}
+
+/*
+ * Remove 'row' from the bitmap (no-op if absent). Bitmap containers
+ * are converted back to arrays when they become sparse enough; empty
+ * containers are released.
+ */
+static void
+rb_remove(rbitmap *bm, uint32_t row)
+{
+	rb_container *c;
+	size_t pos;
+	uint16_t low;
+
+	c = rb_find(bm, row >> 16, &pos);
+	if (c == NULL) {
+		return;
+	}
+	low = (uint16_t)row;
+	if (c->bits != NULL) {
+		uint64_t m;
+
+		m = (uint64_t)1 << (low & 63);
+		if ((c->bits[low >> 6] & m) == 0) {
+			return;
+		}
+		c->bits[low >> 6] &= ~m;
+		c->card --;
+		if (c->card <= RB_ARRAY_MAX / 2) {
+			uint16_t *na;
+			uint32_t j, n;
+
+			na = malloc(RB_ARRAY_MAX * sizeof *na);
+			if (na == NULL) {
+				/* Keep the bitmap form. */
+				return;
+			}
+			n = 0;
+			for (j = 0; j < 65536; j ++) {
+				if ((c->bits[j >> 6] >> (j & 63)) & 1) {
+					na[n ++] = (uint16_t)j;
+				}
+			}
+			free(c->bits);
+			c->bits = NULL;
+			c->array = na;
+			c->array_cap = RB_ARRAY_MAX;
+		}
+	} else {
+		uint32_t i;
+
+		i = rb_array_pos(c->array, c->card, low);
+		if (i == c->card || c->array[i] != low) {
+			return;
+		}
+		memmove(&c->array[i], &c->array[i + 1],
+			(c->card - i - 1) * sizeof *c->array);
+		c->card --;
+	}
+	if (c->card == 0) {
+		free(c->array);
+		free(c->bits);
+		memmove(&bm->c[pos], &bm->c[pos + 1],
+			(bm->num - pos - 1) * sizeof *bm->c);
+		bm->num --;
+	}
+}
+
+/*
+ * Call 'fn' on each row of the bitmap, in increasing order; iteration
+ * stops early if 'fn' returns 0. Returned value is 0 if iteration was
+ * stopped, 1 otherwise.
+ */
+static int
+rb_foreach(const rbitmap *bm, int (*fn)(void *ctx, size_t row), void *ctx)
+{
+	size_t u;
+
+	for (u = 0; u < bm->num; u ++) {
+		const rb_container *c;
+		size_t base;
+		uint32_t j;
+
+		c = &bm->c[u];
+		base = (size_t)c->key << 16;
+		if (c->bits == NULL) {
+			for (j = 0; j < c->card; j ++) {
+				if (!fn(ctx, base + c->array[j])) {
+					return 0;
+				}
+			}
+			continue;
+		}
+		for (j = 0; j < 1024; j ++) {
+			uint64_t w;
+
+			for (w = c->bits[j]; w != 0; w &= w - 1) {
+				unsigned b;
+
+				for (b = 0; ((w >> b) & 1) == 0; b ++);
+				if (!fn(ctx, base + (j << 6) + b)) {
+					return 0;
+				}
+			}
+		}
+	}
+	return 1;
+}
+
+/*
+ * Incremental parameter-tuple index: maps each distinct parameter tuple
+ * to the set of rows (a compressed bitmap) whose hash uses it. Rows are
+ * added, moved to another tuple (e.g. after a rehash) or removed
+ * individually. The 'count' field of each dictionary entry holds the
+ * current number of rows with that tuple, so that counting queries
+ * only scan the (small) dictionary; listing queries then visit only the
+ * postings of matching tuples.
+ */
+typedef struct {
+	param_tuple *tuples;
+	rbitmap *postings;
+	size_t num_tuples;
+	size_t cap_tuples;
+	uint32_t *slots;
+	size_t slots_cap;
+	uint32_t *row_tuple;
+	size_t rows_cap;
+} phc_tuple_index;
+
+#define TUPLE_NONE   ((uint32_t)0xFFFFFFFF)
+
+void
+phc_tuple_index_init(phc_tuple_index *idx)
+{
+	memset(idx, 0, sizeof *idx);
+}
+
+void
+phc_tuple_index_free(phc_tuple_index *idx)
+{
+	size_t u;
+
+	for (u = 0; u < idx->num_tuples; u ++) {
+		rb_free(&idx->postings[u]);
+	}
+	free(idx->tuples);
+	free(idx->postings);
+	free(idx->slots);
+	free(idx->row_tuple);
+	phc_tuple_index_init(idx);
+}
+
+/*
+ * Get the identifier of a tuple, adding it to the dictionary if needed.
+ * Returned value is TUPLE_NONE on allocation failure.
+ */
+static uint32_t
+tuple_index_id(phc_tuple_index *idx, const param_tuple *key)
+{
+	size_t u, mask;
+
+	if (idx->num_tuples >= (idx->slots_cap >> 1)) {
+		uint32_t *ns;
+		size_t ncap, v;
+
+		ncap = idx->slots_cap == 0 ? 64 : idx->slots_cap << 1;
+		ns = calloc(ncap, sizeof *ns);
+		if (ns == NULL) {
+			return TUPLE_NONE;
+		}
+		for (v = 0; v < idx->num_tuples; v ++) {
+			u = param_tuple_hash(&idx->tuples[v]) & (ncap - 1);
+			while (ns[u] != 0) {
+				u = (u + 1) & (ncap - 1);
+			}
+			ns[u] = (uint32_t)(v + 1);
+		}
+		free(idx->slots);
+		idx->slots = ns;
+		idx->slots_cap = ncap;
+	}
+	mask = idx->slots_cap - 1;
+	for (u = param_tuple_hash(key) & mask;; u = (u + 1) & mask) {
+		if (idx->slots[u] == 0) {
+			break;
+		}
+		if (param_tuple_eq(&idx->tuples[idx->slots[u] - 1], key)) {
+			return idx->slots[u] - 1;
+		}
+	}
+	if (idx->num_tuples == idx->cap_tuples) {
+		param_tuple *nt;
+		rbitmap *np;
+		size_t ncap;
+
+		ncap = idx->cap_tuples == 0 ? 16 : idx->cap_tuples << 1;
+		nt = realloc(idx->tuples, ncap * sizeof *nt);
+		if (nt == NULL) {
+			return TUPLE_NONE;
+		}
+		idx->tuples = nt;
+		np = realloc(idx->postings, ncap * sizeof *np);
+		if (np == NULL) {
+			return TUPLE_NONE;
+		}
+		idx->postings = np;
+		idx->cap_tuples = ncap;
+	}
+	idx->tuples[idx->num_tuples] = *key;
+	idx->tuples[idx->num_tuples].count = 0;
+	memset(&idx->postings[idx->num_tuples], 0, sizeof *idx->postings);
+	idx->slots[u] = (uint32_t)(idx->num_tuples + 1);
+	return (uint32_t)idx->num_tuples ++;
+}
+
+/*
+ * Remove a row from the index (no-op if the row is not indexed).
+ */
+void
+phc_tuple_index_remove(phc_tuple_index *idx, size_t row)
+{
+	uint32_t id;
+
+	if (row >= idx->rows_cap) {
+		return;
+	}
+	id = idx->row_tuple[row];
+	if (id == TUPLE_NONE) {
+		return;
+	}
+	rb_remove(&idx->postings[id], (uint32_t)row);
+	idx->tuples[id].count --;
+	idx->row_tuple[row] = TUPLE_NONE;
+}
+
+/*
+ * Set the tuple of row 'row' (which must be lower than 2^32-1): the row
+ * is added to the index, or moved from its previous tuple. The 'count'
+ * field of 'key' is ignored. Returned value is 1 on success, 0 on
+ * allocation failure (the row is then not indexed).
+ */
+int
+phc_tuple_index_set(phc_tuple_index *idx, size_t row, const param_tuple *key)
+{
+	uint32_t id;
+
+	if (row >= TUPLE_NONE) {
+		return 0;
+	}
+	if (row >= idx->rows_cap) {
+		uint32_t *nr;
+		size_t ncap, u;
+
+		ncap = idx->rows_cap == 0 ? 1024 : idx->rows_cap;
+		while (ncap <= row) {
+			ncap <<= 1;
+		}
+		nr = realloc(idx->row_tuple, ncap * sizeof *nr);
+		if (nr == NULL) {
+			return 0;
+		}
+		for (u = idx->rows_cap; u < ncap; u ++) {
+			nr[u] = TUPLE_NONE;
+		}
+		idx->row_tuple = nr;
+		idx->rows_cap = ncap;
+	}
+	id = tuple_index_id(idx, key);
+	if (id == TUPLE_NONE) {
+		phc_tuple_index_remove(idx, row);
+		return 0;
+	}
+	if (id == idx->row_tuple[row]) {
+		return 1;
+	}
+	phc_tuple_index_remove(idx, row);
+	if (!rb_add(&idx->postings[id], (uint32_t)row)) {
+		return 0;
+	}
+	idx->tuples[id].count ++;
+	idx->row_tuple[row] = id;
+	return 1;
+}
+
+/*
+ * Set the tuple of row 'row' from decoded parameters (Argon2i, no
+ * version; the tuple includes the salt and output lengths).
+ */
+int
+phc_tuple_index_set_params(phc_tuple_index *idx, size_t row,
+	const argon2i_params *pp)
+{
+	param_tuple key;
+
+	memset(&key, 0, sizeof key);
+	key.variant = 1;
+	key.m = (uint32_t)pp->m;
+	key.t = (uint32_t)pp->t;
+	key.p = (uint32_t)pp->p;
+	key.salt_len = (uint8_t)pp->salt_len;
+	key.output_len = (uint8_t)pp->output_len;
+	return phc_tuple_index_set(idx, row, &key);
+}
+
+/*
+ * Predicate over parameter tuples, for index queries.
+ */
+typedef int (*phc_tuple_pred)(void *ctx, const param_tuple *pt);
+
+/*
+ * Count the indexed rows whose tuple matches 'pred'. Only the tuple
+ * dictionary is scanned.
+ */
+size_t
+phc_tuple_index_count(const phc_tuple_index *idx,
+	phc_tuple_pred pred, void *pred_ctx)
+{
+	size_t u, n;
+
+	n = 0;
+	for (u = 0; u < idx->num_tuples; u ++) {
+		if (idx->tuples[u].count != 0
+			&& pred(pred_ctx, &idx->tuples[u]))
+		{
+			n += idx->tuples[u].count;
+		}
+	}
+	return n;
+}
+
+/*
+ * Call 'fn' on each indexed row whose tuple matches 'pred' (rows of a
+ * given tuple are visited in increasing order). Iteration stops early
+ * if 'fn' returns 0; returned value is then 0, and 1 otherwise.
+ */
+int
+phc_tuple_index_rows(const phc_tuple_index *idx,
+	phc_tuple_pred pred, void *pred_ctx,
+	int (*fn)(void *ctx, size_t row), void *ctx)
+{
+	size_t u;
+
+	for (u = 0; u < idx->num_tuples; u ++) {
+		if (idx->tuples[u].count != 0
+			&& pred(pred_ctx, &idx->tuples[u])
+			&& !rb_foreach(&idx->postings[u], fn, ctx))
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* ==================================================================== */
+/*
+ * Argon2 hash computation, as specified in RFC 9106 (version 0x13). The
+ * input parameters are taken from an argon2i_params structure, so that
+ * a decoded hash string can be used directly for verification, and the
+ * output is written back into that structure, ready for encoding:
+ *
+ *   m, t, p            memory (in kB), passes, lanes
+ *   associated_data    the "associated data" input (X in RFC 9106)
+ *   salt               the salt (at least 8 bytes)
+ *   output_len         the tag length (4 to 64 bytes; 0 means 32)
+ *
+ * The key identifier is not an input of the function: it only tells
+ * which secret key (K in RFC 9106) is used, and that key is provided
+ * separately, along with the password. Argon2d, Argon2i and Argon2id are
+ * supported.
+ */
+
+#define ARGON2_D     0
+#define ARGON2_I     1
+#define ARGON2_ID    2
+
+#define ARGON2_VERSION       0x13
+#define ARGON2_BLOCK_LEN     1024
+#define ARGON2_SYNC_POINTS   4
+
+/*
+ * Reference blocks are prefetched ARGON2_PREFETCH_DISTANCE blocks ahead
+ * by default (see argon2_fill_segment()); prefetches are issued for
+ * each cache line of ARGON2_CACHE_LINE bytes. ARGON2_PREFETCH_NONE, as
+ * a distance, disables prefetching.
+ */
+#define ARGON2_PREFETCH_DISTANCE   4
+#define ARGON2_PREFETCH_NONE       ((uint32_t)0xFFFFFFFF)
+#define ARGON2_CACHE_LINE          64
+
+/*
+ * BLAKE2b (RFC 7693), unkeyed, with an output of 1 to 64 bytes.
+ */
+typedef struct {
+	uint64_t h[8];
+	uint64_t t;
+	unsigned char buf[128];
+	size_t buf_len;
+	size_t out_len;
+} blake2b_context;
+
+static const uint64_t blake2b_IV[8] = {
+	0x6A09E667F3BCC908, 0xBB67AE8584CAA73B,
+	0x3C6EF372FE94F82B, 0xA54FF53A5F1D36F1,
+	0x510E527FADE682D1, 0x9B05688C2B3E6C1F,
+	0x1F83D9ABFB41BD6B, 0x5BE0CD19137E2179
+};
+
+static const unsigned char blake2b_sigma[12][16] = {
+	{  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+	{ 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 },
+	{ 11,  8, 12,  0,  5,  2, 15, 13, 10, 14,  3,  6,  7,  1,  9,  4 },
+	{  7,  9,  3,  1, 13, 12, 11, 14,  2,  6,  5, 10,  4,  0, 15,  8 },
+	{  9,  0,  5,  7,  2,  4, 10, 15, 14,  1, 11, 12,  6,  8,  3, 13 },
+	{  2, 12,  6, 10,  0, 11,  8,  3,  4, 13,  7,  5, 15, 14,  1,  9 },
+	{ 12,  5,  1, 15, 14, 13,  4, 10,  0,  7,  6,  3,  9,  2,  8, 11 },
+	{ 13, 11,  7, 14, 12,  1,  3,  9,  5,  0, 15,  4,  8,  6,  2, 10 },
+	{  6, 15, 14,  9, 11,  3,  0,  8, 12,  2, 13,  7,  1,  4, 10,  5 },
+	{ 10,  2,  8,  4,  7,  6,  1,  5, 15, 11,  9, 14,  3, 12, 13,  0 },
+	{  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+	{ 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 }
+};
+
+#define ROTR64(x, n)   (((x) >> (n)) | ((x) << (64 - (n))))
+
+static void
+blake2b_compress(blake2b_context *bc, const unsigned char *block, int last)
+{
+#define BG(a, b, c, d, x, y)   do { \
+		v[a] = v[a] + v[b] + (x); \
+		v[d] = ROTR64(v[d] ^ v[a], 32); \
+		v[c] = v[c] + v[d]; \
+		v[b] = ROTR64(v[b] ^ v[c], 24); \
+		v[a] = v[a] + v[b] + (y); \
+		v[d] = ROTR64(v[d] ^ v[a], 16); \
+		v[c] = v[c] + v[d]; \
+		v[b] = ROTR64(v[b] ^ v[c], 63); \
+	} while (0)
+
+	uint64_t v[16], m[16];
+	int i;
+
+	for (i = 0; i < 16; i ++) {
+		m[i] = dec64le(block + (i << 3));
+	}
+	for (i = 0; i < 8; i ++) {
+		v[i] = bc->h[i];
+		v[i + 8] = blake2b_IV[i];
+	}
+	v[12] ^= bc->t;
+	if (last) {
+		v[14] = ~v[14];
+	}
+	for (i = 0; i < 12; i ++) {
+		const unsigned char *s;
+
+		s = blake2b_sigma[i];
+		BG(0, 4,  8, 12, m[s[ 0]], m[s[ 1]]);
+		BG(1, 5,  9, 13, m[s[ 2]], m[s[ 3]]);
+		BG(2, 6, 10, 14, m[s[ 4]], m[s[ 5]]);
+		BG(3, 7, 11, 15, m[s[ 6]], m[s[ 7]]);
+		BG(0, 5, 10, 15, m[s[ 8]], m[s[ 9]]);
+		BG(1, 6, 11, 12, m[s[10]], m[s[11]]);
+		BG(2, 7,  8, 13, m[s[12]], m[s[13]]);
+		BG(3, 4,  9, 14, m[s[14]], m[s[15]]);
+	}
+	for (i = 0; i < 8; i ++) {
+		bc->h[i] ^= v[i] ^ v[i + 8];
+	}
+
+#undef BG
+}
+
+static void
+blake2b_init(blake2b_context *bc, size_t out_len)
+{
+	int i;
+
+	for (i = 0; i < 8; i ++) {
+		bc->h[i] = blake2b_IV[i];
+	}
+	bc->h[0] ^= 0x01010000 ^ (uint64_t)out_len;
+	bc->t = 0;
+	bc->buf_len = 0;
+	bc->out_len = out_len;
+}
+
+static void
+blake2b_update(blake2b_context *bc, const void *data, size_t len)
+{
+	const unsigned char *buf;
+
+	buf = data;
+	while (len > 0) {
+		size_t clen;
+
+		/*
+		 * The last block must be processed with the "last" flag,
+		 * so a full buffer is compressed only when more data
+		 * follows.
+		 */
+		if (bc->buf_len == sizeof bc->buf) {
+			bc->t += sizeof bc->buf;
+			blake2b_compress(bc, bc->buf, 0);
+			bc->buf_len = 0;
+		}
+		clen = sizeof bc->buf - bc->buf_len;
+		if (clen > len) {
+			clen = len;
+		}
+		memcpy(bc->buf + bc->buf_len, buf, clen);
+		bc->buf_len += clen;
+		buf += clen;
+		len -= clen;
+	}
+}
+
+static void
+blake2b_update32(blake2b_context *bc, uint32_t x)
+{
+	unsigned char tmp[4];
+
+	enc32le(tmp, x);
+	blake2b_update(bc, tmp, sizeof tmp);
+}
+
+static void
+blake2b_final(blake2b_context *bc, void *out)
+{
+	unsigned char tmp[64];
+	int i;
+
+	bc->t += bc->buf_len;
+	memset(bc->buf + bc->buf_len, 0, sizeof bc->buf - bc->buf_len);
+	blake2b_compress(bc, bc->buf, 1);
+	for (i = 0; i < 8; i ++) {
+		enc64le(tmp + (i << 3), bc->h[i]);
+	}
+	memcpy(out, tmp, bc->out_len);
+}
+
+/*
+ * Variable-length hash function H' (RFC 9106, section 3.3), over the
+ * concatenation of two inputs.
+ */
+static void
+argon2_hprime(void *out, size_t out_len,
+	const void *in1, size_t in1_len, const void *in2, size_t in2_len)
+{
+	blake2b_context bc;
+	unsigned char *dst, v[64];
+
+	blake2b_init(&bc, out_len <= 64 ? out_len : 64);
+	blake2b_update32(&bc, (uint32_t)out_len);
+	blake2b_update(&bc, in1, in1_len);
+	blake2b_update(&bc, in2, in2_len);
+	if (out_len <= 64) {
+		blake2b_final(&bc, out);
+		return;
+	}
+	dst = out;
+	blake2b_final(&bc, v);
+	memcpy(dst, v, 32);
+	dst += 32;
+	out_len -= 32;
+	while (out_len > 64) {
+		blake2b_init(&bc, 64);
+		blake2b_update(&bc, v, 64);
+		blake2b_final(&bc, v);
+		memcpy(dst, v, 32);
+		dst += 32;
+		out_len -= 32;
+	}
+	blake2b_init(&bc, out_len);
+	blake2b_update(&bc, v, 64);
+	blake2b_final(&bc, dst);
+}
+
+/*
+ * A memory block: 128 64-bit words.
+ */
+typedef struct {
+	uint64_t v[ARGON2_BLOCK_LEN / 8];
+} argon2_block;
+
+/*
+ * Compression function G (RFC 9106, section 3.5): 'dst' receives
+ * G(x, y), or, if 'with_xor' is non-zero, its previous contents XORed
+ * with G(x, y) (as used for passes after the first one).
+ */
+static void
+argon2_compress(argon2_block *dst, const argon2_block *x,
+	const argon2_block *y, int with_xor)
+{
+#define BLAMKA(a, b)   ((a) + (b) + 2 * (uint64_t)(uint32_t)(a) \
+		* (uint64_t)(uint32_t)(b))
+
+#define GB(a, b, c, d)   do { \
+		a = BLAMKA(a, b); \
+		d = ROTR64(d ^ a, 32); \
+		c = BLAMKA(c, d); \
+		b = ROTR64(b ^ c, 24); \
+		a = BLAMKA(a, b); \
+		d = ROTR64(d ^ a, 16); \
+		c = BLAMKA(c, d); \
+		b = ROTR64(b ^ c, 63); \
+	} while (0)
+
+#define PERM(v0, v1, v2, v3, v4, v5, v6, v7, \
+		v8, v9, v10, v11, v12, v13, v14, v15)   do { \
+		GB(v0, v4, v8, v12); \
+		GB(v1, v5, v9, v13); \
+		GB(v2, v6, v10, v14); \
+		GB(v3, v7, v11, v15); \
+		GB(v0, v5, v10, v15); \
+		GB(v1, v6, v11, v12); \
+		GB(v2, v7, v8, v13); \
+		GB(v3, v4, v9, v14); \
+	} while (0)
+
+	argon2_block r, z;
+	int i;
+
+	for (i = 0; i < 128; i ++) {
+		r.v[i] = x->v[i] ^ y->v[i];
+	}
+	z = r;
+
+	/*
+	 * The permutation P is applied to each row (16 consecutive
+	 * words), then to each column (pairs of words, taken from each
+	 * row).
+	 */
+	for (i = 0; i < 8; i ++) {
+		uint64_t *q;
+
+		q = z.v + (i << 4);
+		PERM(q[0], q[1], q[2], q[3], q[4], q[5], q[6], q[7],
+			q[8], q[9], q[10], q[11], q[12], q[13], q[14], q[15]);
+	}
+	for (i = 0; i < 8; i ++) {
+		uint64_t *q;
+
+		q = z.v + (i << 1);
+		PERM(q[0], q[1], q[16], q[17], q[32], q[33], q[48], q[49],
+			q[64], q[65], q[80], q[81], q[96], q[97],
+			q[112], q[113]);
+	}
+	if (with_xor) {
+		for (i = 0; i < 128; i ++) {
+			dst->v[i] ^= z.v[i] ^ r.v[i];
+		}
+	} else {
+		for (i = 0; i < 128; i ++) {
+			dst->v[i] = z.v[i] ^ r.v[i];
+		}
+	}
+
+#undef BLAMKA
+#undef GB
+#undef PERM
+}
+
+/*
+ * AVX2 implementation of the compression function G. The 1024-byte
+ * block is held in 32 256-bit registers (spilled by the compiler as
+ * needed) from the initial XOR to the final store; the BLAKE2b-like
+ * rounds process two rows (or two column pairs) at a time, with the
+ * 32x32->64 multiplications of BlaMka done with vpmuludq and the
+ * rotations done with byte shuffles. This follows the structure of the
+ * optimized Argon2 reference implementation.
+ */
+#if PHC_SF_AVX2
+
+#define AVX2   __attribute__((target("avx2")))
+
+#define ROTR32_AVX2(x)   _mm256_shuffle_epi32(x, _MM_SHUFFLE(2, 3, 0, 1))
+#define ROTR24_AVX2(x)   _mm256_shuffle_epi8(x, _mm256_setr_epi8( \
+		3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10, \
+		3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10))
+#define ROTR16_AVX2(x)   _mm256_shuffle_epi8(x, _mm256_setr_epi8( \
+		2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9, \
+		2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9))
+#define ROTR63_AVX2(x)   _mm256_xor_si256(_mm256_srli_epi64(x, 63), \
+		_mm256_add_epi64(x, x))
+
+/*
+ * a <- a + b + 2*lo(a)*lo(b), on four 64-bit lanes.
+ */
+#define BLAMKA_AVX2(a, b)   do { \
+		__m256i ml = _mm256_mul_epu32(a, b); \
+		ml = _mm256_add_epi64(ml, ml); \
+		a = _mm256_add_epi64(a, _mm256_add_epi64(b, ml)); \
+	} while (0)
+
+#define G1_AVX2(a0, a1, b0, b1, c0, c1, d0, d1)   do { \
+		BLAMKA_AVX2(a0, b0); \
+		BLAMKA_AVX2(a1, b1); \
+		d0 = ROTR32_AVX2(_mm256_xor_si256(d0, a0)); \
+		d1 = ROTR32_AVX2(_mm256_xor_si256(d1, a1)); \
+		BLAMKA_AVX2(c0, d0); \
+		BLAMKA_AVX2(c1, d1); \
+		b0 = ROTR24_AVX2(_mm256_xor_si256(b0, c0)); \
+		b1 = ROTR24_AVX2(_mm256_xor_si256(b1, c1)); \
+	} while (0)
+
+#define G2_AVX2(a0, a1, b0, b1, c0, c1, d0, d1)   do { \
+		BLAMKA_AVX2(a0, b0); \
+		BLAMKA_AVX2(a1, b1); \
+		d0 = ROTR16_AVX2(_mm256_xor_si256(d0, a0)); \
+		d1 = ROTR16_AVX2(_mm256_xor_si256(d1, a1)); \
+		BLAMKA_AVX2(c0, d0); \
+		BLAMKA_AVX2(c1, d1); \
+		b0 = ROTR63_AVX2(_mm256_xor_si256(b0, c0)); \
+		b1 = ROTR63_AVX2(_mm256_xor_si256(b1, c1)); \
+	} while (0)
+
+/*
+ * Row rounds: each register holds four consecutive words of a row, so
+ * the diagonal step rotates the registers' lanes.
+ */
+#define DIAG1_AVX2(b, c, d)   do { \
+		b = _mm256_permute4x64_epi64(b, _MM_SHUFFLE(0, 3, 2, 1)); \
+		c = _mm256_permute4x64_epi64(c, _MM_SHUFFLE(1, 0, 3, 2)); \
+		d = _mm256_permute4x64_epi64(d, _MM_SHUFFLE(2, 1, 0, 3)); \
+	} while (0)
+
+#define UNDIAG1_AVX2(b, c, d)   do { \
+		b = _mm256_permute4x64_epi64(b, _MM_SHUFFLE(2, 1, 0, 3)); \
+		c = _mm256_permute4x64_epi64(c, _MM_SHUFFLE(1, 0, 3, 2)); \
+		d = _mm256_permute4x64_epi64(d, _MM_SHUFFLE(0, 3, 2, 1)); \
+	} while (0)
+
+#define ROUND1_AVX2(a0, a1, b0, b1, c0, c1, d0, d1)   do { \
+		G1_AVX2(a0, a1, b0, b1, c0, c1, d0, d1); \
+		G2_AVX2(a0, a1, b0, b1, c0, c1, d0, d1); \
+		DIAG1_AVX2(b0, c0, d0); \
+		DIAG1_AVX2(b1, c1, d1); \
+		G1_AVX2(a0, a1, b0, b1, c0, c1, d0, d1); \
+		G2_AVX2(a0, a1, b0, b1, c0, c1, d0, d1); \
+		UNDIAG1_AVX2(b0, c0, d0); \
+		UNDIAG1_AVX2(b1, c1, d1); \
+	} while (0)
+
+/*
+ * Column rounds: a pair of registers holds the words of two column
+ * pairs, so the diagonal step exchanges lanes between registers.
+ */
+#define DIAG2_AVX2(b0, b1, c0, c1, d0, d1)   do { \
+		__m256i t1 = _mm256_blend_epi32(b0, b1, 0xCC); \
+		__m256i t2 = _mm256_blend_epi32(b0, b1, 0x33); \
+		b1 = _mm256_permute4x64_epi64(t1, _MM_SHUFFLE(2, 3, 0, 1)); \
+		b0 = _mm256_permute4x64_epi64(t2, _MM_SHUFFLE(2, 3, 0, 1)); \
+		t1 = c0; \
+		c0 = c1; \
+		c1 = t1; \
+		t1 = _mm256_blend_epi32(d0, d1, 0xCC); \
+		t2 = _mm256_blend_epi32(d0, d1, 0x33); \
+		d0 = _mm256_permute4x64_epi64(t1, _MM_SHUFFLE(2, 3, 0, 1)); \
+		d1 = _mm256_permute4x64_epi64(t2, _MM_SHUFFLE(2, 3, 0, 1)); \
+	} while (0)
+
+#define UNDIAG2_AVX2(b0, b1, c0, c1, d0, d1)   do { \
+		__m256i t1 = _mm256_blend_epi32(b0, b1, 0xCC); \
+		__m256i t2 = _mm256_blend_epi32(b0, b1, 0x33); \
+		b0 = _mm256_permute4x64_epi64(t1, _MM_SHUFFLE(2, 3, 0, 1)); \
+		b1 = _mm256_permute4x64_epi64(t2, _MM_SHUFFLE(2, 3, 0, 1)); \
+		t1 = c0; \
+		c0 = c1; \
+		c1 = t1; \
+		t1 = _mm256_blend_epi32(d0, d1, 0x33); \
+		t2 = _mm256_blend_epi32(d0, d1, 0xCC); \
+		d0 = _mm256_permute4x64_epi64(t1, _MM_SHUFFLE(2, 3, 0, 1)); \
+		d1 = _mm256_permute4x64_epi64(t2, _MM_SHUFFLE(2, 3, 0, 1)); \
+	} while (0)
+
+#define ROUND2_AVX2(a0, a1, b0, b1, c0, c1, d0, d1)   do { \
+		G1_AVX2(a0, a1, b0, b1, c0, c1, d0, d1); \
+		G2_AVX2(a0, a1, b0, b1, c0, c1, d0, d1); \
+		DIAG2_AVX2(b0, b1, c0, c1, d0, d1); \
+		G1_AVX2(a0, a1, b0, b1, c0, c1, d0, d1); \
+		G2_AVX2(a0, a1, b0, b1, c0, c1, d0, d1); \
+		UNDIAG2_AVX2(b0, b1, c0, c1, d0, d1); \
+	} while (0)
+
+AVX2
+static void
+argon2_compress_avx2(argon2_block *dst, const argon2_block *x,
+	const argon2_block *y, int with_xor)
+{
+	__m256i s[32], r[32];
+	int i;
+
+	for (i = 0; i < 32; i ++) {
+		s[i] = _mm256_xor_si256(
+			_mm256_loadu_si256((const __m256i *)x->v + i),
+			_mm256_loadu_si256((const __m256i *)y->v + i));
+	}
+	if (with_xor) {
+		for (i = 0; i < 32; i ++) {
+			r[i] = _mm256_xor_si256(s[i],
+				_mm256_loadu_si256((const __m256i *)dst->v + i));
+		}
+	} else {
+		for (i = 0; i < 32; i ++) {
+			r[i] = s[i];
+		}
+	}
+	for (i = 0; i < 4; i ++) {
+		ROUND1_AVX2(s[8 * i + 0], s[8 * i + 4], s[8 * i + 1],
+			s[8 * i + 5], s[8 * i + 2], s[8 * i + 6],
+			s[8 * i + 3], s[8 * i + 7]);
+	}
+	for (i = 0; i < 4; i ++) {
+		ROUND2_AVX2(s[i], s[4 + i], s[8 + i], s[12 + i],
+			s[16 + i], s[20 + i], s[24 + i], s[28 + i]);
+	}
+	for (i = 0; i < 32; i ++) {
+		_mm256_storeu_si256((__m256i *)dst->v + i,
+			_mm256_xor_si256(s[i], r[i]));
+	}
+}
+
+/*
+ * Four independent BLAKE2b computations, one per 64-bit lane of the
+ * AVX2 registers: the messages all have length 'len', and the outputs
+ * all have length 'out_len' (at most 64 bytes). Used for the long chains
+ * of BLAKE2b calls in H', whose rounds are otherwise strictly serial.
+ */
+AVX2
+static void
+blake2b4_compress_avx2(__m256i *h, const __m256i *m, uint64_t t, int last)
+{
+#define BG4(a, b, c, d, x, y)   do { \
+		v[a] = _mm256_add_epi64(_mm256_add_epi64(v[a], v[b]), x); \
+		v[d] = ROTR32_AVX2(_mm256_xor_si256(v[d], v[a])); \
+		v[c] = _mm256_add_epi64(v[c], v[d]); \
+		v[b] = ROTR24_AVX2(_mm256_xor_si256(v[b], v[c])); \
+		v[a] = _mm256_add_epi64(_mm256_add_epi64(v[a], v[b]), y); \
+		v[d] = ROTR16_AVX2(_mm256_xor_si256(v[d], v[a])); \
+		v[c] = _mm256_add_epi64(v[c], v[d]); \
+		v[b] = ROTR63_AVX2(_mm256_xor_si256(v[b], v[c])); \
+	} while (0)
+
+	__m256i v[16];
+	int i;
+
+	for (i = 0; i < 8; i ++) {
+		v[i] = h[i];
+		v[i + 8] = _mm256_set1_epi64x((long long)blake2b_IV[i]);
+	}
+	v[12] = _mm256_xor_si256(v[12], _mm256_set1_epi64x((long long)t));
+	if (last) {
+		v[14] = _mm256_xor_si256(v[14], _mm256_set1_epi64x(-1));
+	}
+	for (i = 0; i < 12; i ++) {
+		const unsigned char *s;
+
+		s = blake2b_sigma[i];
+		BG4(0, 4,  8, 12, m[s[ 0]], m[s[ 1]]);
+		BG4(1, 5,  9, 13, m[s[ 2]], m[s[ 3]]);
+		BG4(2, 6, 10, 14, m[s[ 4]], m[s[ 5]]);
+		BG4(3, 7, 11, 15, m[s[ 6]], m[s[ 7]]);
+		BG4(0, 5, 10, 15, m[s[ 8]], m[s[ 9]]);
+		BG4(1, 6, 11, 12, m[s[10]], m[s[11]]);
+		BG4(2, 7,  8, 13, m[s[12]], m[s[13]]);
+		BG4(3, 4,  9, 14, m[s[14]], m[s[15]]);
+	}
+	for (i = 0; i < 8; i ++) {
+		h[i] = _mm256_xor_si256(h[i], _mm256_xor_si256(v[i], v[i + 8]));
+	}
+
+#undef BG4
+}
+
+AVX2
+static void
+blake2b4_avx2(unsigned char *const *out, size_t out_len,
+	const unsigned char *const *in, size_t len)
+{
+	__m256i h[8], m[16];
+	uint64_t w[16][4], hv[8][4];
+	unsigned char blk[128];
+	size_t off;
+	int i, k;
+
+	for (i = 0; i < 8; i ++) {
+		h[i] = _mm256_set1_epi64x((long long)blake2b_IV[i]);
+	}
+	h[0] = _mm256_xor_si256(h[0],
+		_mm256_set1_epi64x((long long)(0x01010000 ^ out_len)));
+	off = 0;
+	do {
+		size_t clen;
+
+		clen = len - off > 128 ? 128 : len - off;
+		for (k = 0; k < 4; k ++) {
+			memcpy(blk, in[k] + off, clen);
+			memset(blk + clen, 0, sizeof blk - clen);
+			for (i = 0; i < 16; i ++) {
+				w[i][k] = dec64le(blk + (i << 3));
+			}
+		}
+		for (i = 0; i < 16; i ++) {
+			m[i] = _mm256_loadu_si256((const __m256i *)w[i]);
+		}
+		off += clen;
+		blake2b4_compress_avx2(h, m, off, off == len);
+	} while (off < len);
+	for (i = 0; i < 8; i ++) {
+		_mm256_storeu_si256((__m256i *)hv[i], h[i]);
+	}
+	for (k = 0; k < 4; k ++) {
+		for (i = 0; i < 8; i ++) {
+			enc64le(blk + (i << 3), hv[i][k]);
+		}
+		memcpy(out[k], blk, out_len);
+	}
+}
+
+#undef ROTR32_AVX2
+#undef ROTR24_AVX2
+#undef ROTR16_AVX2
+#undef ROTR63_AVX2
+#undef BLAMKA_AVX2
+#undef G1_AVX2
+#undef G2_AVX2
+#undef DIAG1_AVX2
+#undef UNDIAG1_AVX2
+#undef ROUND1_AVX2
+#undef DIAG2_AVX2
+#undef UNDIAG2_AVX2
+#undef ROUND2_AVX2
+
+#endif
+
+typedef void (*argon2_compress_fn)(argon2_block *dst,
+	const argon2_block *x, const argon2_block *y, int with_xor);
+
+/*
+ * Select the fastest implementation of G supported by the current CPU.
+ */
+static argon2_compress_fn
+argon2_compress_select(void)
+{
+#if PHC_SF_AVX2
+	if (__builtin_cpu_supports("avx2")) {
+		return argon2_compress_avx2;
+	}
+#endif
+	return argon2_compress;
+}
+
+/*
+ * Four independent computations of H', each over a 'len'-byte input
+ * (at most ARGON2_BLOCK_LEN bytes) and with output length 'out_len'.
+ * With AVX2, the four chains of BLAKE2b calls run in parallel; the
+ * inputs may be overlapped by the outputs.
+ */
+static void
+argon2_hprime4(unsigned char *const *out, size_t out_len,
+	const unsigned char *const *in, size_t len)
+{
+	int k;
+
+#if PHC_SF_AVX2
+	if (__builtin_cpu_supports("avx2")) {
+		unsigned char msg[4][4 + ARGON2_BLOCK_LEN], v[4][64];
+		unsigned char *mp[4], *vp[4], *dp[4];
+		size_t off;
+
+		for (k = 0; k < 4; k ++) {
+			enc32le(msg[k], (uint32_t)out_len);
+			memcpy(msg[k] + 4, in[k], len);
+			mp[k] = msg[k];
+			vp[k] = v[k];
+		}
+		off = 0;
+		if (out_len > 64) {
+			blake2b4_avx2(vp, 64,
+				(const unsigned char *const *)mp, 4 + len);
+		}
+		for (; out_len - off > 64; off += 32) {
+			for (k = 0; k < 4; k ++) {
+				memcpy(out[k] + off, v[k], 32);
+			}
+			if (out_len - off - 32 > 64) {
+				blake2b4_avx2(vp, 64,
+					(const unsigned char *const *)vp, 64);
+			}
+		}
+		for (k = 0; k < 4; k ++) {
+			dp[k] = out[k] + off;
+		}
+		if (out_len <= 64) {
+			blake2b4_avx2(dp, out_len,
+				(const unsigned char *const *)mp, 4 + len);
+		} else {
+			blake2b4_avx2(dp, out_len - off,
+				(const unsigned char *const *)vp, 64);
+		}
+		memset(msg, 0, sizeof msg);
+		memset(v, 0, sizeof v);
+		return;
+	}
+#endif
+	for (k = 0; k < 4; k ++) {
+		argon2_hprime(out[k], out_len, in[k], len, NULL, 0);
+	}
+}
+
+/*
+ * State of a hash computation: the memory matrix (p lanes of lane_len
+ * blocks, each lane made of four segments), and the parameters that
+ * drive block filling. If 'refs' is not NULL, it contains the indices of
+ * the reference blocks of all data-independent segments (see
+ * argon2_build_refs()), which are then not recomputed. Reference blocks
+ * are prefetched 'prefetch' blocks ahead (0 disables prefetching).
+ */
+typedef struct {
+	argon2_block *mem;
+	uint32_t lanes;
+	uint32_t lane_len;
+	uint32_t seg_len;
+	uint32_t num_blocks;
+	uint32_t passes;
+	int type;
+	argon2_compress_fn compress;
+	const uint32_t *refs;
+	uint32_t prefetch;
+} argon2_instance;
+
+/*
+ * Tell whether a segment uses data-independent addressing: all of them
+ * for Argon2i, the first half of the first pass for Argon2id.
+ */
+static int
+argon2_indep(const argon2_instance *in, uint32_t pass, uint32_t slice)
+{
+	return in->type == ARGON2_I
+		|| (in->type == ARGON2_ID && pass == 0
+		&& slice < ARGON2_SYNC_POINTS / 2);
+}
+
+/*
+ * Set the input block for the generation of pseudo-random addresses of
+ * a segment.
+ */
+static void
+argon2_address_input(const argon2_instance *in, argon2_block *input,
+	uint32_t pass, uint32_t lane, uint32_t slice)
+{
+	memset(input, 0, sizeof *input);
+	input->v[0] = pass;
+	input->v[1] = lane;
+	input->v[2] = slice;
+	input->v[3] = in->num_blocks;
+	input->v[4] = in->passes;
+	input->v[5] = (uint64_t)in->type;
+}
+
+/*
+ * Generate the next block of pseudo-random addresses (data-independent
+ * addressing), by incrementing the counter in 'input' and applying G
+ * twice with a zero block.
+ */
+static void
+argon2_next_addresses(const argon2_instance *in,
+	argon2_block *addr, argon2_block *input)
+{
+	argon2_block zero;
+
+	memset(&zero, 0, sizeof zero);
+	input->v[6] ++;
+	in->compress(addr, &zero, input, 0);
+	in->compress(addr, &zero, addr, 0);
+}
+
+/*
+ * Compute the index (within the whole memory) of the reference block
+ * for block 'index' of the segment ('pass', 'lane', 'slice'), from the
+ * 64-bit pseudo-random value (RFC 9106, section 3.4.2).
+ */
+static uint32_t
+argon2_ref_index(const argon2_instance *in, uint32_t pass, uint32_t lane,
+	uint32_t slice, uint32_t index, uint64_t rnd)
+{
+	uint32_t ref_lane, area, start;
+	uint64_t rel;
+
+	ref_lane = (uint32_t)((rnd >> 32) % in->lanes);
+	if (pass == 0 && slice == 0) {
+		ref_lane = lane;
+	}
+
+	/*
+	 * Blocks that can be referenced: all blocks of the previous
+	 * segments (only those of the current pass, for the first
+	 * pass), and, in the same lane, the blocks already computed in
+	 * the current segment except the previous one. In other lanes,
+	 * the last block of the previous segments is excluded while the
+	 * first block of the current segment is being computed.
+	 */
+	if (pass == 0) {
+		area = slice * in->seg_len;
+	} else {
+		area = in->lane_len - in->seg_len;
+	}
+	if (ref_lane == lane) {
+		area += index - 1;
+	} else if (index == 0) {
+		area --;
+	}
+	start = 0;
+	if (pass != 0 && slice != ARGON2_SYNC_POINTS - 1) {
+		start = (slice + 1) * in->seg_len;
+	}
+	rel = rnd & 0xFFFFFFFF;
+	rel = (rel * rel) >> 32;
+	rel = area - 1 - (((uint64_t)area * rel) >> 32);
+	return ref_lane * in->lane_len
+		+ (uint32_t)((start + rel) % in->lane_len);
+}
+
+/*
+ * Prefetch all cache lines of a block.
+ */
+static inline void
+argon2_prefetch_block(const argon2_block *b)
+{
+	const unsigned char *p;
+	size_t u;
+
+	p = (const unsigned char *)b;
+	for (u = 0; u < sizeof *b; u += ARGON2_CACHE_LINE) {
+		PREFETCH(p + u);
+	}
+}
+
+/*
+ * Fill one segment of the memory matrix.
+ *
+ * Reference blocks are read in a pseudo-random order over the whole
+ * matrix, so each of them is normally a cache miss. With data-independent
+ * addressing, the indices of the next references are known in advance
+ * (from 'refs', or from the current block of 128 addresses), and the
+ * reference of block 'index + in->prefetch' is prefetched while block
+ * 'index' is computed. With data-dependent addressing, the reference is
+ * known only when the previous block is complete, i.e. when it is read,
+ * so there is nothing to prefetch.
+ */
+static void
+argon2_fill_segment(const argon2_instance *in,
+	uint32_t pass, uint32_t lane, uint32_t slice)
+{
+	argon2_block addr, input;
+	uint32_t ref[128];
+	uint32_t index, cur, prev, dist, end;
+	int indep;
+
+	/*
+	 * The first two blocks of each lane are computed from H0.
+	 */
+	indep = argon2_indep(in, pass, slice);
+	index = pass == 0 && slice == 0 ? 2 : 0;
+	cur = lane * in->lane_len + slice * in->seg_len + index;
+	dist = in->prefetch;
+	if (indep && in->refs != NULL) {
+		const uint32_t *refs;
+
+		refs = in->refs + ((size_t)(pass * ARGON2_SYNC_POINTS + slice)
+			* in->lanes + lane) * in->seg_len;
+		for (; index < in->seg_len; index ++, cur ++) {
+			if (dist != 0 && dist < in->seg_len - index) {
+				argon2_prefetch_block(
+					&in->mem[refs[index + dist]]);
+			}
+			prev = cur % in->lane_len == 0
+				? cur + in->lane_len - 1 : cur - 1;
+			in->compress(&in->mem[cur], &in->mem[prev],
+				&in->mem[refs[index]], pass != 0);
+		}
+		return;
+	}
+	if (indep) {
+		argon2_address_input(in, &input, pass, lane, slice);
+	}
+	end = index;
+	for (; index < in->seg_len; index ++, cur ++) {
+		uint32_t r;
+
+		prev = cur % in->lane_len == 0 ? cur + in->lane_len - 1 : cur - 1;
+		if (indep) {
+			uint32_t k;
+
+			/*
+			 * Reference indices are computed for a whole block
+			 * of addresses at once, so that they can be
+			 * prefetched ahead (up to the end of that block).
+			 */
+			if (index == end) {
+				argon2_next_addresses(in, &addr, &input);
+				end = index - index % 128 + 128;
+				if (end > in->seg_len) {
+					end = in->seg_len;
+				}
+				for (k = index; k < end; k ++) {
+					ref[k % 128] = argon2_ref_index(in,
+						pass, lane, slice, k,
+						addr.v[k % 128]);
+				}
+			}
+			if (dist != 0 && dist < 128 - index % 128
+				&& dist < in->seg_len - index)
+			{
+				argon2_prefetch_block(
+					&in->mem[ref[(index + dist) % 128]]);
+			}
+			r = ref[index % 128];
+		} else {
+			r = argon2_ref_index(in, pass, lane, slice,
+				index, in->mem[prev].v[0]);
+		}
+		in->compress(&in->mem[cur], &in->mem[prev],
+			&in->mem[r], pass != 0);
+	}
+}
+
+/*
+ * Number of reference indices in the data-independent segments of a
+ * hash (one per block, for all segments of Argon2i, and for the first
+ * half of the first pass of Argon2id).
+ */
+static uint64_t
+argon2_refs_count(const argon2_instance *in)
+{
+	uint64_t n;
+
+	switch (in->type) {
+	case ARGON2_I:
+		n = (uint64_t)in->passes * ARGON2_SYNC_POINTS;
+		break;
+	case ARGON2_ID:
+		n = ARGON2_SYNC_POINTS / 2;
+		break;
+	default:
+		return 0;
+	}
+	return n * in->lanes * in->seg_len;
+}
+
+/*
+ * Compute the indices of the reference blocks of all data-independent
+ * segments, ordered by pass, slice, lane and position in the segment.
+ * They depend only on the geometry of the matrix, the number of passes
+ * and the type, not on the password or salt.
+ */
+static void
+argon2_build_refs(const argon2_instance *in, uint32_t *refs)
+{
+	uint32_t pass, slice, lane, index;
+
+	for (pass = 0; pass < in->passes; pass ++) {
+		for (slice = 0; slice < ARGON2_SYNC_POINTS; slice ++) {
+			if (!argon2_indep(in, pass, slice)) {
+				return;
+			}
+			for (lane = 0; lane < in->lanes; lane ++) {
+				argon2_block addr, input;
+
+				index = 0;
+				argon2_address_input(in, &input,
+					pass, lane, slice);
+				if (pass == 0 && slice == 0) {
+					refs[0] = refs[1] = 0;
+					index = 2;
+					argon2_next_addresses(in,
+						&addr, &input);
+				}
+				for (; index < in->seg_len; index ++) {
+					if (index % 128 == 0) {
+						argon2_next_addresses(in,
+							&addr, &input);
+					}
+					refs[index] = argon2_ref_index(in,
+						pass, lane, slice, index,
+						addr.v[index % 128]);
+				}
+				refs += in->seg_len;
+			}
+		}
+	}
+}
+
+/*
+ * Persistent thread pool for lane parallelism. Within each slice (one
+ * of four per pass), the segments of all lanes are independent; a hash
+ * with p > 1 lanes posts a job per slice, and both the pool workers and
+ * the calling thread claim lanes from it until none remain. The caller
+ * then waits for the lanes claimed by workers to complete (this is the
+ * barrier between slices). Threads are created once, when the pool is
+ * initialized; if all workers are busy (e.g. with other hashes), the
+ * caller simply runs the lanes itself. Several threads may compute
+ * hashes with the same pool concurrently.
+ */
+
+typedef struct argon2_slice_job_ {
+	const argon2_instance *in;
+	uint32_t pass;
+	uint32_t slice;
+	uint32_t next_lane;
+	uint32_t done;
+	struct argon2_slice_job_ *next;
+} argon2_slice_job;
+
+typedef struct {
+#if PHC_SF_THREADS
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t done;
+	pthread_t *threads;
+#endif
+	unsigned num_threads;
+	argon2_slice_job *jobs;
+	int stop;
+} phc_pool;
+
+#if PHC_SF_THREADS
+/*
+ * Claim the next lane of a pending job, and unlink that job once all its
+ * lanes are claimed. The pool lock must be held.
+ */
+static uint32_t
+pool_take(phc_pool *pool, argon2_slice_job *j)
+{
+	argon2_slice_job **pj;
+	uint32_t lane;
+
+	lane = j->next_lane ++;
+	if (j->next_lane == j->in->lanes) {
+		for (pj = &pool->jobs; *pj != j; pj = &(*pj)->next);
+		*pj = j->next;
+	}
+	return lane;
+}
+
+static void *
+pool_worker_run(void *arg)
+{
+	phc_pool *pool;
+
+	pool = arg;
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		argon2_slice_job *j;
+		uint32_t lane;
+
+		j = pool->jobs;
+		if (j == NULL) {
+			if (pool->stop) {
+				break;
+			}
+			pthread_cond_wait(&pool->work, &pool->lock);
+			continue;
+		}
+		lane = pool_take(pool, j);
+		pthread_mutex_unlock(&pool->lock);
+		argon2_fill_segment(j->in, j->pass, lane, j->slice);
+		pthread_mutex_lock(&pool->lock);
+		if (++ j->done == j->in->lanes) {
+			pthread_cond_broadcast(&pool->done);
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+#endif
+
+/*
+ * Initialize a pool with 'num_threads' worker threads (not counting the
+ * threads that call the hash functions); with 0 threads, or when
+ * threads are disabled, all lanes run on the calling thread. Returned
+ * value is 1 on success, 0 on error (in which case nothing needs to be
+ * released). If only some threads can be started, the pool uses those.
+ */
+int
+phc_pool_init(phc_pool *pool, unsigned num_threads)
+{
+	memset(pool, 0, sizeof *pool);
+#if PHC_SF_THREADS
+	if (pthread_mutex_init(&pool->lock, NULL) != 0) {
+		return 0;
+	}
+	if (pthread_cond_init(&pool->work, NULL) != 0) {
+		pthread_mutex_destroy(&pool->lock);
+		return 0;
+	}
+	if (pthread_cond_init(&pool->done, NULL) != 0) {
+		pthread_cond_destroy(&pool->work);
+		pthread_mutex_destroy(&pool->lock);
+		return 0;
+	}
+	if (num_threads > 0) {
+		pool->threads = malloc(num_threads * sizeof *pool->threads);
+		if (pool->threads == NULL) {
+			num_threads = 0;
+		}
+	}
+	while (pool->num_threads < num_threads
+		&& pthread_create(&pool->threads[pool->num_threads], NULL,
+			pool_worker_run, pool) == 0)
+	{
+		pool->num_threads ++;
+	}
+#else
+	(void)num_threads;
+#endif
+	return 1;
+}
+
+/*
+ * Stop the workers and release the pool. No hash may be in progress.
+ */
+void
+phc_pool_free(phc_pool *pool)
+{
+#if PHC_SF_THREADS
+	unsigned u;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+	for (u = 0; u < pool->num_threads; u ++) {
+		pthread_join(pool->threads[u], NULL);
+	}
+	free(pool->threads);
+	pthread_cond_destroy(&pool->done);
+	pthread_cond_destroy(&pool->work);
+	pthread_mutex_destroy(&pool->lock);
+#endif
+	memset(pool, 0, sizeof *pool);
+}
+
+/*
+ * Fill the memory matrix, all passes and slices. Lanes run on the pool
+ * workers (if 'pool' is not NULL) and on the calling thread.
+ */
+static void
+argon2_fill_memory(const argon2_instance *in, phc_pool *pool)
+{
+	uint32_t pass, slice, lane;
+
+	for (pass = 0; pass < in->passes; pass ++) {
+		for (slice = 0; slice < ARGON2_SYNC_POINTS; slice ++) {
+#if PHC_SF_THREADS
+			argon2_slice_job job, **pj;
+			uint32_t u;
+
+			if (pool != NULL && pool->num_threads > 0
+				&& in->lanes > 1)
+			{
+				job.in = in;
+				job.pass = pass;
+				job.slice = slice;
+				job.next_lane = 0;
+				job.done = 0;
+				job.next = NULL;
+				pthread_mutex_lock(&pool->lock);
+				for (pj = &pool->jobs; *pj != NULL;
+					pj = &(*pj)->next);
+				*pj = &job;
+				for (u = 1; u < in->lanes
+					&& u <= pool->num_threads; u ++)
+				{
+					pthread_cond_signal(&pool->work);
+				}
+
+				/*
+				 * Run lanes of this job (but not of other
+				 * jobs queued before it) on this thread.
+				 */
+				while (job.next_lane < in->lanes) {
+					lane = pool_take(pool, &job);
+					pthread_mutex_unlock(&pool->lock);
+					argon2_fill_segment(in, pass, lane, slice);
+					pthread_mutex_lock(&pool->lock);
+					job.done ++;
+				}
+				while (job.done < in->lanes) {
+					pthread_cond_wait(&pool->done, &pool->lock);
+				}
+				pthread_mutex_unlock(&pool->lock);
+				continue;
+			}
+#else
+			(void)pool;
+#endif
+			for (lane = 0; lane < in->lanes; lane ++) {
+				argon2_fill_segment(in, pass, lane, slice);
+			}
+		}
+	}
+}
+
+/*
+ * Memory pool for block matrices. Allocating, faulting in and freeing a
+ * large matrix for each hash dominates the latency of hashes with a few
+ * passes; the pool instead keeps released matrices, keyed by their
+ * size, and hands them out again. Matrices are mapped with huge pages
+ * when possible (MAP_HUGETLB, or transparent huge pages requested with
+ * MADV_HUGEPAGE), pre-faulted when allocated, and zeroed when released
+ * (so that no secret-dependent data remains in memory between hashes,
+ * and the next user gets them already faulted in).
+ *
+ * The total size of the matrices owned by the pool (in use or cached)
+ * is capped: when a new matrix is needed, cached matrices of other
+ * sizes are released first to make room, and if the matrices in use
+ * leave no room, the request fails.
+ */
+
+#define MEMPOOL_HUGE_PAGE   ((size_t)2 << 20)
+
+typedef struct mempool_entry_ {
+	argon2_block *mem;
+	size_t len;
+	size_t map_len;
+	struct mempool_entry_ *next;
+} mempool_entry;
+
+typedef struct {
+	size_t resident;
+	size_t cached;
+	size_t hits;
+	size_t misses;
+} phc_mempool_stats;
+
+typedef struct {
+#if PHC_SF_THREADS
+	pthread_mutex_t lock;
+#endif
+	mempool_entry *free_list;
+	size_t max_bytes;
+	phc_mempool_stats st;
+} phc_mempool;
+
+/*
+ * Initialize a pool that keeps at most 'max_bytes' bytes of matrices.
+ * Returned value is 1 on success, 0 on error.
+ */
+int
+phc_mempool_init(phc_mempool *mp, size_t max_bytes)
+{
+	memset(mp, 0, sizeof *mp);
+	mp->max_bytes = max_bytes;
+#if PHC_SF_THREADS
+	if (pthread_mutex_init(&mp->lock, NULL) != 0) {
+		return 0;
+	}
+#endif
+	return 1;
+}
+
+static void
+mempool_lock(phc_mempool *mp)
+{
+#if PHC_SF_THREADS
+	pthread_mutex_lock(&mp->lock);
+#else
+	(void)mp;
+#endif
+}
+
+static void
+mempool_unlock(phc_mempool *mp)
+{
+#if PHC_SF_THREADS
+	pthread_mutex_unlock(&mp->lock);
+#else
+	(void)mp;
+#endif
+}
+
+/*
+ * Size of the mapping used for a matrix of 'len' bytes: matrices of at
+ * least one huge page are rounded up to a whole number of huge pages,
+ * so that all of them can be backed by huge pages.
+ */
+static size_t
+mempool_map_len(size_t len)
+{
+#if PHC_SF_MMAP && defined MAP_ANONYMOUS
+	size_t n;
+
+	if (len >= MEMPOOL_HUGE_PAGE) {
+		n = (len + MEMPOOL_HUGE_PAGE - 1) & ~(MEMPOOL_HUGE_PAGE - 1);
+		if (n >= len) {
+			return n;
+		}
+	}
+#endif
+	return len;
+}
+
+/*
+ * Allocate a zeroed, pre-faulted matrix of 'len' bytes. NULL is returned
+ * on allocation failure.
+ */
+static mempool_entry *
+mempool_alloc(size_t len)
+{
+	mempool_entry *e;
+
+	e = malloc(sizeof *e);
+	if (e == NULL) {
+		return NULL;
+	}
+	e->len = len;
+	e->map_len = mempool_map_len(len);
+	e->next = NULL;
+#if PHC_SF_MMAP && defined MAP_ANONYMOUS
+	{
+		unsigned char *p;
+		size_t extra, head;
+
+		p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+		/*
+		 * Explicit huge pages are used only for matrices of at
+		 * least one huge page, to bound the rounding waste.
+		 */
+		if (len >= MEMPOOL_HUGE_PAGE
+			&& e->map_len % MEMPOOL_HUGE_PAGE == 0)
+		{
+			int flags;
+
+			flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB;
+#ifdef MAP_POPULATE
+			flags |= MAP_POPULATE;
+#endif
+			p = mmap(NULL, e->map_len, PROT_READ | PROT_WRITE,
+				flags, -1, 0);
+		}
+#endif
+		if (p == MAP_FAILED) {
+			/*
+			 * Transparent huge pages: the mapping is aligned
+			 * on a huge page boundary (by mapping one more
+			 * huge page and trimming the excess), and pages
+			 * are faulted in only after MADV_HUGEPAGE, since
+			 * pages faulted in before are small pages.
+			 */
+			extra = 0;
+			if (len >= MEMPOOL_HUGE_PAGE
+				&& e->map_len % MEMPOOL_HUGE_PAGE == 0
+				&& e->map_len + MEMPOOL_HUGE_PAGE > e->map_len)
+			{
+				extra = MEMPOOL_HUGE_PAGE;
+			}
+			p = mmap(NULL, e->map_len + extra,
+				PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (p == MAP_FAILED) {
+				free(e);
+				return NULL;
+			}
+			if (extra != 0) {
+				head = (size_t)(MEMPOOL_HUGE_PAGE
+					- (uintptr_t)p % MEMPOOL_HUGE_PAGE)
+					% MEMPOOL_HUGE_PAGE;
+				if (head != 0) {
+					munmap(p, head);
+				}
+				if (head != extra) {
+					munmap(p + head + e->map_len,
+						extra - head);
+				}
+				p += head;
+			}
+#ifdef MADV_HUGEPAGE
+			madvise(p, e->map_len, MADV_HUGEPAGE);
+#endif
+			memset(p, 0, e->map_len);
+		}
+		e->mem = (argon2_block *)p;
+	}
+#else
+	e->mem = calloc(1, len);
+	if (e->mem == NULL) {
+		free(e);
+		return NULL;
+	}
+
+	/*
+	 * calloc() may return untouched pages; fault them in now.
+	 */
+	memset(e->mem, 0, len);
+#endif
+	return e;
+}
+
+static void
+mempool_release(mempool_entry *e)
+{
+#if PHC_SF_MMAP && defined MAP_ANONYMOUS
+	munmap(e->mem, e->map_len);
+#else
+	free(e->mem);
+#endif
+	free(e);
+}
+
+/*
+ * Get a zeroed matrix of 'len' bytes, from the cache if possible. NULL
+ * is returned on allocation failure, or if the matrix does not fit
+ * under the cap (with all cached matrices released).
+ */
+static mempool_entry *
+mempool_get(phc_mempool *mp, size_t len)
+{
+	mempool_entry *e, **pe, *evict;
+	size_t map_len;
+	int fits;
+
+	evict = NULL;
+	map_len = mempool_map_len(len);
+	mempool_lock(mp);
+	for (pe = &mp->free_list; *pe != NULL; pe = &(*pe)->next) {
+		if ((*pe)->len == len) {
+			e = *pe;
+			*pe = e->next;
+			mp->st.cached -= e->map_len;
+			mp->st.hits ++;
+			mempool_unlock(mp);
+			return e;
+		}
+	}
+	mp->st.misses ++;
+
+	/*
+	 * Release cached matrices (oldest first, i.e. at the end of the
+	 * list) until the new one fits under the cap, and reserve its
+	 * size before allocating it, so that concurrent allocations
+	 * cannot exceed the cap.
+	 */
+	while (mp->free_list != NULL
+		&& map_len > mp->max_bytes - mp->st.resident)
+	{
+		for (pe = &mp->free_list; (*pe)->next != NULL;
+			pe = &(*pe)->next);
+		e = *pe;
+		*pe = NULL;
+		mp->st.resident -= e->map_len;
+		mp->st.cached -= e->map_len;
+		e->next = evict;
+		evict = e;
+	}
+	fits = map_len <= mp->max_bytes - mp->st.resident;
+	if (fits) {
+		mp->st.resident += map_len;
+	}
+	mempool_unlock(mp);
+	while (evict != NULL) {
+		e = evict;
+		evict = e->next;
+		mempool_release(e);
+	}
+	if (!fits) {
+		return NULL;
+	}
+	e = mempool_alloc(len);
+	if (e == NULL) {
+		mempool_lock(mp);
+		mp->st.resident -= map_len;
+		mempool_unlock(mp);
+	}
+	return e;
+}
+
+/*
+ * Return a matrix to the pool: it is zeroed, then cached at the head of
+ * the list (it is already counted under the cap).
+ */
+static void
+mempool_put(phc_mempool *mp, mempool_entry *e)
+{
+	memset(e->mem, 0, e->len);
+	mempool_lock(mp);
+	e->next = mp->free_list;
+	mp->free_list = e;
+	mp->st.cached += e->map_len;
+	mempool_unlock(mp);
+}
+
+/*
+ * Get a snapshot of the pool statistics: bytes owned by the pool (in
+ * use or cached), bytes cached, and number of requests served from the
+ * cache or with a new allocation.
+ */
+void
+phc_mempool_get_stats(phc_mempool *mp, phc_mempool_stats *st)
+{
+	mempool_lock(mp);
+	*st = mp->st;
+	mempool_unlock(mp);
+}
+
+/*
+ * Release all cached matrices and the pool. No matrix may be in use.
+ */
+void
+phc_mempool_free(phc_mempool *mp)
+{
+	while (mp->free_list != NULL) {
+		mempool_entry *e;
+
+		e = mp->free_list;
+		mp->free_list = e->next;
+		mempool_release(e);
+	}
+#if PHC_SF_THREADS
+	pthread_mutex_destroy(&mp->lock);
+#endif
+	memset(mp, 0, sizeof *mp);
+}
+
+/*
+ * Admission control for hash computations: each hash reserves the size
+ * of its matrix from a global memory budget before allocating it, and
+ * releases it when done. A request that does not fit waits in a queue
+ * (or is rejected, if the caller does not want to wait, if the queue is
+ * full, or if it exceeds the whole budget).
+ *
+ * Queued requests are granted in arrival order whenever they fit, so
+ * that small requests are not stuck behind a large one waiting for
+ * memory. To avoid starving large requests, a request that has waited
+ * more than the "aging" delay blocks all requests queued after it until
+ * it is granted.
+ */
+
+typedef struct admission_waiter_ {
+	size_t bytes;
+	uint64_t since;
+	int granted;
+	struct admission_waiter_ *next;
+} admission_waiter;
+
+/*
+ * Admission statistics: current and peak reserved memory, current and
+ * peak queue length, numbers of admitted and rejected requests, and
+ * total and maximum waiting time (in seconds) of admitted requests.
+ */
+typedef struct {
+	size_t budget;
+	size_t in_use;
+	size_t peak_in_use;
+	size_t queued;
+	size_t peak_queued;
+	size_t admitted;
+	size_t rejected;
+	double wait_total;
+	double wait_max;
+} phc_admission_stats;
+
+typedef struct {
+#if PHC_SF_THREADS
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+#endif
+	admission_waiter *queue;
+	size_t max_queue;
+	uint64_t aging;
+	phc_admission_stats st;
+} phc_admission;
+
+/*
+ * Monotonic time, in nanoseconds.
+ */
+static uint64_t
+admission_now(void)
+{
+#if PHC_SF_THREADS && defined CLOCK_MONOTONIC
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+#else
+	return (uint64_t)((double)clock() * 1e9 / CLOCKS_PER_SEC);
+#endif
+}
+
+/*
+ * Initialize an admission controller with a budget of 'budget' bytes, at
+ * most 'max_queue' waiting requests, and an aging delay of 'aging'
+ * seconds. Returned value is 1 on success, 0 on error.
+ */
+int
+phc_admission_init(phc_admission *ac, size_t budget, size_t max_queue,
+	double aging)
+{
+	memset(ac, 0, sizeof *ac);
+	ac->st.budget = budget;
+	ac->max_queue = max_queue;
+	ac->aging = aging <= 0.0 ? 0 : (uint64_t)(aging * 1e9);
+#if PHC_SF_THREADS
+	if (pthread_mutex_init(&ac->lock, NULL) != 0) {
+		return 0;
+	}
+	if (pthread_cond_init(&ac->cond, NULL) != 0) {
+		pthread_mutex_destroy(&ac->lock);
+		return 0;
+	}
+#endif
+	return 1;
+}
+
+/*
+ * Release an admission controller. No request may be waiting.
+ */
+void
+phc_admission_free(phc_admission *ac)
+{
+#if PHC_SF_THREADS
+	pthread_cond_destroy(&ac->cond);
+	pthread_mutex_destroy(&ac->lock);
+#endif
+	memset(ac, 0, sizeof *ac);
+}
+
+static void
+admission_lock(phc_admission *ac)
+{
+#if PHC_SF_THREADS
+	pthread_mutex_lock(&ac->lock);
+#else
+	(void)ac;
+#endif
+}
+
+static void
+admission_unlock(phc_admission *ac)
+{
+#if PHC_SF_THREADS
+	pthread_mutex_unlock(&ac->lock);
+#else
+	(void)ac;
+#endif
+}
+
+/*
+ * Grant queued requests that fit, in order, stopping at the first aged
+ * request that does not fit. The lock must be held. Returned value is
+ * non-zero if some request was granted.
+ */
+static int
+admission_grant(phc_admission *ac)
+{
+	admission_waiter **pw;
+	uint64_t now;
+	int any;
+
+	now = admission_now();
+	any = 0;
+	pw = &ac->queue;
+	while (*pw != NULL) {
+		admission_waiter *w;
+		double wait;
+
+		w = *pw;
+		if (ac->st.in_use + w->bytes > ac->st.budget) {
+			if (now - w->since >= ac->aging) {
+				break;
+			}
+			pw = &w->next;
+			continue;
+		}
+		*pw = w->next;
+		w->granted = 1;
+		any = 1;
+		ac->st.in_use += w->bytes;
+		if (ac->st.in_use > ac->st.peak_in_use) {
+			ac->st.peak_in_use = ac->st.in_use;
+		}
+		ac->st.queued --;
+		ac->st.admitted ++;
+		wait = (double)(now - w->since) / 1e9;
+		ac->st.wait_total += wait;
+		if (wait > ac->st.wait_max) {
+			ac->st.wait_max = wait;
+		}
+	}
+	return any;
+}
+
+/*
+ * Reserve 'bytes' from the budget. If the reservation cannot be granted
+ * immediately and 'wait' is non-zero, the caller is queued until it is
+ * granted, unless 'max_queue' requests are already queued (when threads
+ * are disabled, there is no waiting). Returned value is 1 if the
+ * reservation was granted, 0 if it was rejected.
+ */
+int
+phc_admission_acquire(phc_admission *ac, size_t bytes, int wait)
+{
+	admission_waiter w, **pw;
+
+	admission_lock(ac);
+	if (bytes > ac->st.budget) {
+		ac->st.rejected ++;
+		admission_unlock(ac);
+		return 0;
+	}
+	w.bytes = bytes;
+	w.since = admission_now();
+	w.granted = 0;
+	w.next = NULL;
+	for (pw = &ac->queue; *pw != NULL; pw = &(*pw)->next);
+	*pw = &w;
+	ac->st.queued ++;
+	admission_grant(ac);
+#if PHC_SF_THREADS
+	if (!w.granted && wait && ac->st.queued <= ac->max_queue) {
+		if (ac->st.queued > ac->st.peak_queued) {
+			ac->st.peak_queued = ac->st.queued;
+		}
+		while (!w.granted) {
+			pthread_cond_wait(&ac->cond, &ac->lock);
+		}
+	}
+#else
+	(void)wait;
+#endif
+	if (!w.granted) {
+		/*
+		 * Leaving the queue may unblock requests queued after an
+		 * aged one.
+		 */
+		for (pw = &ac->queue; *pw != &w; pw = &(*pw)->next);
+		*pw = w.next;
+		ac->st.queued --;
+		ac->st.rejected ++;
+		if (admission_grant(ac)) {
+#if PHC_SF_THREADS
+			pthread_cond_broadcast(&ac->cond);
+#endif
+		}
+	}
+	admission_unlock(ac);
+	return w.granted;
+}
+
+/*
+ * Return 'bytes' to the budget, and wake up the queued requests that
+ * now fit.
+ */
+void
+phc_admission_release(phc_admission *ac, size_t bytes)
+{
+	admission_lock(ac);
+	ac->st.in_use -= bytes;
+	if (admission_grant(ac)) {
+#if PHC_SF_THREADS
+		pthread_cond_broadcast(&ac->cond);
+#endif
+	}
+	admission_unlock(ac);
+}
+
+void
+phc_admission_get_stats(phc_admission *ac, phc_admission_stats *st)
+{
+	admission_lock(ac);
+	*st = ac->st;
+	admission_unlock(ac);
+}
+
+/*
+ * Cache of reference indices. With data-independent addressing, the
+ * reference blocks depend only on (m', t, p, type); all hashes with the
+ * same parameters would otherwise regenerate the same address blocks
+ * (two calls to G per 128 blocks) and recompute the same indices. The
+ * cache keeps them, as 32-bit block indices, per parameter tuple, and
+ * hands them out to hash computations.
+ *
+ * Entries are immutable once built, and reference-counted; the least
+ * recently used entries that are not in use are evicted to keep the
+ * total size within a cap. An entry larger than the cap is not built at
+ * all: it could not be kept, and building it would cost as much as
+ * generating the addresses during the hash, plus the memory for the
+ * indices.
+ */
+
+typedef struct addr_stream_ {
+	uint32_t lanes;
+	uint32_t lane_len;
+	uint32_t passes;
+	int type;
+	uint32_t *refs;
+	size_t len;
+	unsigned users;
+	int cached;
+	struct addr_stream_ *next;
+} addr_stream;
+
+typedef struct {
+	size_t bytes;
+	size_t entries;
+	size_t hits;
+	size_t misses;
+} phc_addr_cache_stats;
+
+typedef struct {
+#if PHC_SF_THREADS
+	pthread_mutex_t lock;
+#endif
+	addr_stream *list;
+	size_t max_bytes;
+	phc_addr_cache_stats st;
+} phc_addr_cache;
+
+/*
+ * Initialize a cache that keeps at most 'max_bytes' bytes of indices.
+ * Returned value is 1 on success, 0 on error.
+ */
+int
+phc_addr_cache_init(phc_addr_cache *ac, size_t max_bytes)
+{
+	memset(ac, 0, sizeof *ac);
+	ac->max_bytes = max_bytes;
+#if PHC_SF_THREADS
+	if (pthread_mutex_init(&ac->lock, NULL) != 0) {
+		return 0;
+	}
+#endif
+	return 1;
+}
+
+static void
+addr_cache_lock(phc_addr_cache *ac)
+{
+#if PHC_SF_THREADS
+	pthread_mutex_lock(&ac->lock);
+#else
+	(void)ac;
+#endif
+}
+
+static void
+addr_cache_unlock(phc_addr_cache *ac)
+{
+#if PHC_SF_THREADS
+	pthread_mutex_unlock(&ac->lock);
+#else
+	(void)ac;
+#endif
+}
+
+/*
+ * Find the entry for an instance, and move it to the front of the list.
+ * The lock must be held.
+ */
+static addr_stream *
+addr_cache_find(phc_addr_cache *ac, const argon2_instance *in)
+{
+	addr_stream **pe, *e;
+
+	for (pe = &ac->list; *pe != NULL; pe = &(*pe)->next) {
+		e = *pe;
+		if (e->lanes == in->lanes && e->lane_len == in->lane_len
+			&& e->passes == in->passes && e->type == in->type)
+		{
+			*pe = e->next;
+			e->next = ac->list;
+			ac->list = e;
+			e->users ++;
+			return e;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Get the reference indices for an instance, building them if needed.
+ * NULL is returned if the hash has no data-independent segments, if its
+ * indices would not fit in the cap, or on allocation failure (the hash
+ * then computes addresses itself). The entry must be returned with
+ * addr_cache_put().
+ */
+static addr_stream *
+addr_cache_get(phc_addr_cache *ac, const argon2_instance *in)
+{
+	addr_stream *e, *f, **pe;
+	uint64_t count;
+
+	count = argon2_refs_count(in);
+	if (count == 0 || count > ac->max_bytes / sizeof(uint32_t)) {
+		return NULL;
+	}
+	addr_cache_lock(ac);
+	e = addr_cache_find(ac, in);
+	if (e != NULL) {
+		ac->st.hits ++;
+	} else {
+		ac->st.misses ++;
+	}
+	addr_cache_unlock(ac);
+	if (e != NULL) {
+		return e;
+	}
+
+	/*
+	 * Indices are built without holding the lock; if another
+	 * thread has built the same entry in the meantime, ours is
+	 * discarded.
+	 */
+	e = malloc(sizeof *e);
+	if (e == NULL) {
+		return NULL;
+	}
+	e->len = (size_t)count * sizeof(uint32_t);
+	e->refs = malloc(e->len);
+	if (e->refs == NULL) {
+		free(e);
+		return NULL;
+	}
+	argon2_build_refs(in, e->refs);
+	e->lanes = in->lanes;
+	e->lane_len = in->lane_len;
+	e->passes = in->passes;
+	e->type = in->type;
+	e->users = 1;
+	e->cached = 0;
+	addr_cache_lock(ac);
+	f = addr_cache_find(ac, in);
+	if (f != NULL) {
+		addr_cache_unlock(ac);
+		free(e->refs);
+		free(e);
+		return f;
+	}
+	while (ac->st.bytes + e->len > ac->max_bytes) {
+		addr_stream **victim;
+
+		/*
+		 * Evict the least recently used entry not in use (the
+		 * list is in most recently used order).
+		 */
+		victim = NULL;
+		for (pe = &ac->list; *pe != NULL; pe = &(*pe)->next) {
+			if ((*pe)->users == 0) {
+				victim = pe;
+			}
+		}
+		if (victim == NULL) {
+			break;
+		}
+		f = *victim;
+		*victim = f->next;
+		ac->st.bytes -= f->len;
+		ac->st.entries --;
+		free(f->refs);
+		free(f);
+	}
+	if (ac->st.bytes + e->len <= ac->max_bytes) {
+		e->cached = 1;
+		e->next = ac->list;
+		ac->list = e;
+		ac->st.bytes += e->len;
+		ac->st.entries ++;
+	}
+	addr_cache_unlock(ac);
+	return e;
+}
+
+/*
+ * Return an entry obtained with addr_cache_get().
+ */
+static void
+addr_cache_put(phc_addr_cache *ac, addr_stream *e)
+{
+	int drop;
+
+	addr_cache_lock(ac);
+	e->users --;
+	drop = !e->cached && e->users == 0;
+	addr_cache_unlock(ac);
+	if (drop) {
+		free(e->refs);
+		free(e);
+	}
+}
+
+void
+phc_addr_cache_get_stats(phc_addr_cache *ac, phc_addr_cache_stats *st)
+{
+	addr_cache_lock(ac);
+	*st = ac->st;
+	addr_cache_unlock(ac);
+}
+
+/*
+ * Release all entries and the cache. No hash may be in progress.
+ */
+void
+phc_addr_cache_free(phc_addr_cache *ac)
+{
+	while (ac->list != NULL) {
+		addr_stream *e;
+
+		e = ac->list;
+		ac->list = e->next;
+		free(e->refs);
+		free(e);
+	}
+#if PHC_SF_THREADS
+	pthread_mutex_destroy(&ac->lock);
+#endif
+	memset(ac, 0, sizeof *ac);
+}
+
+/*
+ * Execution environment of a hash computation: a thread pool for lanes,
+ * a memory pool for the matrix, an admission controller that must grant
+ * the matrix size before it is allocated, and a cache of reference
+ * indices. NULL fields mean that lanes run on the calling thread, that
+ * the matrix is allocated with malloc(), that no memory budget applies,
+ * and that addresses are generated by each hash. 'prefetch' is the
+ * distance (in blocks) at which reference blocks are prefetched; 0
+ * likewise means the default (ARGON2_PREFETCH_DISTANCE), and
+ * ARGON2_PREFETCH_NONE disables prefetching.
+ */
+typedef struct {
+	phc_pool *threads;
+	phc_mempool *memory;
+	phc_admission *admission;
+	phc_addr_cache *addresses;
+	uint32_t prefetch;
+} argon2_env;
+
+/*
+ * Check the parameters of a hash, and set the geometry of the matrix in
+ * 'in' (but not its memory), and the output length in '*out_len'.
+ * Returned value is 1 on success, 0 if parameters are invalid.
+ */
+static int
+argon2_setup(argon2_instance *in, const argon2i_params *pp, int type,
+	size_t pwd_len, size_t secret_len, size_t *out_len)
+{
+	*out_len = pp->output_len == 0 ? 32 : pp->output_len;
+	if ((type != ARGON2_D && type != ARGON2_I && type != ARGON2_ID)
+		|| pp->p < 1 || pp->p > 255 || pp->t < 1
+		|| (pp->t >> 30) > 3 || (pp->m >> 30) > 3 || pp->m < 8 * pp->p
+		|| pp->salt_len < 8 || pp->salt_len > sizeof pp->salt
+		|| pp->associated_data_len > sizeof pp->associated_data
+		|| *out_len < 4 || *out_len > sizeof pp->output
+		|| (pwd_len >> 30) > 3 || (secret_len >> 30) > 3)
+	{
+		return 0;
+	}
+
+	/*
+	 * The memory size is rounded down to a multiple of 4*p blocks.
+	 */
+	in->mem = NULL;
+	in->lanes = (uint32_t)pp->p;
+	in->seg_len = (uint32_t)(pp->m / (in->lanes * ARGON2_SYNC_POINTS));
+	in->lane_len = in->seg_len * ARGON2_SYNC_POINTS;
+	in->num_blocks = in->lane_len * in->lanes;
+	in->passes = (uint32_t)pp->t;
+	in->type = type;
+	in->compress = argon2_compress_select();
+	in->refs = NULL;
+	in->prefetch = ARGON2_PREFETCH_DISTANCE;
+	return (uint64_t)in->num_blocks * sizeof(argon2_block) <= (size_t)-1;
+}
+
+/*
+ * Compute H0 (64 bytes), followed by room for two 32-bit indices.
+ */
+static void
+argon2_h0(unsigned char *h0, const argon2_instance *in,
+	const argon2i_params *pp, size_t out_len, const void *pwd,
+	size_t pwd_len, const void *secret, size_t secret_len)
+{
+	blake2b_context bc;
+
+	blake2b_init(&bc, 64);
+	blake2b_update32(&bc, in->lanes);
+	blake2b_update32(&bc, (uint32_t)out_len);
+	blake2b_update32(&bc, (uint32_t)pp->m);
+	blake2b_update32(&bc, in->passes);
+	blake2b_update32(&bc, ARGON2_VERSION);
+	blake2b_update32(&bc, (uint32_t)in->type);
+	blake2b_update32(&bc, (uint32_t)pwd_len);
+	blake2b_update(&bc, pwd, pwd_len);
+	blake2b_update32(&bc, (uint32_t)pp->salt_len);
+	blake2b_update(&bc, pp->salt, pp->salt_len);
+	blake2b_update32(&bc, (uint32_t)secret_len);
+	blake2b_update(&bc, secret, secret_len);
+	blake2b_update32(&bc, (uint32_t)pp->associated_data_len);
+	blake2b_update(&bc, pp->associated_data, pp->associated_data_len);
+	blake2b_final(&bc, h0);
+}
+
+/*
+ * Compute the first two blocks of each lane of 'n' instances, from
+ * their values of H0 (with room for the indices). The 2*p*n calls to H'
+ * are independent, and computed four at a time.
+ */
+static void
+argon2_init_blocks(const argon2_instance *in, unsigned char (*h0)[72],
+	size_t n)
+{
+	unsigned char src[4][72], tmp[4][ARGON2_BLOCK_LEN];
+	unsigned char *sp[4], *tp[4];
+	argon2_block *dst[4];
+	size_t k;
+	uint32_t lane;
+	int i, j, c;
+
+	for (c = 0; c < 4; c ++) {
+		sp[c] = src[c];
+		tp[c] = tmp[c];
+	}
+	c = 0;
+	for (k = 0; k < n; k ++) {
+		for (lane = 0; lane < in[k].lanes; lane ++) {
+			for (i = 0; i < 2; i ++) {
+				memcpy(src[c], h0[k], 64);
+				enc32le(src[c] + 64, (uint32_t)i);
+				enc32le(src[c] + 68, lane);
+				dst[c ++] = &in[k].mem[lane * in[k].lane_len
+					+ (uint32_t)i];
+				if (c < 4 && (k < n - 1
+					|| lane < in[k].lanes - 1 || i == 0))
+				{
+					continue;
+				}
+
+				/*
+				 * After the last call, unused slots get a
+				 * copy of the first input (their output is
+				 * ignored).
+				 */
+				for (j = c; j < 4; j ++) {
+					memcpy(src[j], src[0], sizeof src[0]);
+				}
+				argon2_hprime4(tp, sizeof tmp[0],
+					(const unsigned char *const *)sp,
+					sizeof src[0]);
+				while (c -- > 0) {
+					for (j = 0; j < 128; j ++) {
+						dst[c]->v[j] = dec64le(
+							tmp[c] + (j << 3));
+					}
+				}
+				c = 0;
+			}
+		}
+	}
+	memset(src, 0, sizeof src);
+	memset(tmp, 0, sizeof tmp);
+}
+
+/*
+ * Compute the XOR of the last blocks of all lanes, over which the output
+ * is computed.
+ */
+static void
+argon2_final_block(unsigned char *dst, const argon2_instance *in)
+{
+	argon2_block acc;
+	uint32_t lane;
+	int i;
+
+	acc = in->mem[in->lane_len - 1];
+	for (lane = 1; lane < in->lanes; lane ++) {
+		const argon2_block *b;
+
+		b = &in->mem[lane * in->lane_len + in->lane_len - 1];
+		for (i = 0; i < 128; i ++) {
+			acc.v[i] ^= b->v[i];
+		}
+	}
+	for (i = 0; i < 128; i ++) {
+		enc64le(dst + (i << 3), acc.v[i]);
+	}
+	memset(&acc, 0, sizeof acc);
+}
+
+/*
+ * Compute the output into pp->output, and set pp->output_len.
+ */
+static void
+argon2_output(const argon2_instance *in, argon2i_params *pp, size_t out_len)
+{
+	unsigned char tmp[ARGON2_BLOCK_LEN];
+
+	argon2_final_block(tmp, in);
+	argon2_hprime(pp->output, out_len, tmp, sizeof tmp, NULL, 0);
+	pp->output_len = out_len;
+	memset(tmp, 0, sizeof tmp);
+}
+
+/*
+ * Compute an Argon2 hash (type ARGON2_D, ARGON2_I or ARGON2_ID) with the
+ * parameters in 'pp', over the provided password and (optional) secret
+ * key, in the environment 'env' (which may be NULL). On success, the
+ * output is written into pp->output and pp->output_len is set, and 1 is
+ * returned. On error (invalid parameters, memory allocation failure, a
+ * matrix that does not fit under the memory pool cap, or rejection by
+ * the admission controller), 0 is returned. When an admission
+ * controller is set, the calling thread waits until the matrix fits in
+ * the memory budget.
+ */
+int
+argon2_hash_env(const argon2_env *env, argon2i_params *pp, int type,
+	const void *pwd, size_t pwd_len, const void *secret, size_t secret_len)
+{
+	argon2_instance in;
+	mempool_entry *me;
+	phc_admission *ac;
+	addr_stream *refs;
+	size_t mem_len, out_len;
+	unsigned char h0[72];
+
+	if (!argon2_setup(&in, pp, type, pwd_len, secret_len, &out_len)) {
+		return 0;
+	}
+	if (env != NULL && env->prefetch != 0) {
+		in.prefetch = env->prefetch == ARGON2_PREFETCH_NONE
+			? 0 : env->prefetch;
+	}
+	mem_len = (size_t)in.num_blocks * sizeof(argon2_block);
+	ac = env == NULL ? NULL : env->admission;
+	if (ac != NULL && !phc_admission_acquire(ac, mem_len, 1)) {
+		return 0;
+	}
+	me = NULL;
+	if (env != NULL && env->memory != NULL) {
+		me = mempool_get(env->memory, mem_len);
+		in.mem = me == NULL ? NULL : me->mem;
+	} else {
+		in.mem = malloc(mem_len);
+	}
+	if (in.mem == NULL) {
+		if (ac != NULL) {
+			phc_admission_release(ac, mem_len);
+		}
+		return 0;
+	}
+
+	refs = NULL;
+	if (env != NULL && env->addresses != NULL) {
+		refs = addr_cache_get(env->addresses, &in);
+		in.refs = refs == NULL ? NULL : refs->refs;
+	}
+
+	argon2_h0(h0, &in, pp, out_len, pwd, pwd_len, secret, secret_len);
+	argon2_init_blocks(&in, &h0, 1);
+	argon2_fill_memory(&in, env == NULL ? NULL : env->threads);
+	argon2_output(&in, pp, out_len);
+
+	if (refs != NULL) {
+		addr_cache_put(env->addresses, refs);
+	}
+
+	if (me != NULL) {
+		mempool_put(env->memory, me);
+	} else {
+		memset(in.mem, 0, mem_len);
+		free(in.mem);
+	}
+	if (ac != NULL) {
+		phc_admission_release(ac, mem_len);
+	}
+	memset(h0, 0, sizeof h0);
+	return 1;
+}
+
+/*
+ * Same as argon2_hash_env(), with lanes computed by the thread pool
+ * 'pool' (if not NULL) and the calling thread.
+ */
+int
+argon2_hash_pool(phc_pool *pool, argon2i_params *pp, int type,
+	const void *pwd, size_t pwd_len, const void *secret, size_t secret_len)
+{
+	argon2_env env;
+
+	env.threads = pool;
+	env.memory = NULL;
+	env.admission = NULL;
+	env.addresses = NULL;
+	env.prefetch = 0;
+	return argon2_hash_env(&env, pp, type, pwd, pwd_len,
+		secret, secret_len);
+}
+
+/*
+ * Same as argon2_hash_env(), with all lanes computed on the calling
+ * thread, and the matrix allocated with malloc().
+ */
+int
+argon2_hash(argon2i_params *pp, int type,
+	const void *pwd, size_t pwd_len, const void *secret, size_t secret_len)
+{
+	return argon2_hash_env(NULL, pp, type, pwd, pwd_len,
+		secret, secret_len);
+}
+
+/*
+ * Batch computation of small hashes in one thread. With small matrices
+ * (e.g. m = 64 to 1024 kilobytes, t = 1), a large part of the cost of a
+ * hash is in H': the first two blocks of each lane and the output are
+ * each produced by a chain of BLAKE2b calls, which are strictly serial.
+ * Hashes are processed in groups of up to ARGON2_MULTI_MAX, whose H'
+ * chains are computed four at a time across the lanes of AVX2 registers
+ * (see argon2_hprime4()); the matrices of a group are allocated
+ * together.
+ */
+
+#define ARGON2_MULTI_MAX   4
+
+/*
+ * Compute 'num' hashes of type 'type': hash i uses the parameters pp[i]
+ * and the password pwd[i] (of pwd_len[i] bytes), without secret key,
+ * and its output is written into pp[i].output (as with argon2_hash()).
+ * If 'ok' is not NULL, ok[i] is set to 1 if hash i was computed, 0 on
+ * error. Returned value is the number of hashes computed.
+ */
+size_t
+argon2_hash_multi(argon2i_params *pp, const void *const *pwd,
+	const size_t *pwd_len, size_t num, int type, int *ok)
+{
+	size_t u, count;
+
+	count = 0;
+	u = 0;
+	while (u < num) {
+		argon2_instance in[ARGON2_MULTI_MAX];
+		size_t out_len[ARGON2_MULTI_MAX], idx[ARGON2_MULTI_MAX];
+		unsigned char h0[ARGON2_MULTI_MAX][72];
+		unsigned char fin[4][ARGON2_BLOCK_LEN], junk[64];
+		unsigned char *fp[4], *op[4];
+		size_t k, n, total;
+		argon2_block *mem;
+
+		/*
+		 * Collect the next valid hashes; invalid ones fail
+		 * immediately.
+		 */
+		n = 0;
+		total = 0;
+		for (; u < num && n < ARGON2_MULTI_MAX; u ++) {
+			if (!argon2_setup(&in[n], &pp[u], type, pwd_len[u], 0,
+				&out_len[n])
+				|| total + in[n].num_blocks < total)
+			{
+				if (ok != NULL) {
+					ok[u] = 0;
+				}
+				continue;
+			}
+			total += in[n].num_blocks;
+			idx[n ++] = u;
+		}
+		if (n == 0) {
+			continue;
+		}
+		mem = NULL;
+		if ((uint64_t)total * sizeof(argon2_block) <= (size_t)-1) {
+			mem = malloc(total * sizeof(argon2_block));
+		}
+		if (mem == NULL) {
+			for (k = 0; ok != NULL && k < n; k ++) {
+				ok[idx[k]] = 0;
+			}
+			continue;
+		}
+		total = 0;
+		for (k = 0; k < n; k ++) {
+			in[k].mem = mem + total;
+			total += in[k].num_blocks;
+			argon2_h0(h0[k], &in[k], &pp[idx[k]], out_len[k],
+				pwd[idx[k]], pwd_len[idx[k]], NULL, 0);
+		}
+		argon2_init_blocks(in, h0, n);
+		for (k = 0; k < n; k ++) {
+			argon2_fill_memory(&in[k], NULL);
+		}
+
+		/*
+		 * Outputs of the same length are computed together;
+		 * unused slots compute a copy of the first output, into
+		 * a scratch buffer.
+		 */
+		for (k = 0; k < 4; k ++) {
+			fp[k] = fin[k];
+			op[k] = junk;
+			if (k < n) {
+				argon2_final_block(fin[k], &in[k]);
+			} else {
+				memcpy(fin[k], fin[0], sizeof fin[0]);
+			}
+		}
+		for (k = 1; k < n && out_len[k] == out_len[0]; k ++);
+		if (k == n && out_len[0] <= sizeof junk) {
+			for (k = 0; k < n; k ++) {
+				op[k] = pp[idx[k]].output;
+			}
+			argon2_hprime4(op, out_len[0],
+				(const unsigned char *const *)fp, sizeof fin[0]);
+		} else {
+			for (k = 0; k < n; k ++) {
+				argon2_hprime(pp[idx[k]].output, out_len[k],
+					fin[k], sizeof fin[0], NULL, 0);
+			}
+		}
+		for (k = 0; k < n; k ++) {
+			pp[idx[k]].output_len = out_len[k];
+			if (ok != NULL) {
+				ok[idx[k]] = 1;
+			}
+		}
+		count += n;
+		memset(mem, 0, total * sizeof(argon2_block));
+		free(mem);
+		memset(h0, 0, sizeof h0);
+		memset(fin, 0, sizeof fin);
+	}
+	return count;
+}
+
+/*
+ * NUMA placement. On a machine with several memory nodes, a hash whose
+ * matrix lives on a remote node is much slower, since Argon2 is bound
+ * by memory latency and bandwidth. A NUMA environment therefore keeps,
+ * for each node, a thread pool whose workers are pinned to the CPUs of
+ * that node, and a memory pool of matrices allocated on that node. Each
+ * hash is assigned to the node with the fewest hashes in progress; the
+ * calling thread is pinned to that node for the duration of the hash,
+ * so that new matrices are faulted in (first touch) on that node, and
+ * lanes run by the calling thread are local as well.
+ *
+ * The topology is read from /sys/devices/system/node; a fake topology
+ * can be used instead (e.g. for tests on a single-node machine).
+ * Pinning is best-effort: it is skipped when threads are disabled or
+ * CPU affinity is not supported, and failures are ignored.
+ */
+
+#define NUMA_MAX_NODES   16
+#define NUMA_MAX_CPUS    1024
+
+#if PHC_SF_THREADS && defined __linux__ && defined CPU_SET
+#define NUMA_PIN   1
+#else
+#define NUMA_PIN   0
+#endif
+
+/*
+ * Topology: the CPUs of each node, as a bitmap (a CPU may appear in
+ * several nodes of a fake topology).
+ */
+typedef struct {
+	unsigned num_nodes;
+	uint64_t cpus[NUMA_MAX_NODES][NUMA_MAX_CPUS / 64];
+} phc_numa_topology;
+
+static void
+numa_add_cpu(phc_numa_topology *topo, unsigned node, unsigned long cpu)
+{
+	if (cpu < NUMA_MAX_CPUS) {
+		topo->cpus[node][cpu >> 6] |= (uint64_t)1 << (cpu & 63);
+	}
+}
+
+static int
+numa_has_cpu(const phc_numa_topology *topo, unsigned node, unsigned cpu)
+{
+	return (topo->cpus[node][cpu >> 6] >> (cpu & 63)) & 1;
+}
+
+/*
+ * Parse a CPU list such as "0-3,8-11" into the CPUs of a node. Returned
+ * value is the number of CPUs in the list.
+ */
+static unsigned
+numa_parse_cpulist(phc_numa_topology *topo, unsigned node, const char *s)
+{
+	unsigned n;
+
+	n = 0;
+	for (;;) {
+		unsigned long lo, hi;
+		char *e;
+
+		if (*s < '0' || *s > '9') {
+			break;
+		}
+		lo = strtoul(s, &e, 10);
+		hi = lo;
+		if (*e == '-') {
+			hi = strtoul(e + 1, &e, 10);
+		}
+		for (; lo <= hi && lo < NUMA_MAX_CPUS; lo ++) {
+			numa_add_cpu(topo, node, lo);
+			n ++;
+		}
+		if (*e != ',') {
+			break;
+		}
+		s = e + 1;
+	}
+	return n;
+}
+
+/*
+ * Get the CPUs on which the calling thread may run (at most 'max', all
+ * lower than NUMA_MAX_CPUS), in increasing order. Without affinity
+ * support, CPUs 0 to n-1 are assumed, for the n CPUs online. Returned
+ * value is the number of CPUs (at least 1).
+ */
+static unsigned
+numa_allowed_cpus(unsigned *cpus, unsigned max)
+{
+	unsigned n;
+
+#if NUMA_PIN
+	cpu_set_t set;
+	unsigned cpu;
+
+	n = 0;
+	if (sched_getaffinity(0, sizeof set, &set) == 0) {
+		for (cpu = 0; cpu < NUMA_MAX_CPUS && cpu < CPU_SETSIZE
+			&& n < max; cpu ++)
+		{
+			if (CPU_ISSET(cpu, &set)) {
+				cpus[n ++] = cpu;
+			}
+		}
+	}
+	if (n > 0) {
+		return n;
+	}
+#endif
+	for (n = 0; n < default_threads() && n < max; n ++) {
+		cpus[n] = n;
+	}
+	return n;
+}
+
+/*
+ * Read the machine topology. Nodes without CPUs are skipped. If the
+ * topology cannot be read, a single node with all CPUs is assumed.
+ */
+void
+phc_numa_detect(phc_numa_topology *topo)
+{
+	unsigned node, u;
+
+	memset(topo, 0, sizeof *topo);
+	for (node = 0; node < 256 && topo->num_nodes < NUMA_MAX_NODES;
+		node ++)
+	{
+		char path[64], line[4096];
+		FILE *f;
+
+		sprintf(path, "/sys/devices/system/node/node%u/cpulist", node);
+		f = fopen(path, "r");
+		if (f == NULL) {
+			continue;
+		}
+		if (fgets(line, sizeof line, f) != NULL
+			&& numa_parse_cpulist(topo, topo->num_nodes, line) > 0)
+		{
+			topo->num_nodes ++;
+		}
+		fclose(f);
+	}
+	if (topo->num_nodes == 0) {
+		unsigned cpus[NUMA_MAX_CPUS], n;
+
+		topo->num_nodes = 1;
+		n = numa_allowed_cpus(cpus, NUMA_MAX_CPUS);
+		for (u = 0; u < n; u ++) {
+			numa_add_cpu(topo, 0, cpus[u]);
+		}
+	}
+}
+
+/*
+ * Make a fake topology with 'num_nodes' nodes (at most NUMA_MAX_NODES)
+ * of 'cpus_per_node' CPUs each. The CPUs are taken in turn from those
+ * on which the calling thread may run (see numa_allowed_cpus()), so
+ * that pinning succeeds on any machine, including under taskset or a
+ * cpuset.
+ */
+void
+phc_numa_fake(phc_numa_topology *topo,
+	unsigned num_nodes, unsigned cpus_per_node)
+{
+	unsigned cpus[NUMA_MAX_CPUS];
+	unsigned node, u, num_cpus;
+
+	memset(topo, 0, sizeof *topo);
+	if (num_nodes < 1) {
+		num_nodes = 1;
+	} else if (num_nodes > NUMA_MAX_NODES) {
+		num_nodes = NUMA_MAX_NODES;
+	}
+	num_cpus = numa_allowed_cpus(cpus, NUMA_MAX_CPUS);
+	topo->num_nodes = num_nodes;
+	for (node = 0; node < num_nodes; node ++) {
+		for (u = 0; u < cpus_per_node; u ++) {
+			numa_add_cpu(topo, node,
+				cpus[(node * cpus_per_node + u) % num_cpus]);
+		}
+	}
+}
+
+#if NUMA_PIN
+/*
+ * Restrict a thread to the CPUs of a node. Returned value is 1 on
+ * success, 0 on error.
+ */
+static int
+numa_pin(pthread_t th, const phc_numa_topology *topo, unsigned node)
+{
+	cpu_set_t set;
+	unsigned cpu;
+
+	CPU_ZERO(&set);
+	for (cpu = 0; cpu < NUMA_MAX_CPUS && cpu < CPU_SETSIZE; cpu ++) {
+		if (numa_has_cpu(topo, node, cpu)) {
+			CPU_SET(cpu, &set);
+		}
+	}
+	return pthread_setaffinity_np(th, sizeof set, &set) == 0;
+}
+#endif
+
+typedef struct {
+	phc_numa_topology topo;
+	phc_pool threads[NUMA_MAX_NODES];
+	phc_mempool memory[NUMA_MAX_NODES];
+	phc_admission *admission;
+	phc_addr_cache *addresses;
+#if PHC_SF_THREADS
+	pthread_mutex_t lock;
+#endif
+	unsigned active[NUMA_MAX_NODES];
+	size_t hashes[NUMA_MAX_NODES];
+	unsigned cursor;
+} phc_numa_env;
+
+/*
+ * Initialize a NUMA environment over the topology 'topo', with
+ * 'threads_per_node' pool workers per node, and a memory pool of at most
+ * 'max_bytes' bytes split evenly between nodes. The 'admission' and
+ * 'addresses' fields may be set afterwards to apply a memory budget to
+ * all hashes, and to share a cache of reference indices.
+ * Returned value is 1 on success, 0 on error.
+ */
+int
+phc_numa_env_init(phc_numa_env *ne, const phc_numa_topology *topo,
+	unsigned threads_per_node, size_t max_bytes)
+{
+	unsigned node;
+
+	memset(ne, 0, sizeof *ne);
+	ne->topo = *topo;
+#if PHC_SF_THREADS
+	if (pthread_mutex_init(&ne->lock, NULL) != 0) {
+		return 0;
+	}
+#endif
+	for (node = 0; node < topo->num_nodes; node ++) {
+		if (!phc_pool_init(&ne->threads[node], threads_per_node)) {
+			break;
+		}
+		if (!phc_mempool_init(&ne->memory[node],
+			max_bytes / topo->num_nodes))
+		{
+			phc_pool_free(&ne->threads[node]);
+			break;
+		}
+#if NUMA_PIN
+		{
+			unsigned u;
+
+			for (u = 0; u < ne->threads[node].num_threads; u ++) {
+				numa_pin(ne->threads[node].threads[u],
+					topo, node);
+			}
+		}
+#endif
+	}
+	if (node < topo->num_nodes) {
+		while (node -- > 0) {
+			phc_mempool_free(&ne->memory[node]);
+			phc_pool_free(&ne->threads[node]);
+		}
+#if PHC_SF_THREADS
+		pthread_mutex_destroy(&ne->lock);
+#endif
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Release a NUMA environment. No hash may be in progress.
+ */
+void
+phc_numa_env_free(phc_numa_env *ne)
+{
+	unsigned node;
+
+	for (node = 0; node < ne->topo.num_nodes; node ++) {
+		phc_mempool_free(&ne->memory[node]);
+		phc_pool_free(&ne->threads[node]);
+	}
+#if PHC_SF_THREADS
+	pthread_mutex_destroy(&ne->lock);
+#endif
+	memset(ne, 0, sizeof *ne);
+}
+
+static void
+numa_lock(phc_numa_env *ne)
+{
+#if PHC_SF_THREADS
+	pthread_mutex_lock(&ne->lock);
+#else
+	(void)ne;
+#endif
+}
+
+static void
+numa_unlock(phc_numa_env *ne)
+{
+#if PHC_SF_THREADS
+	pthread_mutex_unlock(&ne->lock);
+#else
+	(void)ne;
+#endif
+}
+
+/*
+ * Select the node with the fewest hashes in progress (ties are broken
+ * in round-robin order), and account for the new hash on that node.
+ */
+static unsigned
+numa_select(phc_numa_env *ne)
+{
+	unsigned node, u;
+
+	numa_lock(ne);
+	node = ne->cursor;
+	for (u = 1; u < ne->topo.num_nodes; u ++) {
+		unsigned v;
+
+		v = (ne->cursor + u) % ne->topo.num_nodes;
+		if (ne->active[v] < ne->active[node]) {
+			node = v;
+		}
+	}
+	ne->cursor = (node + 1) % ne->topo.num_nodes;
+	ne->active[node] ++;
+	ne->hashes[node] ++;
+	numa_unlock(ne);
+	return node;
+}
+
+/*
+ * Same as argon2_hash_env(), on the least busy node of the NUMA
+ * environment 'ne': the lanes run on that node's pool and on the calling
+ * thread (pinned to that node during the hash), and the matrix comes
+ * from that node's memory pool.
+ */
+int
+argon2_hash_numa(phc_numa_env *ne, argon2i_params *pp, int type,
+	const void *pwd, size_t pwd_len, const void *secret, size_t secret_len)
+{
+	argon2_env env;
+	unsigned node;
+	int r;
+#if NUMA_PIN
+	cpu_set_t saved;
+	int restore;
+#endif
+
+	node = numa_select(ne);
+#if NUMA_PIN
+	restore = pthread_getaffinity_np(pthread_self(),
+		sizeof saved, &saved) == 0
+		&& numa_pin(pthread_self(), &ne->topo, node);
+#endif
+	env.threads = &ne->threads[node];
+	env.memory = &ne->memory[node];
+	env.admission = ne->admission;
+	env.addresses = ne->addresses;
+	env.prefetch = 0;
+	r = argon2_hash_env(&env, pp, type, pwd, pwd_len,
+		secret, secret_len);
+#if NUMA_PIN
+	if (restore) {
+		pthread_setaffinity_np(pthread_self(), sizeof saved, &saved);
+	}
+#endif
+	numa_lock(ne);
+	ne->active[node] --;
+	numa_unlock(ne);
+	return r;
+}
+
+/* ==================================================================== */
+/*
+ * Test code.
+ */
+
+static const char *KAT_GOOD[] = {
+	"$argon2i$m=120,t=5000,p=2",
+	"$argon2i$m=120,t=4294967295,p=2",
+	"$argon2i$m=2040,t=5000,p=255",
+	"$argon2i$m=120,t=5000,p=2,keyid=Hj5+dsK0",
+	"$argon2i$m=120,t=5000,p=2,keyid=Hj5+dsK0ZQ",
+	"$argon2i$m=120,t=5000,p=2,keyid=Hj5+dsK0ZQA",
+	"$argon2i$m=120,t=5000,p=2,data=sRlHhRmKUGzdOmXn01XmXygd5Kc",
+	"$argon2i$m=120,t=5000,p=2,keyid=Hj5+dsK0,data=sRlHhRmKUGzdOmXn01XmXygd5Kc",
+	"$argon2i$m=120,t=5000,p=2$/LtFjH5rVL8",
+	"$argon2i$m=120,t=5000,p=2$4fXXG0spB92WPB1NitT8/OH0VKI",
+	"$argon2i$m=120,t=5000,p=2$BwUgJHHQaynE+a4nZrYRzOllGSjjxuxNXxyNRUtI6Dlw/zlbt6PzOL8Onfqs6TcG",
+	"$argon2i$m=120,t=5000,p=2,keyid=Hj5+dsK0$4fXXG0spB92WPB1NitT8/OH0VKI",
+	"$argon2i$m=120,t=5000,p=2,data=sRlHhRmKUGzdOmXn01XmXygd5Kc$4fXXG0spB92WPB1NitT8/OH0VKI",
+	"$argon2i$m=120,t=5000,p=2,keyid=Hj5+dsK0,data=sRlHhRmKUGzdOmXn01XmXygd5Kc$4fXXG0spB92WPB1NitT8/OH0VKI",
+	"$argon2i$m=120,t=5000,p=2$4fXXG0spB92WPB1NitT8/OH0VKI$iPBVuORECm5biUsjq33hn9/7BKqy9aPWKhFfK2haEsM",
+	"$argon2i$m=120,t=5000,p=2,keyid=Hj5+dsK0$4fXXG0spB92WPB1NitT8/OH0VKI$iPBVuORECm5biUsjq33hn9/7BKqy9aPWKhFfK2haEsM",
+	"$argon2i$m=120,t=5000,p=2,data=sRlHhRmKUGzdOmXn01XmXygd5Kc$4fXXG0spB92WPB1NitT8/OH0VKI$iPBVuORECm5biUsjq33hn9/7BKqy9aPWKhFfK2haEsM",
+	"$argon2i$m=120,t=5000,p=2,keyid=Hj5+dsK0,data=sRlHhRmKUGzdOmXn01XmXygd5Kc$4fXXG0spB92WPB1NitT8/OH0VKI$iPBVuORECm5biUsjq33hn9/7BKqy9aPWKhFfK2haEsM",
+	"$argon2i$m=120,t=5000,p=2,keyid=Hj5+dsK0,data=sRlHhRmKUGzdOmXn01XmXygd5Kc$iHSDPHzUhPzK7rCcJgOFfg$EkCWX6pSTqWruiR0",
+	"$argon2i$m=120,t=5000,p=2,keyid=Hj5+dsK0,data=sRlHhRmKUGzdOmXn01XmXygd5Kc$iHSDPHzUhPzK7rCcJgOFfg$J4moa2MM0/6uf3HbY2Tf5Fux8JIBTwIhmhxGRbsY14qhTltQt+Vw3b7tcJNEbk8ium8AQfZeD4tabCnNqfkD1g",
+	NULL
+};
+
+static const char *KAT_BAD[] = {
+	/* bad function name */
+	"$argon2j$m=120,t=5000,p=2",
+
+	/* missing parameter 'm' */
+	"$argon2i$t=5000,p=2",
+
+	/* missing parameter 't' */
+	"$argon2i$m=120,p=2",
+
+	/* missing parameter 'p' */
+	"$argon2i$m=120,t=5000",
+
+	/* value of 'm' is too small (lower than 8*p) */
+	"$argon2i$m=15,t=5000,p=2",
+
+	/* value of 't' is invalid */
 	"$argon2i$m=120,t=0,p=2",
 
-	/* value of 'p' is invalid (too small) */
-	"$argon2i$m=120,t=5000,p=0",
+	/* value of 'p' is invalid (too small) */
+	"$argon2i$m=120,t=5000,p=0",
+
+	/* value of 'p' is invalid (too large) */
+	"$argon2i$m=2000,t=5000,p=256",
+
+	/* value of 'm' has non-minimal encoding */
+	"$argon2i$m=0120,t=5000,p=2",
+
+	/* value of 't' has non-minimal encoding */
+	"$argon2i$m=120,t=05000,p=2",
+
+	/* value of 'p' has non-minimal encoding */
+	"$argon2i$m=120,t=5000,p=02",
+
+	/* value of 't' exceeds 2^32-1 */
+	"$argon2i$m=120,t=4294967296,p=2",
+
+	/* invalid Base64 for keyid (length = 9 characters) */
+	"$argon2i$m=120,t=5000,p=2,keyid=Hj5+dsK0Z",
+
+	/* invalid Base64 for keyid (unprocessed bits are not 0) */
+	"$argon2i$m=120,t=5000,p=2,keyid=Hj5+dsK0ZR",
+	"$argon2i$m=120,t=5000,p=2,keyid=Hj5+dsK0ZQB",
+
+	/* invalid keyid (too large) */
+	"$argon2i$m=120,t=5000,p=2,keyid=Mwmcv5/avkXJ",
+
+	/* invalid associated data (too large) */
+	"$argon2i$m=120,t=5000,p=2,data=Vrai0ME0m7lorfxfOCG3+6we5N89+2hXwkbv0C5SECab",
+
+	/* invalid salt (too small) */
+	"$argon2i$m=120,t=5000,p=2$+yPbRi6hdw",
+
+	/* invalid salt (too large) */
+	"$argon2i$m=120,t=5000,p=2$SIZzzPhYC/CXOf64vWG/IZjO/amlRgvKscaRCYwdg9R1boFN/NjaC1VdXdcOtFx+0A",
+
+	/* invalid output (too small) */
+	"$argon2i$m=120,t=5000,p=2$4fXXG0spB92WPB1NitT8/OH0VKI$iHSDPHzUhPzK7rCcJgOFfg$c+jbgTK0PT0eCMI",
+
+	/* invalid output (too large) */
+	"$argon2i$m=120,t=5000,p=2$4fXXG0spB92WPB1NitT8/OH0VKI$iHSDPHzUhPzK7rCcJgOFfg$KtTPhiUlDb98psIiNxUSZ8GYVEm1CsfEaLJrppBe5poD2/sQOUu5mmowSiQUbH+ZK3PjFdY3KUuf83bT5XqTZy0",
+
+	NULL
+};
+
+/*
+ * Cost ceiling: strings above each limit are rejected with their own
+ * error code, before the salt and output are decoded (the last two
+ * strings have a salt that is too short, which is reported only when
+ * within the ceiling), and strings within the ceiling decode as without
+ * it.
+ */
+static void
+test_cost_limits(void)
+{
+	static const struct {
+		const char *str;
+		int err;
+	} kat[] = {
+		{ "$argon2i$m=4294967295,t=1,p=1$4fXXG0spB92WPB1NitT8/OH0VKI",
+			ARGON2I_ERR_COST },
+		{ "$argon2i$m=1024,t=4294967295,p=1", ARGON2I_ERR_COST },
+		{ "$argon2i$m=65536,t=4,p=1", ARGON2I_ERR_COST },
+		{ "$argon2i$m=65536,t=3,p=1", ARGON2I_OK },
+		{ "$argon2i$m=1024,t=3,p=8", ARGON2I_ERR_COST },
+		{ "$argon2i$m=1024,t=3,p=4", ARGON2I_OK },
+		{ "$argon2i$m=1024,t=11,p=1$+yPbRi6hdw", ARGON2I_ERR_COST },
+		{ "$argon2i$m=1024,t=10,p=1$+yPbRi6hdw", ARGON2I_ERR_LENGTH }
+	};
+	argon2i_cost_limits lim, none;
+	argon2i_params pp;
+	const char **s;
+	size_t u;
+
+	lim.max_m = 65536;
+	lim.max_t = 10;
+	lim.max_mt = 200000;
+	lim.max_p = 4;
+	for (u = 0; u < sizeof kat / sizeof kat[0]; u ++) {
+		int err;
+
+		err = argon2i_decode_string_limits(&pp,
+			kat[u].str, strlen(kat[u].str), &lim);
+		if (err != kat[u].err) {
+			fprintf(stderr, "Cost ceiling: got \"%s\" for %s\n",
+				argon2i_error_name(err), kat[u].str);
+			exit(EXIT_FAILURE);
+		}
+	}
+	memset(&none, 0, sizeof none);
+	for (s = KAT_GOOD; *s; s ++) {
+		if (argon2i_decode_string_limits(&pp, *s, strlen(*s), &none)
+			!= ARGON2I_OK
+			|| argon2i_decode_string_limits(&pp, *s, strlen(*s),
+			NULL) != ARGON2I_OK)
+		{
+			fprintf(stderr, "Cost ceiling: failed to decode %s\n",
+				*s);
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+/*
+ * Encode all KAT_GOOD strings into an arena, both contiguously and
+ * with scatter/gather segments, and check the concatenated result.
+ */
+static void
+test_arena(void)
+{
+	phc_arena a, ag;
+	phc_segment seg[3];
+	char *ref, *gathered;
+	size_t ref_len, gathered_len, u, num;
+	const char **s;
+
+	ref_len = 0;
+	for (s = KAT_GOOD; *s; s ++) {
+		ref_len += strlen(*s) + 1;
+	}
+	ref = malloc(ref_len);
+	gathered = malloc(ref_len);
+	if (ref == NULL || gathered == NULL) {
+		fprintf(stderr, "malloc() failed\n");
+		exit(EXIT_FAILURE);
+	}
+	ref_len = 0;
+	gathered_len = 0;
+	phc_arena_init(&a);
+	phc_arena_init(&ag);
+	for (s = KAT_GOOD; *s; s ++) {
+		argon2i_params pp;
+		argon2i_encoder enc;
+		size_t len;
+
+		len = strlen(*s);
+		memcpy(ref + ref_len, *s, len);
+		ref_len += len;
+		ref[ref_len ++] = '\n';
+		if (!argon2i_decode_string(&pp, *s)
+			|| !argon2i_encoder_init(&enc, &pp)
+			|| !argon2i_encoder_append(&enc, &a, pp.salt,
+			pp.salt_len, pp.output, pp.output_len)
+			|| !phc_arena_append(&a, "\n", 1))
+		{
+			fprintf(stderr, "Arena append failure: %s\n", *s);
+			exit(EXIT_FAILURE);
+		}
+		num = argon2i_encoder_gather(&enc, &ag, seg, pp.salt,
+			pp.salt_len, pp.output, pp.output_len);
+		if (num == 0) {
+			fprintf(stderr, "Arena gather failure: %s\n", *s);
+			exit(EXIT_FAILURE);
+		}
+		for (u = 0; u < num; u ++) {
+			memcpy(gathered + gathered_len, seg[u].base, seg[u].len);
+			gathered_len += seg[u].len;
+		}
+		gathered[gathered_len ++] = '\n';
+	}
+	if (a.len != ref_len || memcmp(a.buf, ref, ref_len) != 0
+		|| gathered_len != ref_len
+		|| memcmp(gathered, ref, ref_len) != 0)
+	{
+		fprintf(stderr, "Arena output mismatch\n");
+		exit(EXIT_FAILURE);
+	}
+	phc_arena_free(&a);
+	phc_arena_free(&ag);
+	free(ref);
+	free(gathered);
+}
+
+/*
+ * Decode each KAT_GOOD string, pack it, unpack it, and check that the
+ * encoding is unchanged.
+ */
+static void
+test_packed(void)
+{
+	const char **s;
+
+	for (s = KAT_GOOD; *s; s ++) {
+		argon2i_params pp;
+		argon2i_packed pk;
+		char tmp[300];
+
+		memset(&pp, 0, sizeof pp);
+		if (!argon2i_decode_string(&pp, *s) || !argon2i_pack(&pk, &pp)) {
+			fprintf(stderr, "Pack failure: %s\n", *s);
+			exit(EXIT_FAILURE);
+		}
+		memset(&pp, 0, sizeof pp);
+		argon2i_unpack(&pp, &pk);
+		if (!argon2i_encode_string(tmp, sizeof tmp, &pp)
+			|| strcmp(tmp, *s) != 0)
+		{
+			fprintf(stderr, "Unpack failure: %s\n", *s);
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+/*
+ * Convert each KAT_GOOD string to a blob and back, and check that
+ * truncated or extended blobs are rejected.
+ */
+static void
+test_blob(void)
+{
+	const char **s;
+
+	for (s = KAT_GOOD; *s; s ++) {
+		argon2i_params pp;
+		unsigned char blob[ARGON2I_BLOB_MAX_LEN + 1];
+		char tmp[300];
+		size_t len;
+
+		if (!argon2i_decode_string(&pp, *s)) {
+			fprintf(stderr, "Failed to decode: %s\n", *s);
+			exit(EXIT_FAILURE);
+		}
+		len = argon2i_blob_encode(blob, sizeof blob, &pp);
+		if (len == 0 || argon2i_blob_encode(blob, len - 1, &pp) != 0) {
+			fprintf(stderr, "Blob encode failure: %s\n", *s);
+			exit(EXIT_FAILURE);
+		}
+		memset(&pp, 0, sizeof pp);
+		if (!argon2i_blob_decode(&pp, blob, len)
+			|| !argon2i_encode_string(tmp, sizeof tmp, &pp)
+			|| strcmp(tmp, *s) != 0)
+		{
+			fprintf(stderr, "Blob round-trip failure: %s\n", *s);
+			exit(EXIT_FAILURE);
+		}
+		if (argon2i_blob_decode(&pp, blob, len - 1)
+			|| argon2i_blob_decode(&pp, blob, len + 1))
+		{
+			fprintf(stderr, "Blob length not checked: %s\n", *s);
+			exit(EXIT_FAILURE);
+		}
+		blob[10] = 0;
+		if (argon2i_blob_decode(&pp, blob, len)) {
+			fprintf(stderr, "Blob with p=0 accepted: %s\n", *s);
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+/*
+ * Decode KAT_GOOD and KAT_BAD strings as a single batch into columns,
+ * and compare with individual decoding.
+ */
+static void
+test_columns(void)
+{
+	const char *strs[100];
+	uint8_t valid[100], p[100], len[4][100];
+	uint32_t m[100], t[100];
+	size_t off[4][100];
+	unsigned char bytes[4][100 * 64];
+	argon2i_columns cols;
+	argon2i_bin_column *bc[4];
+	size_t n, u, num, expected;
+	const char **s;
+	int i;
+
+	n = 0;
+	for (s = KAT_GOOD; *s; s ++) {
+		strs[n ++] = *s;
+	}
+	for (s = KAT_BAD; *s; s ++) {
+		strs[n ++] = *s;
+	}
+	cols.valid = valid;
+	cols.m = m;
+	cols.t = t;
+	cols.p = p;
+	bc[0] = &cols.key_id;
+	bc[1] = &cols.associated_data;
+	bc[2] = &cols.salt;
+	bc[3] = &cols.output;
+	for (i = 0; i < 4; i ++) {
+		bc[i]->len = len[i];
+		bc[i]->off = off[i];
+		bc[i]->bytes = bytes[i];
+		bc[i]->fill = 0;
+	}
+
+	/*
+	 * Rows are decoded in two calls, to exercise the 'row' offset.
+	 */
+	num = argon2i_decode_columns(&cols, 0, strs, 7);
+	num += argon2i_decode_columns(&cols, 7, strs + 7, n - 7);
+	expected = 0;
+	for (u = 0; u < n; u ++) {
+		argon2i_params pp;
+		int ok;
+
+		ok = argon2i_decode_string(&pp, strs[u]);
+		expected += ok;
+		if (valid[u] != ok) {
+			fprintf(stderr, "Column status mismatch: %s\n", strs[u]);
+			exit(EXIT_FAILURE);
+		}
+		if (!ok) {
+			continue;
+		}
+		if (m[u] != pp.m || t[u] != pp.t || p[u] != pp.p
+			|| len[0][u] != pp.key_id_len
+			|| memcmp(bytes[0] + off[0][u], pp.key_id,
+				pp.key_id_len) != 0
+			|| len[1][u] != pp.associated_data_len
+			|| memcmp(bytes[1] + off[1][u], pp.associated_data,
+				pp.associated_data_len) != 0
+			|| len[2][u] != pp.salt_len
+			|| memcmp(bytes[2] + off[2][u], pp.salt,
+				pp.salt_len) != 0
+			|| len[3][u] != pp.output_len
+			|| memcmp(bytes[3] + off[3][u], pp.output,
+				pp.output_len) != 0)
+		{
+			fprintf(stderr, "Column value mismatch: %s\n", strs[u]);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (num != expected) {
+		fprintf(stderr, "Column count mismatch\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ * Decode KAT_GOOD and KAT_BAD strings with the explicit-length batch
+ * decoder, from a single newline-separated buffer.
+ */
+static void
+test_batch(void)
+{
+	const char *strs[100];
+	size_t lens[100];
+	argon2i_packed out[100];
+	unsigned char status[13];
+	char buf[10000], tmp[300];
+	size_t n, u, off, num, expected;
+	const char **s;
+	argon2i_params pp;
+	int pass;
+
+	for (pass = 0; pass < 2; pass ++) {
+		n = 0;
+		off = 0;
+		for (s = pass == 0 ? KAT_GOOD : KAT_BAD; *s; s ++) {
+			lens[n] = strlen(*s);
+			memcpy(buf + off, *s, lens[n]);
+			strs[n ++] = buf + off;
+			off += lens[n - 1];
+			buf[off ++] = '\n';
+		}
+		memset(status, 0xFF, sizeof status);
+		num = argon2_decode_batch(strs, lens, n, out, status);
+		expected = 0;
+		for (u = 0; u < n; u ++) {
+			int ok;
+
+			ok = (status[u >> 3] >> (u & 7)) & 1;
+			expected += ok;
+			if (ok != (pass == 0)) {
+				fprintf(stderr, "Batch status mismatch: %.*s\n",
+					(int)lens[u], strs[u]);
+				exit(EXIT_FAILURE);
+			}
+			if (!ok) {
+				continue;
+			}
+			argon2i_unpack(&pp, &out[u]);
+			if (!argon2i_encode_string(tmp, sizeof tmp, &pp)
+				|| strlen(tmp) != lens[u]
+				|| memcmp(tmp, strs[u], lens[u]) != 0)
+			{
+				fprintf(stderr, "Batch decode mismatch: %.*s\n",
+					(int)lens[u], strs[u]);
+				exit(EXIT_FAILURE);
+			}
+		}
+		if (num != expected) {
+			fprintf(stderr, "Batch count mismatch\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	/*
+	 * A truncated length selects a prefix of a valid string, which
+	 * may itself be valid (parameter-only string) or not.
+	 */
+	if (!argon2i_decode_string_len(&pp, KAT_GOOD[14], 25)
+		|| argon2i_decode_string_len(&pp, KAT_GOOD[14], 26)
+		|| argon2i_decode_string_len(&pp, "$argon2i$m=120,t=5000,p=2\0",
+			26))
+	{
+		fprintf(stderr, "Explicit-length decoding failure\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ * Build a dump from many copies of the KAT strings, decode it with
+ * several threads, and compare with a sequential loop.
+ */
+static void
+test_bulk(void)
+{
+	const char *kat[100];
+	size_t kat_num, n, u, len, buf_len;
+	char *buf;
+	argon2i_columns cols;
+	argon2i_bulk_stats st;
+	argon2i_bulk_stats ref;
+	uint8_t *valid, *salt_len;
+	uint32_t *m;
+	size_t *salt_off;
+	unsigned char *salt;
+	const char **s;
+	unsigned threads;
+
+	kat_num = 0;
+	for (s = KAT_GOOD; *s; s ++) {
+		kat[kat_num ++] = *s;
+	}
+	for (s = KAT_BAD; *s; s ++) {
+		kat[kat_num ++] = *s;
+	}
+	n = 5003;
+	buf = malloc(n * 128);
+	valid = malloc(n);
+	m = malloc(n * sizeof *m);
+	salt_len = malloc(n);
+	salt_off = malloc(n * sizeof *salt_off);
+	salt = malloc(n * 48);
+	if (buf == NULL || valid == NULL || m == NULL || salt_len == NULL
+		|| salt_off == NULL || salt == NULL)
+	{
+		fprintf(stderr, "malloc() failed\n");
+		exit(EXIT_FAILURE);
+	}
+	memset(&ref, 0, sizeof ref);
+	buf_len = 0;
+	for (u = 0; u < n; u ++) {
+		argon2i_params pp;
+		const char *str;
+
+		str = kat[(u * 7) % kat_num];
+		len = strlen(str);
+		memcpy(buf + buf_len, str, len);
+		buf_len += len;
+		if (u + 1 < n) {
+			buf[buf_len ++] = '\n';
+		}
+		ref.status[argon2i_decode_string_err(&pp, str, len)] ++;
+		ref.rows ++;
+	}
+	if (phc_count_lines(buf, buf_len) != n) {
+		fprintf(stderr, "Line count mismatch\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (threads = 1; threads <= 4; threads ++) {
+		memset(&cols, 0, sizeof cols);
+		cols.valid = valid;
+		cols.m = m;
+		cols.salt.len = salt_len;
+		cols.salt.off = salt_off;
+		cols.salt.bytes = salt;
+		if (!argon2i_decode_bulk(buf, buf_len, threads, &cols, &st)) {
+			fprintf(stderr, "Bulk decode failure\n");
+			exit(EXIT_FAILURE);
+		}
+		if (memcmp(&st, &ref, sizeof st) != 0) {
+			fprintf(stderr, "Bulk stats mismatch (%u threads)\n",
+				threads);
+			exit(EXIT_FAILURE);
+		}
+		for (u = 0; u < n; u ++) {
+			argon2i_params pp;
+			int ok;
+
+			ok = argon2i_decode_string(&pp, kat[(u * 7) % kat_num]);
+			if (valid[u] != ok || (ok && (m[u] != pp.m
+				|| salt_len[u] != pp.salt_len
+				|| memcmp(salt + salt_off[u], pp.salt,
+					pp.salt_len) != 0)))
+			{
+				fprintf(stderr, "Bulk row mismatch (%u threads,"
+					" row %lu)\n", threads,
+					(unsigned long)u);
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+
+	/*
+	 * Without columns, and with a trailing newline (which does not
+	 * add a row).
+	 */
+	buf[buf_len ++] = '\n';
+	if (!argon2i_decode_bulk(buf, buf_len, 3, NULL, &st)
+		|| memcmp(&st, &ref, sizeof st) != 0)
+	{
+		fprintf(stderr, "Bulk stats mismatch (no columns)\n");
+		exit(EXIT_FAILURE);
+	}
+
+	free(buf);
+	free(valid);
+	free(m);
+	free(salt_len);
+	free(salt_off);
+	free(salt);
+}
+
+/*
+ * Compare two scan results (algorithms and parameter tuples may be
+ * stored in different orders).
+ */
+static int
+scan_equal(const phc_scan_result *a, const phc_scan_result *b)
+{
+	size_t u, v;
+
+	if (memcmp(&a->st, &b->st, sizeof a->st) != 0
+		|| memcmp(a->num_samples, b->num_samples,
+			sizeof a->num_samples) != 0
+		|| memcmp(a->samples, b->samples, sizeof a->samples) != 0
+		|| a->num_algs != b->num_algs
+		|| a->params.num != b->params.num)
+	{
+		return 0;
+	}
+	for (u = 0; u < a->num_algs; u ++) {
+		for (v = 0; v < b->num_algs; v ++) {
+			if (strcmp(a->algs[u].name, b->algs[v].name) == 0) {
+				break;
+			}
+		}
+		if (v == b->num_algs || a->algs[u].count != b->algs[v].count) {
+			return 0;
+		}
+	}
+	for (u = 0; u < a->params.cap; u ++) {
+		const param_tuple *ta;
+
+		ta = &a->params.slots[u];
+		if (ta->count == 0) {
+			continue;
+		}
+		for (v = 0; v < b->params.cap; v ++) {
+			const param_tuple *tb;
+
+			tb = &b->params.slots[v];
+			if (tb->count == ta->count && param_tuple_eq(ta, tb)) {
+				break;
+			}
+		}
+		if (v == b->params.cap) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Scan a dump with KAT strings and a few foreign lines, and check the
+ * summary.
+ */
+static void
+test_scan(void)
+{
+	static const char *const extra[] = {
+		"$argon2id$v=19$m=65536,t=2,p=1$gZiV/M1gPc22ElAH/Jh1Hw"
+			"$CWOrkoo7oJBQ/iyh7uJ0LO2aLEfrHwTWllSAxT0zRno",
+		"$2b$10$abcdefghijklmnopqrstuu",
+		"plain text",
+		"",
+		NULL
+	};
+	char *buf;
+	size_t n, u, len, buf_len, good, bad;
+	phc_scan_result r;
+	const char *line;
+	unsigned threads;
+	int e;
+	FILE *fp;
+	size_t block_size;
+	static const char *const tmp_name = "phc-sf-parse-test.tmp";
+
+	buf = malloc(900 * 160);
+	if (buf == NULL) {
+		fprintf(stderr, "malloc() failed\n");
+		exit(EXIT_FAILURE);
+	}
+	buf_len = 0;
+	good = 0;
+	bad = 0;
+	for (n = 0; n < 900; n ++) {
+		u = n % 45;
+		if (u < 20) {
+			line = KAT_GOOD[u];
+			good ++;
+		} else if (u < 41) {
+			line = KAT_BAD[u - 20];
+			bad ++;
+		} else {
+			line = extra[u - 41];
+			bad ++;
+		}
+		len = strlen(line);
+		memcpy(buf + buf_len, line, len);
+		buf_len += len;
+		buf[buf_len ++] = '\n';
+	}
+
+	for (threads = 1; threads <= 3; threads += 2) {
+		size_t num;
+
+		if (!phc_scan(buf, buf_len, threads, &r)) {
+			fprintf(stderr, "Scan failure\n");
+			exit(EXIT_FAILURE);
+		}
+		if (r.st.rows != 900 || r.st.status[ARGON2I_OK] != good
+			|| r.st.rows - r.st.status[ARGON2I_OK] != bad)
+		{
+			fprintf(stderr, "Scan count mismatch\n");
+			exit(EXIT_FAILURE);
+		}
+		for (u = 0; u < r.num_algs; u ++) {
+			num = 0;
+			if (strcmp(r.algs[u].name, "argon2i") == 0) {
+				num = 800;
+			} else if (strcmp(r.algs[u].name, "argon2j") == 0
+				|| strcmp(r.algs[u].name, "argon2id v=19") == 0
+				|| strcmp(r.algs[u].name, "2b") == 0)
+			{
+				num = 20;
+			} else if (strcmp(r.algs[u].name, "(other)") == 0) {
+				num = 40;
+			}
+			if (r.algs[u].count != num) {
+				fprintf(stderr, "Scan algorithm mismatch: %s\n",
+					r.algs[u].name);
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		/*
+		 * KAT_GOOD strings use three distinct (m,t,p) tuples. The
+		 * first "name" error is the "$argon2j" string, on line 21.
+		 */
+		if (r.params.num != 3 || r.num_samples[ARGON2I_ERR_NAME]
+			!= SCAN_SAMPLES
+			|| r.samples[ARGON2I_ERR_NAME][0] != 21)
+		{
+			fprintf(stderr, "Scan summary mismatch\n");
+			exit(EXIT_FAILURE);
+		}
+		for (e = 0; e < ARGON2I_ERR_NUM; e ++) {
+			for (u = 1; u < r.num_samples[e]; u ++) {
+				if (r.samples[e][u - 1] >= r.samples[e][u]) {
+					fprintf(stderr, "Scan samples unsorted\n");
+					exit(EXIT_FAILURE);
+				}
+			}
+		}
+		phc_scan_free(&r);
+	}
+
+	/*
+	 * Streaming scan of the same data from a file, with a block size
+	 * that is smaller than some lines, and with a larger one.
+	 */
+	fp = fopen(tmp_name, "wb");
+	if (fp == NULL || fwrite(buf, 1, buf_len, fp) != buf_len
+		|| fclose(fp) != 0)
+	{
+		fprintf(stderr, "Cannot write temporary file\n");
+		exit(EXIT_FAILURE);
+	}
+	if (!phc_scan(buf, buf_len, 2, &r)) {
+		fprintf(stderr, "Scan failure\n");
+		exit(EXIT_FAILURE);
+	}
+	for (block_size = 50; block_size <= 5000; block_size *= 10) {
+		phc_scan_result rs;
+
+		if (!phc_scan_stream(tmp_name, block_size, 2, &rs)) {
+			fprintf(stderr, "Stream scan failure\n");
+			exit(EXIT_FAILURE);
+		}
+		if (!scan_equal(&r, &rs)) {
+			fprintf(stderr, "Stream scan mismatch (block size %lu)\n",
+				(unsigned long)block_size);
+			exit(EXIT_FAILURE);
+		}
+		phc_scan_free(&rs);
+	}
+	phc_scan_free(&r);
+	remove(tmp_name);
+	free(buf);
+}
+
+/*
+ * Build the parameter histogram of a dump with KAT strings and a few
+ * strings for other Argon2 variants, and check it against individual
+ * decoding.
+ */
+static void
+test_param_stats(void)
+{
+	static const char *const extra[] = {
+		"$argon2id$v=19$m=65536,t=2,p=1$gZiV/M1gPc22ElAH/Jh1Hw"
+			"$CWOrkoo7oJBQ/iyh7uJ0LO2aLEfrHwTWllSAxT0zRno",
+		"$argon2d$v=16$m=4096,t=3,p=1$gZiV/M1gPc22ElAH/Jh1Hw",
+		"$argon2id$v=19$m=65536,t=2,p=1$gZiV/M1gPc22ElAH",
+		NULL
+	};
+	char *buf, line[200];
+	size_t n, u, len, buf_len, tup, total, found, bad;
+	phc_param_stats ps;
+	const char *str;
+	FILE *fp;
+	int csv_lines;
+
+	buf = malloc(600 * 160);
+	if (buf == NULL) {
+		fprintf(stderr, "malloc() failed\n");
+		exit(EXIT_FAILURE);
+	}
+	buf_len = 0;
+	bad = 0;
+	for (n = 0; n < 600; n ++) {
+		u = n % 44;
+		if (u < 20) {
+			str = KAT_GOOD[u];
+		} else if (u < 41) {
+			str = KAT_BAD[u - 20];
+			bad ++;
+		} else {
+			str = extra[u - 41];
+		}
+		len = strlen(str);
+		memcpy(buf + buf_len, str, len);
+		buf_len += len;
+		buf[buf_len ++] = '\n';
+	}
+	if (!phc_param_stats_build(buf, buf_len, 3, &ps)) {
+		fprintf(stderr, "Parameter stats failure\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/*
+	 * Each argon2i tuple must be counted as many times as argon2i
+	 * strings with these values decode correctly.
+	 */
+	total = 0;
+	for (tup = 0; tup < ps.tuples.cap; tup ++) {
+		const param_tuple *pt;
+
+		pt = &ps.tuples.slots[tup];
+		if (pt->count == 0) {
+			continue;
+		}
+		total += pt->count;
+		if (pt->variant != 1) {
+			continue;
+		}
+		found = 0;
+		for (n = 0; n < 600; n ++) {
+			argon2i_params pp;
+
+			u = n % 44;
+			if (u >= 41 || !argon2i_decode_string(&pp,
+				u < 20 ? KAT_GOOD[u] : KAT_BAD[u - 20]))
+			{
+				continue;
+			}
+			found += pp.m == pt->m && pp.t == pt->t
+				&& pp.p == pt->p && pp.salt_len == pt->salt_len
+				&& pp.output_len == pt->output_len
+				&& pt->version == 0;
+		}
+		if (found != pt->count) {
+			fprintf(stderr, "Parameter stats count mismatch\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	/*
+	 * All KAT_BAD strings are rejected; KAT_GOOD strings yield 9
+	 * distinct tuples, and the extra strings 3 more.
+	 */
+	if (ps.rows != 600 || ps.rejected != bad
+		|| total != ps.rows - ps.rejected || ps.tuples.num != 12)
+	{
+		fprintf(stderr, "Parameter stats totals mismatch (%lu, %lu)\n",
+			(unsigned long)total, (unsigned long)ps.tuples.num);
+		exit(EXIT_FAILURE);
+	}
+
+	fp = tmpfile();
+	if (fp == NULL || !phc_param_stats_write(fp, &ps, 0)) {
+		fprintf(stderr, "Parameter stats CSV failure\n");
+		exit(EXIT_FAILURE);
+	}
+	rewind(fp);
+	csv_lines = 0;
+	while (fgets(line, sizeof line, fp) != NULL) {
+		csv_lines ++;
+	}
+	fclose(fp);
+	if (csv_lines != 13) {
+		fprintf(stderr, "Parameter stats CSV line count mismatch\n");
+		exit(EXIT_FAILURE);
+	}
+	fp = tmpfile();
+	if (fp == NULL || !phc_param_stats_write(fp, &ps, 1)) {
+		fprintf(stderr, "Parameter stats JSON failure\n");
+		exit(EXIT_FAILURE);
+	}
+	rewind(fp);
+	if (fgets(line, sizeof line, fp) == NULL
+		|| strncmp(line, "{\"rows\":600,", 12) != 0)
+	{
+		fprintf(stderr, "Parameter stats JSON mismatch\n");
+		exit(EXIT_FAILURE);
+	}
+	fclose(fp);
+	phc_param_stats_free(&ps);
+	free(buf);
+}
+
+/*
+ * Build a columnar store from KAT_GOOD strings, and check that each row
+ * converts back to the original string.
+ */
+static void
+test_store(void)
+{
+	const char *strs[100];
+	size_t lens[100];
+	size_t n, u, bad;
+	phc_arena a;
+	phc_store st;
+	argon2i_params pp;
+	const char **s;
+	char tmp[300];
+
+	n = 0;
+	for (s = KAT_GOOD; *s; s ++) {
+		strs[n] = *s;
+		lens[n] = strlen(*s);
+		n ++;
+	}
+	phc_arena_init(&a);
+	if (!phc_store_build(&a, strs, lens, n, NULL)
+		|| !phc_store_open(&st, a.buf, a.len) || st.num_rows != n)
+	{
+		fprintf(stderr, "Store build failure\n");
+		exit(EXIT_FAILURE);
+	}
+	for (u = 0; u < n; u ++) {
+		if (!phc_store_get(&st, u, &pp)
+			|| !argon2i_encode_string(tmp, sizeof tmp, &pp)
+			|| strcmp(tmp, strs[u]) != 0)
+		{
+			fprintf(stderr, "Store round-trip failure: %s\n",
+				strs[u]);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (phc_store_get(&st, n, &pp)
+		|| phc_store_open(&st, a.buf, a.len / 2))
+	{
+		fprintf(stderr, "Store accepted invalid access\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/*
+	 * An invalid string is rejected, with its index.
+	 */
+	strs[3] = KAT_BAD[0];
+	lens[3] = strlen(KAT_BAD[0]);
+	bad = 0;
+	if (phc_store_build(&a, strs, lens, n, &bad) || bad != 3) {
+		fprintf(stderr, "Store accepted invalid string\n");
+		exit(EXIT_FAILURE);
+	}
+	phc_arena_free(&a);
+}
+
+/*
+ * Salt checker: unique 16-byte salts, with some rows reusing the salt of
+ * the previous row, and some with short salts or no salt.
+ */
+static void
+test_salt_check(void)
+{
+	char *buf;
+	size_t n, u, buf_len, exp_dup, exp_short, exp_none;
+	size_t exp_dup_samples[SCAN_SAMPLES], exp_short_samples[SCAN_SAMPLES];
+	phc_salt_report r;
+	unsigned threads;
+
+	n = 20000;
+	buf = malloc(n * 128);
+	if (buf == NULL) {
+		fprintf(stderr, "malloc() failed\n");
+		exit(EXIT_FAILURE);
+	}
+	buf_len = 0;
+	exp_dup = 0;
+	exp_short = 0;
+	exp_none = 0;
+	for (u = 0; u < n; u ++) {
+		argon2i_params pp;
+		size_t salt_id;
+
+		memset(&pp, 0, sizeof pp);
+		pp.m = 4096;
+		pp.t = 3;
+		pp.p = 1;
+		pp.salt_len = 16;
+		pp.output_len = 32;
+		salt_id = u;
+		if (u % 97 == 50) {
+			/* Reuses the salt of the previous row. */
+			salt_id = u - 1;
+			if (exp_dup < SCAN_SAMPLES) {
+				exp_dup_samples[exp_dup] = u + 1;
+			}
+			exp_dup ++;
+		} else if (u % 97 == 20 && (u / 97) % 10 == 0) {
+			pp.salt_len = 8;
+			if (exp_short < SCAN_SAMPLES) {
+				exp_short_samples[exp_short] = u + 1;
+			}
+			exp_short ++;
+		} else if (u % 97 == 30 && (u / 97) % 5 == 0) {
+			pp.salt_len = 0;
+			pp.output_len = 0;
+			exp_none ++;
+		}
+		enc64le(pp.salt, (uint64_t)salt_id * 0x9E3779B97F4A7C15);
+		enc64le(pp.salt + 8, (uint64_t)salt_id);
+		if (!argon2i_encode_string(buf + buf_len, 128, &pp)) {
+			fprintf(stderr, "Encode failure\n");
+			exit(EXIT_FAILURE);
+		}
+		buf_len += strlen(buf + buf_len);
+		buf[buf_len ++] = '\n';
+	}
+
+	for (threads = 1; threads <= 4; threads += 3) {
+		if (!phc_salt_check(buf, buf_len, threads, &r)) {
+			fprintf(stderr, "Salt check failure\n");
+			exit(EXIT_FAILURE);
+		}
+		if (r.rows != n || r.no_salt != exp_none
+			|| r.short_salts != exp_short
+			|| r.dup_rows != exp_dup || r.dup_salts != exp_dup
+			|| r.num_short_samples != SCAN_SAMPLES
+			|| memcmp(r.short_samples, exp_short_samples,
+				sizeof exp_short_samples) != 0
+			|| (threads == 1 && memcmp(r.dup_samples,
+				exp_dup_samples, sizeof exp_dup_samples) != 0))
+		{
+			fprintf(stderr, "Salt check mismatch (%u threads)\n",
+				threads);
+			exit(EXIT_FAILURE);
+		}
+	}
+	free(buf);
+}
+
+/*
+ * Export: compare the CSV and JSON-lines output with records formatted
+ * with fprintf().
+ */
+static void
+export_ref_hex(FILE *fp, const unsigned char *buf, size_t len)
+{
+	size_t u;
+
+	for (u = 0; u < len; u ++) {
+		fprintf(fp, "%02x", buf[u]);
+	}
+}
+
+static void
+test_export(void)
+{
+	unsigned char hex_in[20];
+	char hex_out[41], *buf, *exp, *got;
+	size_t n, u, buf_len, exp_len, got_len;
+	argon2i_bulk_stats st;
+	const char *str;
+	FILE *fp;
+	unsigned threads;
+	int json;
+
+	for (u = 0; u < sizeof hex_in; u ++) {
+		hex_in[u] = (unsigned char)(u * 0x1D + 0x07);
+	}
+	to_hex(hex_out, hex_in, sizeof hex_in);
+	hex_out[40] = 0;
+	if (strcmp(hex_out,
+		"0724415e7b98b5d2ef0c294663809dbad7f4112e") != 0)
+	{
+		fprintf(stderr, "Hex encoding mismatch: %s\n", hex_out);
+		exit(EXIT_FAILURE);
+	}
+
+	n = 2000;
+	buf = malloc(n * 160);
+	exp = malloc(n * 600);
+	got = malloc(n * 600);
+	if (buf == NULL || exp == NULL || got == NULL) {
+		fprintf(stderr, "malloc() failed\n");
+		exit(EXIT_FAILURE);
+	}
+	buf_len = 0;
+	for (u = 0; u < n; u ++) {
+		str = u % 41 < 20 ? KAT_GOOD[u % 41] : KAT_BAD[u % 41 - 20];
+		memcpy(buf + buf_len, str, strlen(str));
+		buf_len += strlen(str);
+		buf[buf_len ++] = '\n';
+	}
+	for (json = 0; json <= 1; json ++) {
+		fp = tmpfile();
+		if (fp == NULL) {
+			fprintf(stderr, "tmpfile() failed\n");
+			exit(EXIT_FAILURE);
+		}
+		if (!json) {
+			fprintf(fp, "line,m,t,p,keyid,data,salt,output\n");
+		}
+		for (u = 0; u < n; u ++) {
+			argon2i_params pp;
+
+			str = u % 41 < 20 ? KAT_GOOD[u % 41]
+				: KAT_BAD[u % 41 - 20];
+			if (!argon2i_decode_string(&pp, str)) {
+				continue;
+			}
+			fprintf(fp, json ? "{\"line\":%lu,\"m\":%lu,\"t\":%lu,"
+				"\"p\":%lu,\"keyid\":\"" : "%lu,%lu,%lu,%lu,",
+				(unsigned long)u + 1, pp.m, pp.t, pp.p);
+			export_ref_hex(fp, pp.key_id, pp.key_id_len);
+			fprintf(fp, json ? "\",\"data\":\"" : ",");
+			export_ref_hex(fp, pp.associated_data,
+				pp.associated_data_len);
+			fprintf(fp, json ? "\",\"salt\":\"" : ",");
+			export_ref_hex(fp, pp.salt, pp.salt_len);
+			fprintf(fp, json ? "\",\"output\":\"" : ",");
+			export_ref_hex(fp, pp.output, pp.output_len);
+			fprintf(fp, json ? "\"}\n" : "\n");
+		}
+		rewind(fp);
+		exp_len = fread(exp, 1, n * 600, fp);
+		fclose(fp);
+
+		for (threads = 1; threads <= 3; threads += 2) {
+			fp = tmpfile();
+			if (fp == NULL || !phc_export(fp, buf, buf_len,
+				threads, json, &st))
+			{
+				fprintf(stderr, "Export failure\n");
+				exit(EXIT_FAILURE);
+			}
+			rewind(fp);
+			got_len = fread(got, 1, n * 600, fp);
+			fclose(fp);
+			if (got_len != exp_len || memcmp(got, exp, exp_len) != 0
+				|| st.rows != n
+				|| st.status[ARGON2I_OK] != (n / 41) * 20 + 20)
+			{
+				fprintf(stderr, "Export mismatch (json=%d)\n",
+					json);
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+	free(buf);
+	free(exp);
+	free(got);
+}
+
+/*
+ * Append a "key:hash" line for user 'id' to a dump; 'kind' selects a
+ * modification (DIFF_PARAMS, DIFF_OUTPUT, or -1 for none).
+ */
+static void
+diff_test_line(char *buf, size_t *len, size_t id, int kind)
+{
+	argon2i_params pp;
+	size_t u;
+
+	memset(&pp, 0, sizeof pp);
+	pp.m = 4096 << (id % 3);
+	pp.t = 3;
+	pp.p = 1;
+	pp.salt_len = 16;
+	pp.output_len = 32;
+	for (u = 0; u < 16; u ++) {
+		pp.salt[u] = (unsigned char)(id >> (u & 7));
+	}
+	for (u = 0; u < 32; u ++) {
+		pp.output[u] = (unsigned char)(id * 31 + u);
+	}
+	if (kind == DIFF_PARAMS) {
+		pp.t ++;
+	} else if (kind == DIFF_OUTPUT) {
+		pp.output[5] ^= 1;
+	}
+	memcpy(buf + *len, "user", 4);
+	*len += 4;
+	*len += encode_decimal(buf + *len, 21, id);
+	buf[(*len) ++] = ':';
+	if (!argon2i_encode_string(buf + *len, 200, &pp)) {
+		fprintf(stderr, "Encode failure\n");
+		exit(EXIT_FAILURE);
+	}
+	*len += strlen(buf + *len);
+	buf[(*len) ++] = '\n';
+}
+
+/*
+ * Diff: the new dump lists users in reverse order, with some removed,
+ * added, or modified; both dumps also contain invalid lines and a
+ * duplicate key.
+ */
+static void
+test_diff(void)
+{
+	char *old_buf, *new_buf;
+	size_t n, u, old_len, new_len, line;
+	phc_diff_result r, exp;
+	unsigned threads;
+	int k;
+
+	n = 6000;
+	old_buf = malloc((n + 10) * 200);
+	new_buf = malloc((n + 510) * 200);
+	if (old_buf == NULL || new_buf == NULL) {
+		fprintf(stderr, "malloc() failed\n");
+		exit(EXIT_FAILURE);
+	}
+	memset(&exp, 0, sizeof exp);
+	old_len = 0;
+	for (u = 0; u < n; u ++) {
+		diff_test_line(old_buf, &old_len, u, -1);
+		if (u % 50 == 1) {
+			exp.count[DIFF_REMOVED] ++;
+			sample_insert(exp.samples[DIFF_REMOVED],
+				&exp.num_samples[DIFF_REMOVED], u + 1);
+		}
+	}
+	strcpy(old_buf + old_len, "no separator\nuser7:$argon2i$m=1\n");
+	old_len += strlen(old_buf + old_len);
+	diff_test_line(old_buf, &old_len, 3, -1);
+	new_len = 0;
+	line = 0;
+	for (u = n + 500; u -- > 0;) {
+		int kind;
+
+		if (u % 50 == 1 && u < n) {
+			continue;
+		}
+		line ++;
+		if (u >= n) {
+			kind = DIFF_ADDED;
+		} else if (u % 37 == 5) {
+			kind = DIFF_PARAMS;
+		} else if (u % 41 == 7) {
+			kind = DIFF_OUTPUT;
+		} else {
+			kind = -1;
+		}
+		diff_test_line(new_buf, &new_len, u, kind);
+		if (kind < 0) {
+			exp.unchanged ++;
+		} else {
+			exp.count[kind] ++;
+			sample_insert(exp.samples[kind],
+				&exp.num_samples[kind], line);
+		}
+	}
+	strcpy(new_buf + new_len, "user9:$argon2i$m=120,t=0,p=2\n");
+	new_len += strlen(new_buf + new_len);
+	exp.old_rows = n + 3;
+	exp.new_rows = line + 1;
+	exp.old_invalid = 2;
+	exp.new_invalid = 1;
+	exp.dup_keys = 1;
+
+	for (threads = 1; threads <= 4; threads += 3) {
+		if (!phc_diff(old_buf, old_len, new_buf, new_len, threads, &r)) {
+			fprintf(stderr, "Diff failure\n");
+			exit(EXIT_FAILURE);
+		}
+		if (r.old_rows != exp.old_rows || r.new_rows != exp.new_rows
+			|| r.old_invalid != exp.old_invalid
+			|| r.new_invalid != exp.new_invalid
+			|| r.dup_keys != exp.dup_keys
+			|| r.unchanged != exp.unchanged)
+		{
+			fprintf(stderr, "Diff totals mismatch\n");
+			exit(EXIT_FAILURE);
+		}
+		for (k = 0; k < DIFF_NUM; k ++) {
+			if (r.count[k] != exp.count[k]
+				|| r.num_samples[k] != exp.num_samples[k]
+				|| memcmp(r.samples[k], exp.samples[k],
+					exp.num_samples[k] * sizeof(size_t)) != 0)
+			{
+				fprintf(stderr, "Diff mismatch (kind %d)\n", k);
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+	free(old_buf);
+	free(new_buf);
+}
+
+/*
+ * Convert a hexadecimal string into bytes (test helper); returned value
+ * is the number of bytes.
+ */
+static size_t
+hextobin(unsigned char *dst, const char *src)
+{
+	size_t n;
+
+	for (n = 0; src[0] != 0 && src[1] != 0; n ++, src += 2) {
+		unsigned u;
+
+		sscanf(src, "%2x", &u);
+		dst[n] = (unsigned char)u;
+	}
+	return n;
+}
+
+/*
+ * Several threads computing hashes with the same pool.
+ */
+typedef struct {
+	phc_pool *pool;
+	argon2i_params pp;
+	int ok;
+} pool_test_ctx;
+
+static void *
+pool_test_run(void *arg)
+{
+	pool_test_ctx *pc;
+	int k;
+
+	pc = arg;
+	pc->ok = 1;
+	for (k = 0; k < 4; k ++) {
+		pc->ok &= argon2_hash_pool(pc->pool, &pc->pp, ARGON2_ID,
+			"password", 8, NULL, 0);
+	}
+	return NULL;
+}
+
+/*
+ * Several threads computing hashes in the same environment (e.g. under
+ * the same memory budget).
+ */
+typedef struct {
+	argon2_env *env;
+	int id;
+	int ok;
+} env_test_ctx;
+
+static void *
+env_test_run(void *arg)
+{
+	env_test_ctx *ec;
+	argon2i_params pp1, pp2;
+	int k;
+
+	ec = arg;
+	ec->ok = 1;
+	for (k = 0; k < 3; k ++) {
+		memset(&pp1, 0, sizeof pp1);
+		pp1.m = ((ec->id + k) & 1) != 0 ? 512 : 128;
+		pp1.t = 1;
+		pp1.p = 1;
+		memset(pp1.salt, ec->id + k, 16);
+		pp1.salt_len = 16;
+		pp2 = pp1;
+		ec->ok &= argon2_hash_env(ec->env, &pp1, ARGON2_ID,
+			"password", 8, NULL, 0);
+		ec->ok &= argon2_hash(&pp2, ARGON2_ID, "password", 8, NULL, 0);
+		ec->ok &= memcmp(pp1.output, pp2.output, 32) == 0;
+	}
+	return NULL;
+}
+
+/*
+ * Argon2 hash computation: test vectors from RFC 9106, section 5, and
+ * from the reference implementation (through a decoded hash string).
+ */
+static void
+test_argon2(void)
+{
+	static const struct {
+		int type;
+		const char *tag;
+	} rfc[] = {
+		{ ARGON2_D, "512b391b6f1162975371d30919734294"
+			"f868e3be3984f3c1a13a4db9fabe4acb" },
+		{ ARGON2_I, "c814d9d1dc7f37aa13f0d77f2494bda1"
+			"c8de6b016dd388d29952a4c4672b6ce8" },
+		{ ARGON2_ID, "0d640df58d78766c08c037a34a8b53c9"
+			"d01ef0452d75b65eb52520e96b01e659" }
+	};
+	static const char *const ref_str = "$argon2i$m=256,t=2,p=1"
+		"$c29tZXNhbHQ$iekCn0Y3spW+sCcFanM2xBT63UP2sghkUoHLIUpWRS8";
+	unsigned char pwd[32], secret[8], tag[32];
+	argon2i_params pp, ref;
+	size_t u;
+
+	memset(pwd, 0x01, sizeof pwd);
+	memset(secret, 0x03, sizeof secret);
+	for (u = 0; u < sizeof rfc / sizeof rfc[0]; u ++) {
+		memset(&pp, 0, sizeof pp);
+		pp.m = 32;
+		pp.t = 3;
+		pp.p = 4;
+		memset(pp.salt, 0x02, 16);
+		pp.salt_len = 16;
+		memset(pp.associated_data, 0x04, 12);
+		pp.associated_data_len = 12;
+		pp.output_len = 32;
+		hextobin(tag, rfc[u].tag);
+		if (!argon2_hash(&pp, rfc[u].type, pwd, sizeof pwd,
+			secret, sizeof secret)
+			|| pp.output_len != 32
+			|| memcmp(pp.output, tag, 32) != 0)
+		{
+			fprintf(stderr, "Argon2 test vector failure (%d)\n",
+				rfc[u].type);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	/*
+	 * All implementations of G must agree (on random blocks).
+	 */
+	{
+		argon2_block x, y, d1, d2;
+		uint64_t st;
+		int i, k;
+
+		st = 1;
+		for (k = 0; k < 20; k ++) {
+			for (i = 0; i < 128; i ++) {
+				st = st * 6364136223846793005 + 1442695040888963407;
+				x.v[i] = st;
+				st = st * 6364136223846793005 + 1442695040888963407;
+				y.v[i] = st;
+				d1.v[i] = d2.v[i] = st ^ (st >> 29);
+			}
+			argon2_compress(&d1, &x, &y, k & 1);
+			argon2_compress_select()(&d2, &x, &y, k & 1);
+			if (memcmp(&d1, &d2, sizeof d1) != 0) {
+				fprintf(stderr, "Argon2 G implementation"
+					" mismatch\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+
+	/*
+	 * Decode a hash string, recompute the output from the password,
+	 * and compare.
+	 */
+	if (!argon2i_decode_string(&ref, ref_str)) {
+		fprintf(stderr, "Failed to decode: %s\n", ref_str);
+		exit(EXIT_FAILURE);
+	}
+	pp = ref;
+	memset(pp.output, 0, sizeof pp.output);
+	if (!argon2_hash(&pp, ARGON2_I, "password", 8, NULL, 0)
+		|| memcmp(pp.output, ref.output, ref.output_len) != 0)
+	{
+		fprintf(stderr, "Argon2 hash string verification failure\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/*
+	 * Invalid parameters: too little memory for the number of lanes,
+	 * short salt.
+	 */
+	pp.m = 8 * pp.p - 1;
+	if (argon2_hash(&pp, ARGON2_I, "password", 8, NULL, 0)) {
+		fprintf(stderr, "Argon2 accepted invalid parameters\n");
+		exit(EXIT_FAILURE);
+	}
+	pp = ref;
+	pp.salt_len = 7;
+	if (argon2_hash(&pp, ARGON2_I, "password", 8, NULL, 0)) {
+		fprintf(stderr, "Argon2 accepted invalid parameters\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ * Batch computation (with various geometries, an invalid entry, and a
+ * last group that is not full) must give the same outputs as separate
+ * hashes. Outputs have different lengths for Argon2d, and the same
+ * length for Argon2i and Argon2id (they are then computed together).
+ */
+static void
+test_argon2_multi(void)
+{
+	static const uint32_t shape[][3] = {
+		{ 64, 1, 1 }, { 67, 1, 1 }, { 64, 1, 1 },
+		{ 128, 2, 2 }, { 128, 2, 2 },
+		{ 64, 1, 1 }, { 64, 1, 1 }, { 64, 1, 1 },
+		{ 64, 1, 1 }, { 64, 1, 1 },
+		{ 96, 2, 3 }
+	};
+	argon2i_params mp[11], pp2;
+	const void *mpwd[11];
+	size_t mlen[11];
+	char pwbuf[11][8];
+	int mok[11], types[3];
+	int i, k;
+
+	types[0] = ARGON2_D;
+	types[1] = ARGON2_I;
+	types[2] = ARGON2_ID;
+	for (k = 0; k < 3; k ++) {
+		for (i = 0; i < 11; i ++) {
+			memset(&mp[i], 0, sizeof mp[i]);
+			mp[i].m = shape[i][0];
+			mp[i].t = shape[i][1];
+			mp[i].p = shape[i][2];
+			memset(mp[i].salt, 0x30 + i, 16);
+			mp[i].salt_len = i == 6 ? 4 : 16;
+			mp[i].output_len = k == 0 ? 16 + i : 32;
+			sprintf(pwbuf[i], "pwd%d", i);
+			mpwd[i] = pwbuf[i];
+			mlen[i] = strlen(pwbuf[i]);
+		}
+		if (argon2_hash_multi(mp, mpwd, mlen, 11,
+			types[k], mok) != 10)
+		{
+			fprintf(stderr, "Argon2 batch failure\n");
+			exit(EXIT_FAILURE);
+		}
+		for (i = 0; i < 11; i ++) {
+			pp2 = mp[i];
+			if (mok[i] != (i != 6) || (mok[i]
+				&& (!argon2_hash(&pp2, types[k],
+				mpwd[i], mlen[i], NULL, 0)
+				|| pp2.output_len != mp[i].output_len
+				|| memcmp(pp2.output, mp[i].output,
+					pp2.output_len) != 0)))
+			{
+				fprintf(stderr, "Argon2 batch mismatch"
+					" (%d, %d)\n", types[k], i);
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+}
+
+/*
+ * Lanes computed with a thread pool (of various sizes, and shared by
+ * concurrent hashes) must give the same output.
+ */
+static void
+test_argon2_pool(void)
+{
+	phc_pool pool;
+	pool_test_ctx pc[3];
+	unsigned nt;
+	int i;
+
+	for (nt = 0; nt <= 3; nt ++) {
+		if (!phc_pool_init(&pool, nt)) {
+			fprintf(stderr, "Pool creation failure\n");
+			exit(EXIT_FAILURE);
+		}
+		for (i = 0; i < 3; i ++) {
+			memset(&pc[i].pp, 0, sizeof pc[i].pp);
+			pc[i].pool = &pool;
+			pc[i].pp.m = 256 + 64 * i;
+			pc[i].pp.t = 2;
+			pc[i].pp.p = 3 + i;
+			memset(pc[i].pp.salt, 0x40 + i, 16);
+			pc[i].pp.salt_len = 16;
+		}
+		run_workers(pool_test_run, pc, sizeof pc[0], 3);
+		for (i = 0; i < 3; i ++) {
+			argon2i_params pp2;
+
+			pp2 = pc[i].pp;
+			if (!pc[i].ok || !argon2_hash(&pp2, ARGON2_ID,
+				"password", 8, NULL, 0)
+				|| memcmp(pp2.output, pc[i].pp.output,
+					pp2.output_len) != 0)
+			{
+				fprintf(stderr, "Pool hash mismatch\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		phc_pool_free(&pool);
+	}
+}
+
+/*
+ * Matrices from a memory pool: reused when the size matches, zeroed
+ * when returned, and the cap is respected.
+ */
+static void
+test_mempool(void)
+{
+	phc_mempool mp;
+	phc_mempool_stats mst;
+	argon2_env env;
+	argon2i_params pp1, pp2;
+	const mempool_entry *e;
+	mempool_entry *me1, *me2;
+	size_t u2;
+	int i;
+
+	if (!phc_mempool_init(&mp, (size_t)600 << 10)) {
+		fprintf(stderr, "Memory pool creation failure\n");
+		exit(EXIT_FAILURE);
+	}
+	env.threads = NULL;
+	env.memory = &mp;
+	env.admission = NULL;
+	env.addresses = NULL;
+	env.prefetch = 0;
+	for (i = 0; i < 6; i ++) {
+		memset(&pp1, 0, sizeof pp1);
+		pp1.m = i < 3 ? 256 : 512;
+		pp1.t = 2;
+		pp1.p = 2;
+		memset(pp1.salt, 0x11 * i, 16);
+		pp1.salt_len = 16;
+		pp2 = pp1;
+		if (!argon2_hash_env(&env, &pp1, ARGON2_I,
+			"password", 8, NULL, 0)
+			|| !argon2_hash(&pp2, ARGON2_I,
+			"password", 8, NULL, 0)
+			|| memcmp(pp1.output, pp2.output, 32) != 0)
+		{
+			fprintf(stderr, "Memory pool hash mismatch\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	phc_mempool_get_stats(&mp, &mst);
+	if (mst.hits != 4 || mst.misses != 2
+		|| mst.resident != (size_t)512 << 10
+		|| mst.cached != mst.resident)
+	{
+		fprintf(stderr, "Memory pool statistics mismatch\n");
+		exit(EXIT_FAILURE);
+	}
+	for (e = mp.free_list; e != NULL; e = e->next) {
+		for (u2 = 0; u2 < e->len / sizeof(argon2_block); u2 ++) {
+			for (i = 0; i < 128; i ++) {
+				if (e->mem[u2].v[i] != 0) {
+					fprintf(stderr, "Memory pool"
+						" matrix not zeroed\n");
+					exit(EXIT_FAILURE);
+				}
+			}
+		}
+	}
+
+	/*
+	 * With a 256 KiB matrix in use, a 512 KiB matrix does not
+	 * fit under the 600 KiB cap, even after the cached one is
+	 * released.
+	 */
+	me1 = mempool_get(&mp, (size_t)256 << 10);
+	me2 = mempool_get(&mp, (size_t)512 << 10);
+	phc_mempool_get_stats(&mp, &mst);
+	if (me1 == NULL || me2 != NULL
+		|| mst.resident != (size_t)256 << 10 || mst.cached != 0)
+	{
+		fprintf(stderr, "Memory pool cap not enforced\n");
+		exit(EXIT_FAILURE);
+	}
+	mempool_put(&mp, me1);
+	phc_mempool_free(&mp);
+}
+
+/*
+ * Cached reference indices: same outputs, one entry per parameter tuple
+ * and type (none for Argon2d), eviction of the least recently used
+ * entry, and no entries larger than the cap.
+ */
+static void
+test_addr_cache(void)
+{
+	static const uint32_t shape[][3] = {
+		{ 64, 2, 1 }, { 96, 3, 3 }, { 64, 2, 1 }, { 256, 2, 1 }
+	};
+	static const int types[] = { ARGON2_D, ARGON2_I, ARGON2_ID };
+	phc_addr_cache cache;
+	phc_addr_cache_stats cst;
+	argon2_env env;
+	env_test_ctx tc[4];
+	argon2i_params pp1, pp2;
+	int i, k;
+
+	env.threads = NULL;
+	env.memory = NULL;
+	env.admission = NULL;
+	env.addresses = &cache;
+	env.prefetch = 0;
+	for (k = 0; k < 2; k ++) {
+		if (!phc_addr_cache_init(&cache, k == 0 ? 8192 : 1200)) {
+			fprintf(stderr, "Address cache creation"
+				" failure\n");
+			exit(EXIT_FAILURE);
+		}
+		for (i = 0; i < 12; i ++) {
+			memset(&pp1, 0, sizeof pp1);
+			pp1.m = shape[i & 3][0];
+			pp1.t = shape[i & 3][1];
+			pp1.p = shape[i & 3][2];
+			memset(pp1.salt, 0x20 + i, 16);
+			pp1.salt_len = 16;
+			pp2 = pp1;
+			if (!argon2_hash_env(&env, &pp1, types[i >> 2],
+				"password", 8, NULL, 0)
+				|| !argon2_hash(&pp2, types[i >> 2],
+				"password", 8, NULL, 0)
+				|| memcmp(pp1.output, pp2.output, 32) != 0)
+			{
+				fprintf(stderr, "Address cache hash"
+					" mismatch\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		/*
+		 * Argon2i indices take 512, 1152 and 2048 bytes,
+		 * Argon2id indices 128, 192 and 512 bytes. With a
+		 * cap of 1200 bytes, the 2048-byte entry is not
+		 * built (neither a hit nor a miss), the first
+		 * Argon2i entry is evicted before its second use,
+		 * and the last Argon2id entry evicts the remaining
+		 * Argon2i entry.
+		 */
+		phc_addr_cache_get_stats(&cache, &cst);
+		if ((k == 0 && (cst.hits != 2 || cst.misses != 6
+			|| cst.entries != 6 || cst.bytes != 4544))
+			|| (k == 1 && (cst.hits != 1 || cst.misses != 6
+			|| cst.entries != 3 || cst.bytes != 832)))
+		{
+			fprintf(stderr, "Address cache statistics"
+				" mismatch\n");
+			exit(EXIT_FAILURE);
+		}
+		phc_addr_cache_free(&cache);
+	}
+
+	/*
+	 * Concurrent hashes sharing the cache.
+	 */
+	phc_addr_cache_init(&cache, (size_t)1 << 20);
+	for (i = 0; i < 4; i ++) {
+		tc[i].env = &env;
+		tc[i].id = i;
+	}
+	run_workers(env_test_run, tc, sizeof tc[0], 4);
+	for (i = 0; i < 4; i ++) {
+		if (!tc[i].ok) {
+			fprintf(stderr, "Address cache hash"
+				" mismatch\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	phc_addr_cache_get_stats(&cache, &cst);
+	if (cst.hits + cst.misses != 12 || cst.entries != 2) {
+		fprintf(stderr, "Address cache statistics mismatch\n");
+		exit(EXIT_FAILURE);
+	}
+	phc_addr_cache_free(&cache);
+}
+
+/*
+ * Prefetch distances do not change outputs: none, the default, within
+ * one block of addresses, up to its end, and beyond the segment; with
+ * generated and with cached reference indices.
+ */
+static void
+test_prefetch(void)
+{
+	static const uint32_t dist[] = {
+		ARGON2_PREFETCH_NONE, 0, 1, 3, 127, 128, 1000
+	};
+	static const uint32_t shape[][3] = {
+		{ 64, 2, 1 }, { 1024, 2, 2 }, { 2048, 1, 1 }
+	};
+	static const int types[] = { ARGON2_D, ARGON2_I, ARGON2_ID };
+	phc_addr_cache cache;
+	argon2_env env;
+	argon2i_params pp1, pp2;
+	int i, j, k;
+
+	if (!phc_addr_cache_init(&cache, (size_t)1 << 20)) {
+		fprintf(stderr, "Address cache creation failure\n");
+		exit(EXIT_FAILURE);
+	}
+	env.threads = NULL;
+	env.memory = NULL;
+	env.admission = NULL;
+	for (i = 0; i < 9; i ++) {
+		memset(&pp1, 0, sizeof pp1);
+		pp1.m = shape[i / 3][0];
+		pp1.t = shape[i / 3][1];
+		pp1.p = shape[i / 3][2];
+		memset(pp1.salt, 0x40 + i, 16);
+		pp1.salt_len = 16;
+		pp2 = pp1;
+		if (!argon2_hash(&pp2, types[i % 3],
+			"password", 8, NULL, 0))
+		{
+			fprintf(stderr, "Prefetch hash failure\n");
+			exit(EXIT_FAILURE);
+		}
+		for (j = 0; j < (int)(sizeof dist / sizeof dist[0]);
+			j ++)
+		{
+			for (k = 0; k < 2; k ++) {
+				env.addresses = k ? &cache : NULL;
+				env.prefetch = dist[j];
+				memset(pp1.output, 0, sizeof pp1.output);
+				if (!argon2_hash_env(&env, &pp1,
+					types[i % 3],
+					"password", 8, NULL, 0)
+					|| memcmp(pp1.output,
+					pp2.output, 32) != 0)
+				{
+					fprintf(stderr, "Prefetch hash"
+						" mismatch\n");
+					exit(EXIT_FAILURE);
+				}
+			}
+		}
+	}
+	phc_addr_cache_free(&cache);
+}
+
+#if PHC_SF_THREADS
+/*
+ * A request that waits in an admission queue (see test_admission()).
+ */
+typedef struct {
+	phc_admission *ac;
+	size_t bytes;
+	int ok;
+} admission_waiter_ctx;
+
+static void *
+admission_waiter_run(void *arg)
+{
+	admission_waiter_ctx *wc;
+
+	wc = arg;
+	wc->ok = phc_admission_acquire(wc->ac, wc->bytes, 1);
+	if (wc->ok) {
+		phc_admission_release(wc->ac, wc->bytes);
+	}
+	return NULL;
+}
+
+/*
+ * Hold 6 units out of 10, queue a request for 8 units in another
+ * thread, and then ask (without waiting) for 3 units: this must be
+ * granted unless the queued request has aged. Returned value is the
+ * result of that last request.
+ */
+static int
+admission_bypass(double aging)
+{
+	phc_admission ac;
+	phc_admission_stats st;
+	admission_waiter_ctx wc;
+	pthread_t th;
+	int r;
+
+	if (!phc_admission_init(&ac, 10, 4, aging)
+		|| !phc_admission_acquire(&ac, 6, 0))
+	{
+		fprintf(stderr, "Admission setup failure\n");
+		exit(EXIT_FAILURE);
+	}
+	wc.ac = &ac;
+	wc.bytes = 8;
+	wc.ok = 0;
+	if (pthread_create(&th, NULL, admission_waiter_run, &wc) != 0) {
+		fprintf(stderr, "pthread_create() failed\n");
+		exit(EXIT_FAILURE);
+	}
+	do {
+		sched_yield();
+		phc_admission_get_stats(&ac, &st);
+	} while (st.queued == 0);
+	r = phc_admission_acquire(&ac, 3, 0);
+	if (r) {
+		phc_admission_release(&ac, 3);
+	}
+	phc_admission_release(&ac, 6);
+	pthread_join(th, NULL);
+	phc_admission_get_stats(&ac, &st);
+	if (!wc.ok || st.in_use != 0 || st.queued != 0
+		|| st.peak_queued != 1 || st.peak_in_use > 10)
+	{
+		fprintf(stderr, "Admission queue failure\n");
+		exit(EXIT_FAILURE);
+	}
+	phc_admission_free(&ac);
+	return r;
+}
+#endif
+
+/*
+ * Memory-budget admission: immediate grants and rejections, bypass of
+ * a large queued request by a small one (and its prevention by aging),
+ * and concurrent hashes sharing a budget.
+ */
+static void
+test_admission(void)
+{
+	phc_admission ac;
+	phc_admission_stats st;
+	argon2_env env;
+	env_test_ctx tc[4];
+	int i;
+
+	if (!phc_admission_init(&ac, 10, 4, 1.0)) {
+		fprintf(stderr, "Admission controller creation failure\n");
+		exit(EXIT_FAILURE);
+	}
+	if (!phc_admission_acquire(&ac, 6, 0)
+		|| phc_admission_acquire(&ac, 6, 0)
+		|| phc_admission_acquire(&ac, 11, 1)
+		|| !phc_admission_acquire(&ac, 4, 0))
+	{
+		fprintf(stderr, "Admission decision failure\n");
+		exit(EXIT_FAILURE);
+	}
+	phc_admission_release(&ac, 6);
+	phc_admission_release(&ac, 4);
+	phc_admission_get_stats(&ac, &st);
+	if (st.admitted != 2 || st.rejected != 2 || st.in_use != 0
+		|| st.peak_in_use != 10 || st.queued != 0)
+	{
+		fprintf(stderr, "Admission statistics mismatch\n");
+		exit(EXIT_FAILURE);
+	}
+	phc_admission_free(&ac);
+
+#if PHC_SF_THREADS
+	if (!admission_bypass(1000.0) || admission_bypass(0.0)) {
+		fprintf(stderr, "Admission fairness failure\n");
+		exit(EXIT_FAILURE);
+	}
+#endif
+
+	/*
+	 * Four threads, each computing hashes with 128 or 512 KiB, with
+	 * a budget of 640 KiB.
+	 */
+	if (!phc_admission_init(&ac, (size_t)640 << 10, 4, 0.05)) {
+		fprintf(stderr, "Admission controller creation failure\n");
+		exit(EXIT_FAILURE);
+	}
+	env.threads = NULL;
+	env.memory = NULL;
+	env.admission = &ac;
+	env.addresses = NULL;
+	env.prefetch = 0;
+	for (i = 0; i < 4; i ++) {
+		tc[i].env = &env;
+		tc[i].id = i;
+	}
+	run_workers(env_test_run, tc, sizeof tc[0], 4);
+	phc_admission_get_stats(&ac, &st);
+	for (i = 0; i < 4; i ++) {
+		if (!tc[i].ok) {
+			fprintf(stderr, "Admission hash mismatch\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (st.admitted != 12 || st.rejected != 0 || st.in_use != 0
+		|| st.peak_in_use > st.budget)
+	{
+		fprintf(stderr, "Admission statistics mismatch\n");
+		exit(EXIT_FAILURE);
+	}
+	phc_admission_free(&ac);
+}
+
+/*
+ * Several threads computing hashes in the same NUMA environment.
+ */
+typedef struct {
+	phc_numa_env *ne;
+	int id;
+	int ok;
+} numa_test_ctx;
+
+static void *
+numa_test_run(void *arg)
+{
+	numa_test_ctx *nc;
+	argon2i_params pp1, pp2;
+	int k;
+
+	nc = arg;
+	nc->ok = 1;
+	for (k = 0; k < 2; k ++) {
+		memset(&pp1, 0, sizeof pp1);
+		pp1.m = 256;
+		pp1.t = 1;
+		pp1.p = 2;
+		memset(pp1.salt, nc->id * 2 + k, 16);
+		pp1.salt_len = 16;
+		pp2 = pp1;
+		nc->ok &= argon2_hash_numa(nc->ne, &pp1, ARGON2_I,
+			"password", 8, NULL, 0);
+		nc->ok &= argon2_hash(&pp2, ARGON2_I, "password", 8, NULL, 0);
+		nc->ok &= memcmp(pp1.output, pp2.output, 32) == 0;
+	}
+	return NULL;
+}
+
+/*
+ * NUMA placement, with a fake two-node topology: CPU list parsing,
+ * hashes spread over nodes, per-node memory pools, and pinning of the
+ * pool workers.
+ */
+static void
+test_numa(void)
+{
+	phc_numa_topology topo;
+	phc_numa_env ne;
+	phc_mempool_stats mst;
+	numa_test_ctx nc[4];
+#if NUMA_PIN
+	unsigned cpus[NUMA_MAX_CPUS], num_cpus;
+#endif
+	unsigned node, u;
+	size_t total;
+
+	phc_numa_detect(&topo);
+	if (topo.num_nodes < 1) {
+		fprintf(stderr, "NUMA topology detection failure\n");
+		exit(EXIT_FAILURE);
+	}
+	for (node = 0; node < topo.num_nodes; node ++) {
+		for (u = 0; u < NUMA_MAX_CPUS; u ++) {
+			if (numa_has_cpu(&topo, node, u)) {
+				break;
+			}
+		}
+		if (u == NUMA_MAX_CPUS) {
+			fprintf(stderr, "NUMA node without CPU\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	memset(&topo, 0, sizeof topo);
+	if (numa_parse_cpulist(&topo, 1, "0-3,8,10-11\n") != 7
+		|| !numa_has_cpu(&topo, 1, 3) || numa_has_cpu(&topo, 1, 4)
+		|| !numa_has_cpu(&topo, 1, 8) || numa_has_cpu(&topo, 1, 9)
+		|| !numa_has_cpu(&topo, 1, 11) || numa_has_cpu(&topo, 0, 0))
+	{
+		fprintf(stderr, "NUMA CPU list parsing failure\n");
+		exit(EXIT_FAILURE);
+	}
+
+	phc_numa_fake(&topo, 2, 1);
+	if (!phc_numa_env_init(&ne, &topo, 1, (size_t)2 << 20)) {
+		fprintf(stderr, "NUMA environment creation failure\n");
+		exit(EXIT_FAILURE);
+	}
+#if NUMA_PIN
+	num_cpus = numa_allowed_cpus(cpus, NUMA_MAX_CPUS);
+	for (node = 0; node < 2; node ++) {
+		cpu_set_t set;
+
+		for (u = 0; u < ne.threads[node].num_threads; u ++) {
+			if (pthread_getaffinity_np(ne.threads[node].threads[u],
+				sizeof set, &set) != 0
+				|| CPU_COUNT(&set) != 1
+				|| !CPU_ISSET(cpus[node % num_cpus], &set))
+			{
+				fprintf(stderr, "NUMA worker not pinned\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+#endif
+
+	/*
+	 * Sequential hashes alternate between nodes, and each node
+	 * reuses its own matrix.
+	 */
+	nc[0].ne = &ne;
+	nc[0].id = 0;
+	numa_test_run(&nc[0]);
+	nc[0].id = 1;
+	numa_test_run(&nc[0]);
+	if (!nc[0].ok || ne.hashes[0] != 2 || ne.hashes[1] != 2) {
+		fprintf(stderr, "NUMA hash placement failure\n");
+		exit(EXIT_FAILURE);
+	}
+	for (node = 0; node < 2; node ++) {
+		phc_mempool_get_stats(&ne.memory[node], &mst);
+		if (mst.misses != 1 || mst.hits != 1) {
+			fprintf(stderr, "NUMA memory pool mismatch\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	for (u = 0; u < 4; u ++) {
+		nc[u].ne = &ne;
+		nc[u].id = (int)u + 2;
+	}
+	run_workers(numa_test_run, nc, sizeof nc[0], 4);
+	total = 0;
+	for (u = 0; u < 4; u ++) {
+		if (!nc[u].ok) {
+			fprintf(stderr, "NUMA hash mismatch\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	for (node = 0; node < 2; node ++) {
+		if (ne.active[node] != 0) {
+			fprintf(stderr, "NUMA accounting failure\n");
+			exit(EXIT_FAILURE);
+		}
+		total += ne.hashes[node];
+	}
+	if (total != 12) {
+		fprintf(stderr, "NUMA accounting failure\n");
+		exit(EXIT_FAILURE);
+	}
+	phc_numa_env_free(&ne);
+}
+
+/*
+ * Query predicate for the index test: "m < max_m or t < max_t".
+ */
+typedef struct {
+	uint32_t max_m;
+	uint32_t max_t;
+} weak_params;
+
+static int
+is_weak(void *ctx, const param_tuple *pt)
+{
+	const weak_params *wp;
+
+	wp = ctx;
+	return pt->m < wp->max_m || pt->t < wp->max_t;
+}
+
+typedef struct {
+	const uint32_t *model;
+	const weak_params *wp;
+	size_t seen;
+	int ok;
+} index_check;
+
+static int
+index_check_row(void *ctx, size_t row)
+{
+	index_check *ic;
+	uint32_t v;
+
+	ic = ctx;
+	v = ic->model[row];
+	if (v == 0 || !((v >> 8) < ic->wp->max_m
+		|| (v & 0xFF) < ic->wp->max_t))
+	{
+		ic->ok = 0;
+	}
+	ic->seen ++;
+	return 1;
+}
+
+/*
+ * Apply a pseudo-random sequence of row insertions, moves and removals
+ * to a tuple index, and compare query results with a plain array of
+ * (m, t) values (encoded as m*256+t, 0 for "no row").
+ */
+static void
+test_tuple_index(void)
+{
+	phc_tuple_index idx;
+	uint32_t *model;
+	weak_params wp;
+	index_check ic;
+	size_t n, u, expected;
+	uint32_t rnd;
+	int step;
+
+	n = 150000;
+	model = calloc(n, sizeof *model);
+	if (model == NULL) {
+		fprintf(stderr, "malloc() failed\n");
+		exit(EXIT_FAILURE);
+	}
+	phc_tuple_index_init(&idx);
+	rnd = 12345;
+	for (step = 0; step < 4; step ++) {
+		for (u = 0; u < n; u ++) {
+			param_tuple key;
+			uint32_t m, t;
+
+			rnd = rnd * 1664525u + 1013904223u;
+
+			/*
+			 * Rows with the same tuple are clustered, so that
+			 * bitmap containers get dense enough to switch
+			 * representation; each step rehashes some rows
+			 * and removes a few.
+			 */
+			if (step > 0 && (rnd >> 28) > 4) {
+				continue;
+			}
+			if (step > 0 && (rnd >> 28) == 0) {
+				phc_tuple_index_remove(&idx, u);
+				model[u] = 0;
+				continue;
+			}
+			m = 1024 << ((u >> 14) % 4 + (uint32_t)step);
+			t = 1 + ((rnd >> 20) & 1);
+			memset(&key, 0, sizeof key);
+			key.variant = 1;
+			key.m = m;
+			key.t = t;
+			key.p = 1;
+			if (!phc_tuple_index_set(&idx, u, &key)) {
+				fprintf(stderr, "Index update failure\n");
+				exit(EXIT_FAILURE);
+			}
+			model[u] = (m << 8) | t;
+		}
+
+		wp.max_m = 8192 << step;
+		wp.max_t = 2;
+		expected = 0;
+		for (u = 0; u < n; u ++) {
+			if (model[u] != 0 && ((model[u] >> 8) < wp.max_m
+				|| (model[u] & 0xFF) < wp.max_t))
+			{
+				expected ++;
+			}
+		}
+		ic.model = model;
+		ic.wp = &wp;
+		ic.seen = 0;
+		ic.ok = 1;
+		if (phc_tuple_index_count(&idx, is_weak, &wp) != expected
+			|| !phc_tuple_index_rows(&idx, is_weak, &wp,
+				index_check_row, &ic)
+			|| !ic.ok || ic.seen != expected)
+		{
+			fprintf(stderr, "Index query mismatch (step %d)\n", step);
+			exit(EXIT_FAILURE);
+		}
+	}
+	phc_tuple_index_free(&idx);
+	free(model);
+}
+
+/* ==================================================================== */
+/*
+ * Benchmarks. These are run when the program is invoked with "bench"
+ * as first argument.
+ */
+
+#define BENCH_RECORDS   ((size_t)1 << 18)
+#define BENCH_ROUNDS    20
+
+/*
+ * Get the current time, in seconds. This is wall-clock time when
+ * available (so that multi-threaded runs show their speedup), CPU time
+ * otherwise.
+ */
+static double
+bench_now(void)
+{
+#if PHC_SF_THREADS
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+#else
+	return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+/*
+ * Open a hardware counter for the calling thread that measures the cost
+ * of cache misses on demand loads: last-level cache misses of reads
+ * (the generic event excludes prefetches, which would otherwise count
+ * the misses they move ahead), or, if that event is not supported,
+ * cycles stalled in the backend. '*name' is set to the counted unit.
+ * Returned value is the counter descriptor, or -1 if no counter is
+ * available.
+ */
+static int
+bench_counter_open(const char **name)
+{
+#if PHC_SF_PERF
+	static const struct {
+		uint32_t type;
+		uint64_t config;
+		const char *name;
+	} events[] = {
+		{ PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL
+			| (PERF_COUNT_HW_CACHE_OP_READ << 8)
+			| (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+			"LLC load misses" },
+		{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_STALLED_CYCLES_BACKEND,
+			"stall cycles" }
+	};
+	struct perf_event_attr pe;
+	size_t u;
+	int fd;
+
+	for (u = 0; u < sizeof events / sizeof events[0]; u ++) {
+		memset(&pe, 0, sizeof pe);
+		pe.type = events[u].type;
+		pe.size = sizeof pe;
+		pe.config = events[u].config;
+		pe.disabled = 1;
+		pe.exclude_kernel = 1;
+		pe.exclude_hv = 1;
+		fd = (int)syscall(SYS_perf_event_open, &pe, 0, -1, -1, 0UL);
+		if (fd >= 0) {
+			*name = events[u].name;
+			return fd;
+		}
+	}
+#endif
+	*name = NULL;
+	return -1;
+}
+
+/*
+ * Reset and start a counter (no-op if fd is -1).
+ */
+static void
+bench_counter_start(int fd)
+{
+#if PHC_SF_PERF
+	if (fd >= 0) {
+		ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+#else
+	(void)fd;
+#endif
+}
+
+/*
+ * Stop a counter and return its value, or -1 if it is not available.
+ */
+static double
+bench_counter_stop(int fd)
+{
+#if PHC_SF_PERF
+	uint64_t v;
+
+	if (fd >= 0) {
+		ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+		if (read(fd, &v, sizeof v) == (ssize_t)sizeof v) {
+			return (double)v;
+		}
+	}
+#else
+	(void)fd;
+#endif
+	return -1.0;
+}
+
+/*
+ * Close a counter (no-op if fd is -1).
+ */
+static void
+bench_counter_close(int fd)
+{
+#if PHC_SF_PERF
+	if (fd >= 0) {
+		close(fd);
+	}
+#else
+	(void)fd;
+#endif
+}
+
+static void
+bench_report(const char *name, size_t num, size_t bytes, double sec)
+{
+	if (sec <= 0.0) {
+		sec = 1e-9;
+	}
+	printf("%-28s %8.2f ns/record %9.1f MB/s\n", name,
+		sec * 1e9 / (double)num, (double)bytes / sec / 1e6);
+}
+
+static void
+bench_report_rows(const char *name, size_t num, double sec)
+{
+	if (sec <= 0.0) {
+		sec = 1e-9;
+	}
+	printf("%-28s %8.2f ns/record %9.2f Mrecords/s\n", name,
+		sec * 1e9 / (double)num, (double)num / sec / 1e6);
+}
+
+/*
+ * Results of benchmarked passes are stored here, so that the passes are
+ * not optimized away.
+ */
+static volatile uint64_t bench_sink;
+
+/*
+ * Sum of the 64-bit words of a buffer (a pass that reads every byte).
+ */
+static uint64_t
+bench_sum_words(const void *buf, size_t len)
+{
+	const unsigned char *p;
+	uint64_t s, w;
+	size_t u;
+
+	p = buf;
+	s = 0;
+	for (u = 0; u + 8 <= len; u += 8) {
+		memcpy(&w, p + u, 8);
+		s += w;
+	}
+	return s;
+}
+
+/*
+ * Passes over many records, in the argon2i_params and argon2i_packed
+ * layouts. Scanning one field ("count where m < 65536") costs one cache
+ * line per record in both layouts; a pass that reads whole records
+ * (e.g. an audit of salts and outputs) moves fewer bytes with the
+ * smaller records. Results are in records per second.
+ */
+static void
+bench_packed(void)
+{
+	argon2i_params *pps;
+	argon2i_packed *pks;
+	size_t u, kat_num, count1, count2;
+	uint64_t sum;
+	const char **s;
+	double begin;
+	double sec;
+	int r;
+
+	pps = malloc(BENCH_RECORDS * sizeof *pps);
+	pks = malloc(BENCH_RECORDS * sizeof *pks);
+	if (pps == NULL || pks == NULL) {
+		fprintf(stderr, "malloc() failed\n");
+		exit(EXIT_FAILURE);
+	}
+	for (kat_num = 0; KAT_GOOD[kat_num]; kat_num ++);
+	for (u = 0; u < BENCH_RECORDS; u ++) {
+		s = &KAT_GOOD[u % kat_num];
+		argon2i_decode_string(&pps[u], *s);
+		pps[u].m = (unsigned long)(u & 0x1FFFF) + 8;
+		argon2i_pack(&pks[u], &pps[u]);
+	}
+	printf("record size: argon2i_params = %lu, argon2i_packed = %lu\n",
+		(unsigned long)sizeof *pps, (unsigned long)sizeof *pks);
+
+	count1 = 0;
+	begin = bench_now();
+	for (r = 0; r < BENCH_ROUNDS; r ++) {
+		for (u = 0; u < BENCH_RECORDS; u ++) {
+			count1 += pps[u].m < 65536;
+		}
+	}
+	sec = bench_now() - begin;
+	bench_report_rows("scan m (argon2i_params)",
+		BENCH_RECORDS * BENCH_ROUNDS, sec);
+
+	count2 = 0;
+	begin = bench_now();
+	for (r = 0; r < BENCH_ROUNDS; r ++) {
+		for (u = 0; u < BENCH_RECORDS; u ++) {
+			count2 += pks[u].m < 65536;
+		}
+	}
+	sec = bench_now() - begin;
+	bench_report_rows("scan m (argon2i_packed)",
+		BENCH_RECORDS * BENCH_ROUNDS, sec);
+
+	if (count1 != count2) {
+		fprintf(stderr, "Benchmark mismatch\n");
+		exit(EXIT_FAILURE);
+	}
+
+	sum = 0;
+	begin = bench_now();
+	for (r = 0; r < BENCH_ROUNDS; r ++) {
+		sum += bench_sum_words(pps, BENCH_RECORDS * sizeof *pps);
+	}
+	sec = bench_now() - begin;
+	bench_report_rows("read all (argon2i_params)",
+		BENCH_RECORDS * BENCH_ROUNDS, sec);
+
+	begin = bench_now();
+	for (r = 0; r < BENCH_ROUNDS; r ++) {
+		sum += bench_sum_words(pks, BENCH_RECORDS * sizeof *pks);
+	}
+	sec = bench_now() - begin;
+	bench_report_rows("read all (argon2i_packed)",
+		BENCH_RECORDS * BENCH_ROUNDS, sec);
+
+	bench_sink = sum;
+	free(pps);
+	free(pks);
+}
+
+/*
+ * Same scan as bench_packed(), over the 'm' column of a batch decoded
+ * with argon2i_decode_columns().
+ */
+static void
+bench_columns(void)
+{
+	const char **strs;
+	uint32_t *m;
+	argon2i_columns cols;
+	size_t u, kat_num, count, in_len;
+	double begin;
+	double sec;
+	int r;
+
+	strs = malloc(BENCH_RECORDS * sizeof *strs);
+	m = malloc(BENCH_RECORDS * sizeof *m);
+	if (strs == NULL || m == NULL) {
+		fprintf(stderr, "malloc() failed\n");
+		exit(EXIT_FAILURE);
+	}
+	for (kat_num = 0; KAT_GOOD[kat_num]; kat_num ++);
+	in_len = 0;
+	for (u = 0; u < BENCH_RECORDS; u ++) {
+		strs[u] = KAT_GOOD[u % kat_num];
+		in_len += strlen(strs[u]);
+	}
+	memset(&cols, 0, sizeof cols);
+	cols.m = m;
+	begin = bench_now();
+	argon2i_decode_columns(&cols, 0, strs, BENCH_RECORDS);
+	sec = bench_now() - begin;
+	bench_report("decode into columns", BENCH_RECORDS, in_len, sec);
 
-	/* value of 'p' is invalid (too large) */
-	"$argon2i$m=2000,t=5000,p=256",
+	count = 0;
+	begin = bench_now();
+	for (r = 0; r < BENCH_ROUNDS; r ++) {
+		for (u = 0; u < BENCH_RECORDS; u ++) {
+			count += m[u] < 65536;
+		}
+	}
+	sec = bench_now() - begin;
+	bench_report_rows("scan m (column)",
+		BENCH_RECORDS * BENCH_ROUNDS, sec);
+	if (count != BENCH_RECORDS * BENCH_ROUNDS) {
+		fprintf(stderr, "Benchmark mismatch\n");
+		exit(EXIT_FAILURE);
+	}
+	free(strs);
+	free(m);
+}
 
-	/* value of 'm' has non-minimal encoding */
-	"$argon2i$m=0120,t=5000,p=2",
+/*
+ * Compare one-by-one decoding with argon2_decode_batch().
+ */
+static void
+bench_batch(void)
+{
+	const char **strs;
+	size_t *lens;
+	argon2i_packed *out;
+	unsigned char *status;
+	size_t u, kat_num, in_len;
+	double begin;
+	double sec;
 
-	/* value of 't' has non-minimal encoding */
-	"$argon2i$m=120,t=05000,p=2",
+	strs = malloc(BENCH_RECORDS * sizeof *strs);
+	lens = malloc(BENCH_RECORDS * sizeof *lens);
+	out = malloc(BENCH_RECORDS * sizeof *out);
+	status = malloc(BENCH_RECORDS / 8 + 1);
+	if (strs == NULL || lens == NULL || out == NULL || status == NULL) {
+		fprintf(stderr, "malloc() failed\n");
+		exit(EXIT_FAILURE);
+	}
+	for (kat_num = 0; KAT_GOOD[kat_num]; kat_num ++);
+	in_len = 0;
+	for (u = 0; u < BENCH_RECORDS; u ++) {
+		strs[u] = KAT_GOOD[u % kat_num];
+		lens[u] = strlen(strs[u]);
+		in_len += lens[u];
+	}
 
-	/* value of 'p' has non-minimal encoding */
-	"$argon2i$m=120,t=5000,p=02",
+	begin = bench_now();
+	for (u = 0; u < BENCH_RECORDS; u ++) {
+		argon2i_params pp;
 
-	/* value of 't' exceeds 2^32-1 */
-	"$argon2i$m=120,t=4294967296,p=2",
+		if (argon2i_decode_string(&pp, strs[u])) {
+			argon2i_pack(&out[u], &pp);
+		}
+	}
+	sec = bench_now() - begin;
+	bench_report("decode one by one", BENCH_RECORDS, in_len, sec);
 
-	/* invalid Base64 for keyid (length = 9 characters) */
-	"$argon2i$m=120,t=5000,p=2,keyid=Hj5+dsK0Z",
+	begin = bench_now();
+	if (argon2_decode_batch(strs, lens, BENCH_RECORDS, out, status)
+		!= BENCH_RECORDS)
+	{
+		fprintf(stderr, "Benchmark mismatch\n");
+		exit(EXIT_FAILURE);
+	}
+	sec = bench_now() - begin;
+	bench_report("decode batch", BENCH_RECORDS, in_len, sec);
 
-	/* invalid Base64 for keyid (unprocessed bits are not 0) */
-	"$argon2i$m=120,t=5000,p=2,keyid=Hj5+dsK0ZR",
-	"$argon2i$m=120,t=5000,p=2,keyid=Hj5+dsK0ZQB",
+	free(strs);
+	free(lens);
+	free(out);
+	free(status);
+}
 
-	/* invalid keyid (too large) */
-	"$argon2i$m=120,t=5000,p=2,keyid=Mwmcv5/avkXJ",
+/*
+ * Decode a newline-separated dump with argon2i_decode_bulk(), with one
+ * and with four threads.
+ */
+static void
+bench_bulk(void)
+{
+	char *buf;
+	size_t u, kat_num, len, buf_len;
+	argon2i_bulk_stats st;
+	unsigned threads;
+	double begin;
+	double sec;
 
-	/* invalid associated data (too large) */
-	"$argon2i$m=120,t=5000,p=2,data=Vrai0ME0m7lorfxfOCG3+6we5N89+2hXwkbv0C5SECab",
+	for (kat_num = 0; KAT_GOOD[kat_num]; kat_num ++);
+	buf = malloc(BENCH_RECORDS * 200);
+	if (buf == NULL) {
+		fprintf(stderr, "malloc() failed\n");
+		exit(EXIT_FAILURE);
+	}
+	buf_len = 0;
+	for (u = 0; u < BENCH_RECORDS; u ++) {
+		len = strlen(KAT_GOOD[u % kat_num]);
+		memcpy(buf + buf_len, KAT_GOOD[u % kat_num], len);
+		buf_len += len;
+		buf[buf_len ++] = '\n';
+	}
+	for (threads = 1; threads <= 4; threads *= 4) {
+		char name[40];
 
-	/* invalid salt (too small) */
-	"$argon2i$m=120,t=5000,p=2$+yPbRi6hdw",
+		begin = bench_now();
+		if (!argon2i_decode_bulk(buf, buf_len, threads, NULL, &st)
+			|| st.status[ARGON2I_OK] != BENCH_RECORDS)
+		{
+			fprintf(stderr, "Benchmark mismatch\n");
+			exit(EXIT_FAILURE);
+		}
+		sec = bench_now() - begin;
+		sprintf(name, "bulk decode (%u thread%s)",
+			threads, threads > 1 ? "s" : "");
+		bench_report(name, BENCH_RECORDS, buf_len, sec);
+	}
+	free(buf);
+}
 
-	/* invalid salt (too large) */
-	"$argon2i$m=120,t=5000,p=2$SIZzzPhYC/CXOf64vWG/IZjO/amlRgvKscaRCYwdg9R1boFN/NjaC1VdXdcOtFx+0A",
+/*
+ * Export to CSV: decoding and formatting each record with fprintf(),
+ * compared with phc_export(). Output goes to a temporary file.
+ */
+static void
+bench_export(void)
+{
+	char *buf;
+	size_t u, v, kat_num, len, buf_len;
+	argon2i_bulk_stats st;
+	double begin;
+	FILE *fp;
 
-	/* invalid output (too small) */
-	"$argon2i$m=120,t=5000,p=2$4fXXG0spB92WPB1NitT8/OH0VKI$iHSDPHzUhPzK7rCcJgOFfg$c+jbgTK0PT0eCMI",
+	for (kat_num = 0; KAT_GOOD[kat_num]; kat_num ++);
+	buf = malloc(BENCH_RECORDS * 200);
+	fp = tmpfile();
+	if (buf == NULL || fp == NULL) {
+		fprintf(stderr, "malloc() failed\n");
+		exit(EXIT_FAILURE);
+	}
+	buf_len = 0;
+	for (u = 0; u < BENCH_RECORDS; u ++) {
+		len = strlen(KAT_GOOD[u % kat_num]);
+		memcpy(buf + buf_len, KAT_GOOD[u % kat_num], len);
+		buf_len += len;
+		buf[buf_len ++] = '\n';
+	}
 
-	/* invalid output (too large) */
-	"$argon2i$m=120,t=5000,p=2$4fXXG0spB92WPB1NitT8/OH0VKI$iHSDPHzUhPzK7rCcJgOFfg$KtTPhiUlDb98psIiNxUSZ8GYVEm1CsfEaLJrppBe5poD2/sQOUu5mmowSiQUbH+ZK3PjFdY3KUuf83bT5XqTZy0",
+	begin = bench_now();
+	for (u = 0; u < BENCH_RECORDS; u ++) {
+		argon2i_params pp;
 
-	NULL
-};
+		if (!argon2i_decode_string(&pp, KAT_GOOD[u % kat_num])) {
+			fprintf(stderr, "Benchmark mismatch\n");
+			exit(EXIT_FAILURE);
+		}
+		fprintf(fp, "%lu,%lu,%lu,%lu,", (unsigned long)u + 1,
+			pp.m, pp.t, pp.p);
+		for (v = 0; v < pp.salt_len; v ++) {
+			fprintf(fp, "%02x", pp.salt[v]);
+		}
+		fputc(',', fp);
+		for (v = 0; v < pp.output_len; v ++) {
+			fprintf(fp, "%02x", pp.output[v]);
+		}
+		fputc('\n', fp);
+	}
+	fflush(fp);
+	bench_report("export (fprintf)", BENCH_RECORDS, buf_len,
+		bench_now() - begin);
+	rewind(fp);
+
+	begin = bench_now();
+	if (!phc_export(fp, buf, buf_len, 1, 0, &st)
+		|| st.status[ARGON2I_OK] != BENCH_RECORDS || fflush(fp) != 0)
+	{
+		fprintf(stderr, "Benchmark mismatch\n");
+		exit(EXIT_FAILURE);
+	}
+	bench_report("export (1 thread)", BENCH_RECORDS, buf_len,
+		bench_now() - begin);
+	fclose(fp);
+	free(buf);
+}
+
+/*
+ * Argon2 compression function G, for each implementation: blocks per
+ * second on one core (over a 1 MB working set).
+ */
+static void
+bench_argon2_compress(void)
+{
+	argon2_compress_fn fn[2];
+	const char *name[2];
+	char tmp[40];
+	argon2_block *mem;
+	double begin, sec;
+	size_t u, n;
+	int i, num;
+
+	mem = calloc(1024, sizeof *mem);
+	if (mem == NULL) {
+		fprintf(stderr, "malloc() failed\n");
+		exit(EXIT_FAILURE);
+	}
+	for (u = 0; u < 1024 * 128; u ++) {
+		mem[u >> 7].v[u & 127] = (uint64_t)u * 0x9E3779B97F4A7C15;
+	}
+	num = 0;
+	fn[num] = argon2_compress;
+	name[num ++] = "portable";
+#if PHC_SF_AVX2
+	if (argon2_compress_select() != argon2_compress) {
+		fn[num] = argon2_compress_select();
+		name[num ++] = "avx2";
+	}
+#endif
+	n = (size_t)1 << 20;
+	for (i = 0; i < num; i ++) {
+		begin = bench_now();
+		for (u = 1; u < n; u ++) {
+			fn[i](&mem[u & 1023], &mem[(u - 1) & 1023],
+				&mem[(u * 509) & 1023], (int)(u >> 10) & 1);
+		}
+		sec = bench_now() - begin;
+		sprintf(tmp, "argon2 G (%s)", name[i]);
+		printf("%-28s %8.2f ns/block %9.0f blocks/s\n",
+			tmp, sec * 1e9 / (double)n, (double)n / sec);
+	}
+	free(mem);
+}
+
+/*
+ * Argon2 hash computation, for a few memory sizes (throughput counts
+ * the memory filled by all passes).
+ */
+static void
+bench_argon2(void)
+{
+	static const unsigned long mem[] = { 256, 4096, 65536 };
+	argon2i_params pp;
+	double begin, sec;
+	int i, n, k;
+
+	memset(&pp, 0, sizeof pp);
+	pp.t = 3;
+	pp.p = 1;
+	memset(pp.salt, 0x55, 16);
+	pp.salt_len = 16;
+	pp.output_len = 32;
+	for (i = 0; i < (int)(sizeof mem / sizeof mem[0]); i ++) {
+		pp.m = mem[i];
+		n = (int)(65536 / mem[i]) + 2;
+		begin = bench_now();
+		for (k = 0; k < n; k ++) {
+			if (!argon2_hash(&pp, ARGON2_I, "password", 8,
+				NULL, 0))
+			{
+				fprintf(stderr, "Benchmark failure\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		sec = bench_now() - begin;
+		printf("argon2i m=%-6lu t=3 p=1 %11.3f ms/hash %9.1f MB/s\n",
+			pp.m, sec * 1e3 / n,
+			(double)pp.m * 1024.0 * pp.t * n / sec / 1e6);
+	}
+}
+
+/*
+ * Argon2 with 4 lanes: lanes computed on the calling thread, then with
+ * a persistent pool (one worker per extra CPU, up to 3).
+ */
+static void
+bench_argon2_pool(void)
+{
+	argon2i_params pp;
+	phc_pool pool;
+	double begin, sec;
+	unsigned nt;
+	int k, use_pool;
+
+	nt = default_threads();
+	nt = nt > 4 ? 3 : nt - 1;
+	if (!phc_pool_init(&pool, nt)) {
+		fprintf(stderr, "Pool creation failure\n");
+		exit(EXIT_FAILURE);
+	}
+	memset(&pp, 0, sizeof pp);
+	pp.m = 16384;
+	pp.t = 3;
+	pp.p = 4;
+	memset(pp.salt, 0x55, 16);
+	pp.salt_len = 16;
+	for (use_pool = 0; use_pool <= 1; use_pool ++) {
+		char name[40];
+
+		begin = bench_now();
+		for (k = 0; k < 10; k ++) {
+			if (!argon2_hash_pool(use_pool ? &pool : NULL, &pp,
+				ARGON2_ID, "password", 8, NULL, 0))
+			{
+				fprintf(stderr, "Benchmark failure\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		sec = bench_now() - begin;
+		if (use_pool) {
+			sprintf(name, "argon2id p=4 (pool, %u)",
+				pool.num_threads);
+		} else {
+			sprintf(name, "argon2id p=4 (no pool)");
+		}
+		printf("%-28s %8.3f ms/hash\n", name, sec * 1e3 / 10);
+	}
+	phc_pool_free(&pool);
+}
+
+/*
+ * Argon2 with one pass over 64 MB, with the matrix allocated for each
+ * hash, then taken from a memory pool.
+ */
+static void
+bench_argon2_mempool(void)
+{
+	argon2i_params pp;
+	phc_mempool mp;
+	argon2_env env;
+	double begin, sec;
+	int k, use_pool;
+
+	if (!phc_mempool_init(&mp, (size_t)256 << 20)) {
+		fprintf(stderr, "Memory pool creation failure\n");
+		exit(EXIT_FAILURE);
+	}
+	env.threads = NULL;
+	env.memory = &mp;
+	env.admission = NULL;
+	env.addresses = NULL;
+	env.prefetch = 0;
+	memset(&pp, 0, sizeof pp);
+	pp.m = 65536;
+	pp.t = 1;
+	pp.p = 1;
+	memset(pp.salt, 0x55, 16);
+	pp.salt_len = 16;
+	for (use_pool = 0; use_pool <= 1; use_pool ++) {
+		begin = bench_now();
+		for (k = 0; k < 5; k ++) {
+			if (!argon2_hash_env(use_pool ? &env : NULL, &pp,
+				ARGON2_ID, "password", 8, NULL, 0))
+			{
+				fprintf(stderr, "Benchmark failure\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		sec = bench_now() - begin;
+		printf("%-28s %8.3f ms/hash\n", use_pool
+			? "argon2id m=64M t=1 (pool)" : "argon2id m=64M t=1 (malloc)",
+			sec * 1e3 / 5);
+	}
+	phc_mempool_free(&mp);
+}
+
+/*
+ * Small hashes (as used for API tokens), one at a time and in batches
+ * of ARGON2_MULTI_MAX.
+ */
+static void
+bench_argon2_multi(void)
+{
+	static const unsigned long mem[] = { 64, 256, 1024 };
+	argon2i_params pp[ARGON2_MULTI_MAX];
+	const void *pwd[ARGON2_MULTI_MAX];
+	size_t pwd_len[ARGON2_MULTI_MAX];
+	char tmp[40];
+	double begin, sec[2];
+	int i, j, k, n;
+
+	for (i = 0; i < (int)(sizeof mem / sizeof mem[0]); i ++) {
+		for (j = 0; j < ARGON2_MULTI_MAX; j ++) {
+			memset(&pp[j], 0, sizeof pp[j]);
+			pp[j].m = mem[i];
+			pp[j].t = 1;
+			pp[j].p = 1;
+			memset(pp[j].salt, 0x55 + j, 16);
+			pp[j].salt_len = 16;
+			pwd[j] = "password";
+			pwd_len[j] = 8;
+		}
+		n = (int)(65536 / mem[i]);
+		begin = bench_now();
+		for (k = 0; k < n; k ++) {
+			for (j = 0; j < ARGON2_MULTI_MAX; j ++) {
+				if (!argon2_hash(&pp[j], ARGON2_ID,
+					pwd[j], pwd_len[j], NULL, 0))
+				{
+					fprintf(stderr, "Benchmark failure\n");
+					exit(EXIT_FAILURE);
+				}
+			}
+		}
+		sec[0] = bench_now() - begin;
+		begin = bench_now();
+		for (k = 0; k < n; k ++) {
+			if (argon2_hash_multi(pp, pwd, pwd_len,
+				ARGON2_MULTI_MAX, ARGON2_ID, NULL)
+				!= ARGON2_MULTI_MAX)
+			{
+				fprintf(stderr, "Benchmark failure\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		sec[1] = bench_now() - begin;
+		for (j = 0; j < 2; j ++) {
+			sprintf(tmp, "argon2id m=%luk t=1 (%s)", mem[i],
+				j == 0 ? "single" : "batch");
+			printf("%-28s %8.2f us/hash %9.0f hashes/s\n", tmp,
+				sec[j] * 1e6 / (n * ARGON2_MULTI_MAX),
+				(n * ARGON2_MULTI_MAX) / sec[j]);
+		}
+	}
+}
+
+/*
+ * Argon2i hashes with addresses generated by each hash, and taken from
+ * a cache of reference indices.
+ */
+static void
+bench_argon2_addr_cache(void)
+{
+	static const unsigned long mem[] = { 256, 4096 };
+	argon2i_params pp;
+	phc_addr_cache cache;
+	argon2_env env;
+	char tmp[40];
+	double begin, sec;
+	int i, k, n, use_cache;
+
+	if (!phc_addr_cache_init(&cache, (size_t)16 << 20)) {
+		fprintf(stderr, "Address cache creation failure\n");
+		exit(EXIT_FAILURE);
+	}
+	env.threads = NULL;
+	env.memory = NULL;
+	env.admission = NULL;
+	env.addresses = &cache;
+	env.prefetch = 0;
+	memset(&pp, 0, sizeof pp);
+	pp.t = 3;
+	pp.p = 1;
+	memset(pp.salt, 0x55, 16);
+	pp.salt_len = 16;
+	for (i = 0; i < (int)(sizeof mem / sizeof mem[0]); i ++) {
+		pp.m = mem[i];
+		n = (int)(16384 / mem[i]) + 2;
+		for (use_cache = 0; use_cache <= 1; use_cache ++) {
+			argon2_hash_env(use_cache ? &env : NULL, &pp,
+				ARGON2_I, "password", 8, NULL, 0);
+			begin = bench_now();
+			for (k = 0; k < n; k ++) {
+				if (!argon2_hash_env(use_cache ? &env : NULL,
+					&pp, ARGON2_I, "password", 8, NULL, 0))
+				{
+					fprintf(stderr, "Benchmark failure\n");
+					exit(EXIT_FAILURE);
+				}
+			}
+			sec = bench_now() - begin;
+			sprintf(tmp, "argon2i m=%luk t=3 (%s)", mem[i],
+				use_cache ? "cached" : "generated");
+			printf("%-28s %8.3f ms/hash\n", tmp, sec * 1e3 / n);
+		}
+	}
+	phc_addr_cache_free(&cache);
+}
+
+/*
+ * Argon2i hashes with reference blocks prefetched at various distances
+ * (the first one without prefetching). Time per hash and, when it can
+ * be measured, the demand miss counter per block (see
+ * bench_counter_open()) are reported along with their change relative
+ * to the run without prefetching. The matrix is made large enough not
+ * to fit in the caches of most systems.
+ */
+static void
+bench_argon2_prefetch(void)
+{
+	static const uint32_t dist[] = {
+		ARGON2_PREFETCH_NONE, 1, 2, 4, 8, 16
+	};
+	argon2i_params pp;
+	argon2_env env;
+	const char *unit;
+	char tmp[40];
+	double begin, sec, events, base_sec, base_events;
+	int j, k, n, fd;
+
+	fd = bench_counter_open(&unit);
+	env.threads = NULL;
+	env.memory = NULL;
+	env.admission = NULL;
+	env.addresses = NULL;
+	memset(&pp, 0, sizeof pp);
+	pp.m = 262144;
+	pp.t = 1;
+	pp.p = 1;
+	memset(pp.salt, 0x55, 16);
+	pp.salt_len = 16;
+	n = 3;
+	base_sec = 0.0;
+	base_events = 0.0;
+	for (j = 0; j < (int)(sizeof dist / sizeof dist[0]); j ++) {
+		env.prefetch = dist[j];
+		bench_counter_start(fd);
+		begin = bench_now();
+		for (k = 0; k < n; k ++) {
+			if (!argon2_hash_env(&env, &pp, ARGON2_I,
+				"password", 8, NULL, 0))
+			{
+				fprintf(stderr, "Benchmark failure\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		sec = (bench_now() - begin) / n;
+		events = bench_counter_stop(fd) / ((double)n * pp.m);
+		if (j == 0) {
+			base_sec = sec;
+			base_events = events;
+			strcpy(tmp, "argon2i m=256M no prefetch");
+		} else {
+			sprintf(tmp, "argon2i m=256M prefetch=%lu",
+				(unsigned long)dist[j]);
+		}
+		printf("%-28s %8.3f ms/hash %+6.1f%%", tmp, sec * 1e3,
+			(sec / base_sec - 1.0) * 100.0);
+		if (unit != NULL && events >= 0 && base_events > 0) {
+			printf(" %9.3f %s/block %+6.1f%%", events, unit,
+				(events / base_events - 1.0) * 100.0);
+		}
+		printf("\n");
+	}
+	bench_counter_close(fd);
+}
+
+static void
+run_benchmarks(void)
+{
+	bench_packed();
+	bench_columns();
+	bench_batch();
+	bench_bulk();
+	bench_export();
+	bench_argon2_compress();
+	bench_argon2();
+	bench_argon2_pool();
+	bench_argon2_mempool();
+	bench_argon2_multi();
+	bench_argon2_addr_cache();
+	bench_argon2_prefetch();
+}
+
+/* ==================================================================== */
+
+/*
+ * Dump scanner command-line tool.
+ */
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+"usage: phc-sf-parse                     run self-tests\n"
+"       phc-sf-parse bench               run benchmarks\n"
+"       phc-sf-parse scan [-j N] [-s] file\n"
+"                                        validate and summarize a file of\n"
+"                                        hash strings (one per line); with\n"
+"                                        -s, stream the file instead of\n"
+"                                        mapping it\n"
+"       phc-sf-parse stats [-j N] [-f csv|json] file\n"
+"                                        count Argon2 strings per parameter\n"
+"                                        tuple (default output: CSV)\n"
+"       phc-sf-parse salts [-j N] file   report reused and short salts\n"
+"       phc-sf-parse export [-j N] [-f csv|json] file\n"
+"                                        write the valid Argon2i strings\n"
+"                                        as CSV or JSON lines, with hex\n"
+"                                        binary fields\n"
+"       phc-sf-parse diff [-j N] old new compare two files of key:hash\n"
+"                                        lines\n");
+	exit(EXIT_FAILURE);
+}
+
+static void
+scan_print(const phc_scan_result *r)
+{
+	param_tuple *tp;
+	size_t u, n;
+	int e;
+
+	printf("rows: %lu\n", (unsigned long)r->st.rows);
+	printf("valid argon2i: %lu\n",
+		(unsigned long)r->st.status[ARGON2I_OK]);
+	printf("algorithms:\n");
+	for (u = 0; u < r->num_algs; u ++) {
+		printf("  %-24s %lu\n", r->algs[u].name,
+			(unsigned long)r->algs[u].count);
+	}
+	printf("argon2i parameters:\n");
+	tp = param_table_sorted(&r->params, &n);
+	if (tp == NULL) {
+		fprintf(stderr, "malloc() failed\n");
+		exit(EXIT_FAILURE);
+	}
+	for (u = 0; u < n; u ++) {
+		char tmp[50];
+
+		sprintf(tmp, "m=%lu,t=%lu,p=%lu",
+			(unsigned long)tp[u].m, (unsigned long)tp[u].t,
+			(unsigned long)tp[u].p);
+		printf("  %-24s %lu\n", tmp, (unsigned long)tp[u].count);
+	}
+	free(tp);
+	printf("errors:\n");
+	for (e = 1; e < ARGON2I_ERR_NUM; e ++) {
+		if (r->st.status[e] == 0) {
+			continue;
+		}
+		printf("  %-10s %lu (line%s", argon2i_error_name(e),
+			(unsigned long)r->st.status[e],
+			r->num_samples[e] > 1 ? "s" : "");
+		for (u = 0; u < r->num_samples[e]; u ++) {
+			printf("%s %lu", u == 0 ? "" : ",",
+				(unsigned long)r->samples[e][u]);
+		}
+		printf("%s)\n", r->st.status[e] > r->num_samples[e]
+			? ", ..." : "");
+	}
+}
+
+/*
+ * "scan" command. Exit status is 0 if all lines are valid Argon2i hash
+ * strings, 1 if some are not, 2 on error.
+ */
+static int
+scan_main(int argc, char *argv[])
+{
+	unsigned threads;
+	const char *name;
+	phc_file f;
+	phc_scan_result r;
+	int i, stream;
+
+	threads = default_threads();
+	name = NULL;
+	stream = 0;
+	for (i = 2; i < argc; i ++) {
+		if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+			threads = (unsigned)strtoul(argv[++ i], NULL, 10);
+		} else if (strcmp(argv[i], "-s") == 0) {
+			stream = 1;
+		} else if (name == NULL) {
+			name = argv[i];
+		} else {
+			usage();
+		}
+	}
+	if (name == NULL) {
+		usage();
+	}
+	if (stream) {
+		if (!phc_scan_stream(name, (size_t)8 << 20, threads, &r)) {
+			fprintf(stderr, "cannot scan file: %s\n", name);
+			return 2;
+		}
+		scan_print(&r);
+		i = r.st.status[ARGON2I_OK] != r.st.rows;
+		phc_scan_free(&r);
+		return i;
+	}
+	if (!phc_file_open(&f, name)) {
+		fprintf(stderr, "cannot read file: %s\n", name);
+		return 2;
+	}
+	if (!phc_scan(f.buf, f.len, threads, &r)) {
+		fprintf(stderr, "out of memory\n");
+		phc_file_close(&f);
+		return 2;
+	}
+	phc_file_close(&f);
+	scan_print(&r);
+	i = r.st.status[ARGON2I_OK] != r.st.rows;
+	phc_scan_free(&r);
+	return i;
+}
+
+/*
+ * "stats" command: parameter histogram of a file of hash strings.
+ */
+static int
+stats_main(int argc, char *argv[])
+{
+	unsigned threads;
+	const char *name;
+	phc_file f;
+	phc_param_stats ps;
+	int i, json;
+
+	threads = default_threads();
+	name = NULL;
+	json = 0;
+	for (i = 2; i < argc; i ++) {
+		if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+			threads = (unsigned)strtoul(argv[++ i], NULL, 10);
+		} else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+			i ++;
+			if (strcmp(argv[i], "json") == 0) {
+				json = 1;
+			} else if (strcmp(argv[i], "csv") == 0) {
+				json = 0;
+			} else {
+				usage();
+			}
+		} else if (name == NULL) {
+			name = argv[i];
+		} else {
+			usage();
+		}
+	}
+	if (name == NULL) {
+		usage();
+	}
+	if (!phc_file_open(&f, name)) {
+		fprintf(stderr, "cannot read file: %s\n", name);
+		return 2;
+	}
+	i = phc_param_stats_build(f.buf, f.len, threads, &ps);
+	phc_file_close(&f);
+	if (!i) {
+		fprintf(stderr, "out of memory\n");
+		return 2;
+	}
+	i = phc_param_stats_write(stdout, &ps, json);
+	phc_param_stats_free(&ps);
+	return i ? 0 : 2;
+}
+
+static void
+print_samples(const size_t *samples, size_t num, size_t count)
+{
+	size_t u;
+
+	if (num == 0) {
+		printf("\n");
+		return;
+	}
+	printf(" (line%s", num > 1 ? "s" : "");
+	for (u = 0; u < num; u ++) {
+		printf("%s %lu", u == 0 ? "" : ",", (unsigned long)samples[u]);
+	}
+	printf("%s)\n", count > num ? ", ..." : "");
+}
+
+/*
+ * "salts" command. Exit status is 0 if no salt is reused or short, 1
+ * otherwise, 2 on error.
+ */
+static int
+salts_main(int argc, char *argv[])
+{
+	unsigned threads;
+	const char *name;
+	phc_file f;
+	phc_salt_report r;
+	int i;
+
+	threads = default_threads();
+	name = NULL;
+	for (i = 2; i < argc; i ++) {
+		if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+			threads = (unsigned)strtoul(argv[++ i], NULL, 10);
+		} else if (name == NULL) {
+			name = argv[i];
+		} else {
+			usage();
+		}
+	}
+	if (name == NULL) {
+		usage();
+	}
+	if (!phc_file_open(&f, name)) {
+		fprintf(stderr, "cannot read file: %s\n", name);
+		return 2;
+	}
+	i = phc_salt_check(f.buf, f.len, threads, &r);
+	phc_file_close(&f);
+	if (!i) {
+		fprintf(stderr, "out of memory\n");
+		return 2;
+	}
+	printf("rows: %lu\n", (unsigned long)r.rows);
+	printf("rows without salt: %lu\n", (unsigned long)r.no_salt);
+	printf("short salts (< %d bytes): %lu", SALT_MIN_LEN,
+		(unsigned long)r.short_salts);
+	print_samples(r.short_samples, r.num_short_samples,
+		r.short_salts);
+	printf("reused salts: %lu\n", (unsigned long)r.dup_salts);
+	printf("rows reusing a salt: %lu", (unsigned long)r.dup_rows);
+	print_samples(r.dup_samples, r.num_dup_samples, r.dup_rows);
+	return r.short_salts != 0 || r.dup_rows != 0;
+}
+
+/*
+ * "export" command: decoded records of a file of hash strings, on
+ * standard output. The number of skipped (invalid) lines is printed on
+ * standard error.
+ */
+static int
+export_main(int argc, char *argv[])
+{
+	unsigned threads;
+	const char *name;
+	phc_file f;
+	argon2i_bulk_stats st;
+	int i, json;
+
+	threads = default_threads();
+	name = NULL;
+	json = 0;
+	for (i = 2; i < argc; i ++) {
+		if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+			threads = (unsigned)strtoul(argv[++ i], NULL, 10);
+		} else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+			i ++;
+			if (strcmp(argv[i], "json") == 0) {
+				json = 1;
+			} else if (strcmp(argv[i], "csv") == 0) {
+				json = 0;
+			} else {
+				usage();
+			}
+		} else if (name == NULL) {
+			name = argv[i];
+		} else {
+			usage();
+		}
+	}
+	if (name == NULL) {
+		usage();
+	}
+	if (!phc_file_open(&f, name)) {
+		fprintf(stderr, "cannot read file: %s\n", name);
+		return 2;
+	}
+	i = phc_export(stdout, f.buf, f.len, threads, json, &st);
+	phc_file_close(&f);
+	if (!i || fflush(stdout) != 0) {
+		fprintf(stderr, "export failed\n");
+		return 2;
+	}
+	if (st.status[ARGON2I_OK] != st.rows) {
+		fprintf(stderr, "skipped %lu invalid line(s)\n",
+			(unsigned long)(st.rows - st.status[ARGON2I_OK]));
+	}
+	return 0;
+}
+
+/*
+ * "diff" command. Exit status is 0 if the files have the same rows, 1
+ * if they differ, 2 on error.
+ */
+static int
+diff_main(int argc, char *argv[])
+{
+	static const char *const kind_names[DIFF_NUM] = {
+		"added", "removed", "parameters changed", "output changed"
+	};
+	unsigned threads;
+	const char *names[2];
+	phc_file f[2];
+	phc_diff_result r;
+	int i, k, num;
+
+	threads = default_threads();
+	num = 0;
+	for (i = 2; i < argc; i ++) {
+		if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+			threads = (unsigned)strtoul(argv[++ i], NULL, 10);
+		} else if (num < 2) {
+			names[num ++] = argv[i];
+		} else {
+			usage();
+		}
+	}
+	if (num != 2) {
+		usage();
+	}
+	for (k = 0; k < 2; k ++) {
+		if (!phc_file_open(&f[k], names[k])) {
+			fprintf(stderr, "cannot read file: %s\n", names[k]);
+			if (k > 0) {
+				phc_file_close(&f[0]);
+			}
+			return 2;
+		}
+	}
+	i = phc_diff(f[0].buf, f[0].len, f[1].buf, f[1].len, threads, &r);
+	phc_file_close(&f[0]);
+	phc_file_close(&f[1]);
+	if (!i) {
+		fprintf(stderr, "out of memory\n");
+		return 2;
+	}
+	printf("rows: %lu (old), %lu (new)\n",
+		(unsigned long)r.old_rows, (unsigned long)r.new_rows);
+	printf("invalid rows: %lu (old), %lu (new)\n",
+		(unsigned long)r.old_invalid, (unsigned long)r.new_invalid);
+	printf("duplicate keys: %lu\n", (unsigned long)r.dup_keys);
+	printf("unchanged: %lu\n", (unsigned long)r.unchanged);
+	i = 0;
+	for (k = 0; k < DIFF_NUM; k ++) {
+		printf("%s: %lu", kind_names[k], (unsigned long)r.count[k]);
+		print_samples(r.samples[k], r.num_samples[k], r.count[k]);
+		i |= r.count[k] != 0;
+	}
+	return i;
+}
 
 int
-main(void)
+main(int argc, char *argv[])
 {
 	const char **s;
 
+	if (argc >= 2) {
+		if (strcmp(argv[1], "bench") == 0) {
+			run_benchmarks();
+			return 0;
+		}
+		if (strcmp(argv[1], "scan") == 0) {
+			return scan_main(argc, argv);
+		}
+		if (strcmp(argv[1], "stats") == 0) {
+			return stats_main(argc, argv);
+		}
+		if (strcmp(argv[1], "salts") == 0) {
+			return salts_main(argc, argv);
+		}
+		if (strcmp(argv[1], "export") == 0) {
+			return export_main(argc, argv);
+		}
+		if (strcmp(argv[1], "diff") == 0) {
+			return diff_main(argc, argv);
+		}
+		usage();
+	}
+
 	for (s = KAT_GOOD; *s; s ++) {
 		const char *str;
 		argon2i_params pp;
+		argon2i_encoder enc;
 		char tmp[300];
 		size_t len;
 
@@ -579,8 +12090,47 @@ main(void)
 			fprintf(stderr, "Encode failure (2): %s\n", str);
 			exit(EXIT_FAILURE);
 		}
+		if (!argon2i_encoder_init(&enc, &pp)
+			|| !argon2i_encoder_encode(&enc, tmp, len + 1,
+			pp.salt, pp.salt_len, pp.output, pp.output_len)
+			|| strcmp(str, tmp) != 0)
+		{
+			fprintf(stderr, "Compiled encoder failure (1): %s\n",
+				str);
+			exit(EXIT_FAILURE);
+		}
+		if (argon2i_encoder_encode(&enc, tmp, len,
+			pp.salt, pp.salt_len, pp.output, pp.output_len))
+		{
+			fprintf(stderr, "Compiled encoder failure (2): %s\n",
+				str);
+			exit(EXIT_FAILURE);
+		}
 	}
 
+	test_cost_limits();
+	test_arena();
+	test_packed();
+	test_blob();
+	test_columns();
+	test_batch();
+	test_bulk();
+	test_scan();
+	test_param_stats();
+	test_store();
+	test_tuple_index();
+	test_salt_check();
+	test_export();
+	test_diff();
+	test_argon2();
+	test_argon2_multi();
+	test_argon2_pool();
+	test_mempool();
+	test_addr_cache();
+	test_prefetch();
+	test_admission();
+	test_numa();
+
 	for (s = KAT_BAD; *s; s ++) {
 		const char *str;
 		argon2i_params pp;